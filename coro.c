@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "coro.h"
+#include "wheel.h"
+
+#define MAX_EVENTS 64
+
+/* ASan keeps its own idea of the current stack; tell it about every
+   switch, or it reports false stack-buffer errors on coroutine stacks */
+#if defined(__SANITIZE_ADDRESS__)
+#define CORO_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define CORO_ASAN 1
+#endif
+#endif
+
+#ifdef CORO_ASAN
+#include <sanitizer/common_interface_defs.h>
+#include <sanitizer/asan_interface.h>
+#define switch_begin(save, bottom, size) \
+    __sanitizer_start_switch_fiber((save), (bottom), (size))
+#define switch_end(save, bottom, size) \
+    __sanitizer_finish_switch_fiber((save), (bottom), (size))
+#define stack_reset(p, size) __asan_unpoison_memory_region((p), (size))
+#else
+#define switch_begin(save, bottom, size) ((void)(save))
+#define switch_end(save, bottom, size) ((void)(save))
+#define stack_reset(p, size) ((void)0)
+#endif
+
+typedef struct sched sched_t;
+
+typedef struct coro {
+    ucontext_t ctx;
+    char *stack;               /* usable stack, above the guard page */
+    void (*fn)(void *);
+    void (*refuse)(void *);    /* called instead of fn if no stack */
+    void *arg;
+    sched_t *sched;
+    void *fake_stack;          /* ASan bookkeeping across switches */
+    int waiting;               /* parked in coro_poll */
+    int timed_out;
+    wheel_timer_t timer;       /* coro_poll timeout, if any */
+    struct coro *next;         /* inbox, run queue or stack pool */
+} coro_t;
+
+struct sched {
+    int epfd;
+    int wake_fd;
+    coro_t *inbox;             /* lock-free stack of new coroutines */
+    coro_t *run_head;
+    coro_t *run_tail;
+    wheel_t timers;            /* coro_poll timeouts */
+    coro_t *pool;              /* finished coroutines, stacks kept */
+    ucontext_t main_ctx;
+    const void *main_bottom;   /* scheduler stack, for ASan */
+    size_t main_size;
+};
+
+static sched_t *scheds;
+static int sched_count = 1;
+static size_t stack_size = DEFAULT_CORO_STACK;
+static size_t page_size;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static int start_failed;
+static unsigned next_sched;
+static int live;
+static int stacks;
+
+static __thread sched_t *this_sched;
+static __thread coro_t *this_coro;
+
+static char wake_tag;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void coro_init(int threads, size_t size) {
+    long ps = sysconf(_SC_PAGESIZE);
+    page_size = (ps > 0) ? (size_t)ps : 4096;
+    sched_count = (threads < 1) ? 1 : threads;
+    if (size < page_size) size = page_size;
+    stack_size = (size + page_size - 1) / page_size * page_size;
+}
+
+size_t coro_session_bytes(void) {
+    return stack_size + page_size + sizeof(coro_t);
+}
+
+int coro_live(void) {
+    return __atomic_load_n(&live, __ATOMIC_RELAXED);
+}
+
+int coro_stacks(void) {
+    return __atomic_load_n(&stacks, __ATOMIC_RELAXED);
+}
+
+/* --------------------------
+   Scheduler
+   -------------------------- */
+
+static void run_push(sched_t *s, coro_t *c) {
+    c->next = NULL;
+    if (s->run_tail) s->run_tail->next = c;
+    else s->run_head = c;
+    s->run_tail = c;
+}
+
+/* a parked coroutine's fd fired or its timeout passed */
+static void wake(sched_t *s, coro_t *c, int timed_out) {
+    if (!c->waiting) return;
+    c->waiting = 0;
+    c->timed_out = timed_out;
+    wheel_cancel(&c->timer);
+    run_push(s, c);
+}
+
+static void on_timer(wheel_timer_t *t, void *ctx) {
+    wake(ctx, (coro_t *)((char *)t - offsetof(coro_t, timer)), 1);
+}
+
+static void coro_entry(void) {
+    sched_t *s = this_sched;
+    coro_t *c = this_coro;
+    switch_end(NULL, &s->main_bottom, &s->main_size);
+
+    c->fn(c->arg);
+
+    /* finished: back to the scheduler for good (NULL tells ASan this
+       stack's frames are gone) */
+    switch_begin(NULL, s->main_bottom, s->main_size);
+    setcontext(&s->main_ctx);
+}
+
+/* give a new coroutine a stack (pooled if possible) and a context */
+static int coro_prepare(sched_t *s, coro_t *c) {
+    coro_t *pooled = s->pool;
+    if (pooled) {
+        s->pool = pooled->next;
+        c->stack = pooled->stack;
+        free(pooled);
+        stack_reset(c->stack, stack_size);
+    } else {
+        char *p = mmap(NULL, stack_size + page_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (p == MAP_FAILED) return -1;
+        /* guard page: an overflow faults instead of corrupting memory */
+        mprotect(p, page_size, PROT_NONE);
+        c->stack = p + page_size;
+        __atomic_fetch_add(&stacks, 1, __ATOMIC_RELAXED);
+    }
+
+    getcontext(&c->ctx);
+    c->ctx.uc_stack.ss_sp = c->stack;
+    c->ctx.uc_stack.ss_size = stack_size;
+    c->ctx.uc_link = NULL;
+    makecontext(&c->ctx, coro_entry, 0);
+    return 0;
+}
+
+/* run c until it parks or finishes */
+static void coro_resume(sched_t *s, coro_t *c) {
+    void *fake = NULL;
+    this_coro = c;
+    switch_begin(&fake, c->stack, stack_size);
+    swapcontext(&s->main_ctx, &c->ctx);
+    switch_end(fake, NULL, NULL);
+    this_coro = NULL;
+
+    if (!c->waiting) {
+        /* finished; keep its stack for the next coroutine */
+        c->next = s->pool;
+        s->pool = c;
+        __atomic_fetch_sub(&live, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void on_wake(sched_t *s) {
+    uint64_t count;
+    (void)read(s->wake_fd, &count, sizeof(count));
+
+    coro_t *stack = __atomic_exchange_n(&s->inbox, NULL, __ATOMIC_ACQUIRE);
+    coro_t *list = NULL;
+    while (stack) {
+        coro_t *c = stack;
+        stack = c->next;
+        c->next = list;
+        list = c;
+    }
+    while (list) {
+        coro_t *c = list;
+        list = c->next;
+        if (coro_prepare(s, c) != 0) {
+            /* no stack: running fn here would stall every coroutine on
+               this scheduler for as long as it runs, so turn it away */
+            perror("mmap");
+            c->refuse(c->arg);
+            free(c);
+            __atomic_fetch_sub(&live, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        run_push(s, c);
+    }
+}
+
+/* wake coroutines whose timeout has passed; returns the epoll_wait
+   timeout until the next one (-1 if none) */
+static int expire_timers(sched_t *s) {
+    long long now = now_ms();
+    wheel_advance(&s->timers, now, s);
+    return wheel_timeout(&s->timers, now);
+}
+
+static void *sched_run(void *arg) {
+    sched_t *s = arg;
+    this_sched = s;
+
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        while (s->run_head) {
+            coro_t *c = s->run_head;
+            s->run_head = c->next;
+            if (!s->run_head) s->run_tail = NULL;
+            coro_resume(s, c);
+        }
+
+        int timeout = expire_timers(s);
+        if (s->run_head) continue;
+
+        int n = epoll_wait(s->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &wake_tag) {
+                on_wake(s);
+            } else {
+                wake(s, events[i].data.ptr, 0);
+            }
+        }
+    }
+}
+
+static void start_scheds(void) {
+    if (page_size == 0) coro_init(sched_count, stack_size);
+
+    scheds = calloc((size_t)sched_count, sizeof(*scheds));
+    if (!scheds) {
+        start_failed = 1;
+        return;
+    }
+    for (int i = 0; i < sched_count; i++) {
+        sched_t *s = &scheds[i];
+        wheel_init(&s->timers, now_ms());
+        s->epfd = epoll_create1(EPOLL_CLOEXEC);
+        s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wake_tag;
+        pthread_t tid;
+        if (s->epfd < 0 || s->wake_fd < 0
+            || epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wake_fd, &ev) < 0
+            || pthread_create(&tid, NULL, sched_run, s) != 0) {
+            perror("coro scheduler");
+            start_failed = 1;
+            return;
+        }
+        pthread_detach(tid);
+    }
+}
+
+int coro_spawn(void (*fn)(void *), void (*refuse)(void *), void *arg) {
+    pthread_once(&start_once, start_scheds);
+    if (start_failed) return -1;
+
+    coro_t *c = calloc(1, sizeof(*c));
+    if (!c) return -1;
+    c->fn = fn;
+    c->refuse = refuse;
+    c->arg = arg;
+    wheel_timer_init(&c->timer, on_timer);
+
+    unsigned i = __atomic_fetch_add(&next_sched, 1, __ATOMIC_RELAXED);
+    sched_t *s = &scheds[i % (unsigned)sched_count];
+    c->sched = s;
+    __atomic_fetch_add(&live, 1, __ATOMIC_RELAXED);
+
+    coro_t *head = __atomic_load_n(&s->inbox, __ATOMIC_RELAXED);
+    do {
+        c->next = head;
+    } while (!__atomic_compare_exchange_n(&s->inbox, &head, c, 1,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+    uint64_t one = 1;
+    (void)write(s->wake_fd, &one, sizeof(one));
+    return 0;
+}
+
+/* --------------------------
+   Blocking calls
+   -------------------------- */
+
+/* arm fd in the scheduler's epoll set for one wakeup of c. Sessions
+   keep their fds, so the registration is made once and re-armed with
+   EPOLL_CTL_MOD afterwards; closing the fd removes it. */
+static int arm_fd(sched_t *s, coro_t *c, const struct pollfd *p) {
+    struct epoll_event ev;
+    ev.events = EPOLLONESHOT;
+    if (p->events & POLLIN) ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (p->events & POLLOUT) ev.events |= EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, p->fd, &ev) == 0) return 0;
+    if (errno != ENOENT) return -1;
+    return epoll_ctl(s->epfd, EPOLL_CTL_ADD, p->fd, &ev);
+}
+
+int coro_poll(struct pollfd *fds, nfds_t nfds, int timeout_ms) {
+    coro_t *c = this_coro;
+    if (!c) {
+        return poll(fds, nfds, timeout_ms);
+    }
+    sched_t *s = c->sched;
+    long long deadline = (timeout_ms < 0) ? -1 : now_ms() + timeout_ms;
+
+    for (;;) {
+        int rc = poll(fds, nfds, 0);
+        if (rc != 0 || timeout_ms == 0) return rc;
+
+        for (nfds_t i = 0; i < nfds; i++) {
+            if (arm_fd(s, c, &fds[i]) != 0) return -1;
+        }
+        c->waiting = 1;
+        c->timed_out = 0;
+        if (deadline >= 0) wheel_arm(&s->timers, &c->timer, deadline);
+
+        switch_begin(&c->fake_stack, s->main_bottom, s->main_size);
+        swapcontext(&c->ctx, &s->main_ctx);
+        switch_end(c->fake_stack, &s->main_bottom, &s->main_size);
+
+        if (c->timed_out) {
+            return poll(fds, nfds, 0);
+        }
+        /* woken by one fd; the other may still be armed, which at
+           worst causes one spurious wakeup that loops back here */
+    }
+}
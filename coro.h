@@ -0,0 +1,39 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+#include <poll.h>
+
+// Stackful coroutines on a few scheduler threads. Code written as
+// straight-line blocking I/O (run_game) runs unchanged as a coroutine:
+// coro_poll() parks the coroutine in its scheduler's epoll set instead
+// of blocking the thread. Each coroutine runs on a small fixed stack
+// taken from a per-scheduler pool, so a session costs coro_session_bytes()
+// rather than a whole pthread stack.
+
+#define DEFAULT_CORO_STACK 65536   // bytes of stack per coroutine
+
+// Set the scheduler thread count and per-coroutine stack size (rounded
+// up to whole pages). The threads start on the first coro_spawn, so
+// they inherit that thread's signal mask.
+void coro_init(int threads, size_t stack_size);
+
+// Run fn(arg) as a coroutine on one of the schedulers; returns 0, or
+// -1 if the schedulers could not be started. If the scheduler cannot
+// get a stack for it, refuse(arg) is called there instead; it must not
+// block.
+int coro_spawn(void (*fn)(void *), void (*refuse)(void *), void *arg);
+
+// poll(2) that yields to the scheduler instead of blocking when called
+// from a coroutine; a plain poll() anywhere else
+int coro_poll(struct pollfd *fds, nfds_t nfds, int timeout_ms);
+
+// Memory charged to one coroutine: its stack, guard page and context
+size_t coro_session_bytes(void);
+
+// Coroutines currently running, and stacks allocated for them
+// (live plus pooled for reuse)
+int coro_live(void);
+int coro_stacks(void);
+
+#endif
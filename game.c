@@ -1,32 +1,233 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include "game.h"
+#include "rules.h"
+
+static const uint32_t classic_start[] = {1, 3, 5, 7, 9};
+static const game_layout_t classic = {
+    .piles = 5,
+    .start = classic_start,
+    .board_cap = sizeof("1 3 5 7 9"),
+    .rules = NULL,
+};
+
+const game_layout_t *game_default_layout(void) {
+    return &classic;
+}
+
+// number of decimal digits in a non-negative count
+static int digits(uint32_t v) {
+    int n = 1;
+    while (v >= 10) {
+        v /= 10;
+        n++;
+    }
+    return n;
+}
+
+// write v as exactly width digits at p
+static void put_digits(char *p, uint32_t v, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        p[i] = (char)('0' + v % 10);
+        v /= 10;
+    }
+}
+
+// parse an unsigned count at *s, advancing past it; -1 if there is none
+// or it exceeds max
+static long long parse_count(const char **s, uint32_t max) {
+    const char *p = *s;
+    long long v = 0;
+    if (*p < '0' || *p > '9') return -1;
+    while (*p >= '0' && *p <= '9') {
+        v = v * 10 + (*p++ - '0');
+        if (v > max) return -1;
+    }
+    *s = p;
+    return v;
+}
 
-void game_init(game_t *g) {
-    int defaults[NIM_PILES] = {1, 3, 5, 7, 9};
-    for (int i = 0; i < NIM_PILES; i++) {
-        g->piles[i] = defaults[i];
+int game_layout_parse(game_layout_t *l, const char *spec) {
+    uint32_t *start = NULL;
+    int piles = 0, cap = 0;
+    size_t text = 0;
+
+    const char *p = spec;
+    for (;;) {
+        long long n = 1;
+        long long c = parse_count(&p, NIM_MAX_STONES);
+        if (c >= 0 && *p == 'x') {
+            p++;
+            n = c;
+            c = parse_count(&p, NIM_MAX_STONES);
+        }
+        if (c < 0 || n < 1 || n > NIM_MAX_PILES - piles
+            || (*p != ',' && *p != '\0')) {
+            free(start);
+            return -1;
+        }
+        if (piles + n > cap) {
+            cap = (int)(piles + n) * 2;
+            if (cap > NIM_MAX_PILES) cap = NIM_MAX_PILES;
+            uint32_t *grown = realloc(start, (size_t)cap * sizeof(*start));
+            if (!grown) {
+                free(start);
+                return -1;
+            }
+            start = grown;
+        }
+        for (long long i = 0; i < n; i++) {
+            start[piles++] = (uint32_t)c;
+            text += (size_t)digits((uint32_t)c) + 1;  // digits and a space
+        }
+        if (*p == '\0') break;
+        p++;
+    }
+
+    l->piles = piles;
+    l->start = start;
+    l->board_cap = text;   // the last pile's space is the NUL
+    l->rules = NULL;
+    return 0;
+}
+
+size_t game_size(const game_layout_t *l) {
+    size_t n = sizeof(game_t) + 2 * (size_t)l->piles * sizeof(uint32_t)
+             + l->board_cap;
+    return (n + 7) & ~(size_t)7;
+}
+
+// point the arrays at the storage following the struct
+static void game_bind(game_t *g, const game_layout_t *l) {
+    g->layout = l;
+    g->piles = (uint32_t *)(g + 1);
+    g->pile_off = g->piles + l->piles;
+    g->board = (char *)(g->pile_off + l->piles);
+}
+
+void game_init(game_t *g, const game_layout_t *l) {
+    game_bind(g, l);
+    memcpy(g->piles, l->start, (size_t)l->piles * sizeof(uint32_t));
+    g->rules = l->rules ? l->rules : rules_default();
+    g->live = 0;
+    for (int i = 0; i < l->piles; i++) {
+        if (g->piles[i] >= g->rules->min) g->live++;
     }
     g->current_player = 1;
+
+    // render the whole board text, "a b c d e"; no later text is longer,
+    // since piles only shrink
+    size_t len = 0;
+    for (int i = 0; i < l->piles; i++) {
+        if (i > 0) g->board[len++] = ' ';
+        int w = digits(g->piles[i]);
+        g->pile_off[i] = (uint32_t)len;
+        put_digits(g->board + len, g->piles[i], w);
+        len += (size_t)w;
+    }
+    g->board[len] = '\0';
+    g->board_len = len;
+}
+
+void game_copy(game_t *dst, const game_t *src) {
+    memcpy(dst, src, game_size(src->layout));
+    game_bind(dst, src->layout);
 }
 
 int game_is_over(const game_t *g) {
-    for (int i = 0; i < NIM_PILES; i++) {
-        if (g->piles[i] > 0)
-            return 0;
+    return g->live == 0;
+}
+
+int game_winner(const game_t *g) {
+    // the player to move has none left; under misere rules the last
+    // stone was taken by the loser
+    if (g->rules->kind == RULES_MISERE) return g->current_player;
+    return (g->current_player == 1) ? 2 : 1;
+}
+
+// can qty stones be taken from a pile of n under the rules?
+static int valid_amount(const game_rules_t *r, uint32_t n, long qty) {
+    if (qty <= 0 || qty > (long)n) return 0;
+    if (r->kind == RULES_SUBTRACT) {
+        return qty <= r->amount[r->amounts - 1] && r->allowed[qty];
     }
     return 1;
 }
 
 int game_is_valid_move(const game_t *g, int pile, int qty) {
-    if (pile < 0 || pile >= NIM_PILES)
+    if (pile < 0 || pile >= g->layout->piles)
         return 0;
-    if (qty <= 0)
-        return 0;
-    if (qty > g->piles[pile])
-        return 0;
-    return 1;
+    return valid_amount(g->rules, g->piles[pile], qty);
 }
 
-void game_apply_move(game_t *g, int pile, int qty) {
+int game_read_move(const game_t *g, const long *values, int count,
+                   game_move_t *m) {
+    // a move is whole pairs, no more of them than the rules allow
+    if (count % 2 != 0 || count / 2 > g->rules->take) return 33;
+    m->count = count / 2;
+    for (int i = 0; i < m->count; i++) {
+        long pile = values[2 * i];
+        long qty = values[2 * i + 1];
+
+        if (pile < 0 || pile >= g->layout->piles) return 32;
+        for (int j = 0; j < i; j++) {
+            if (m->pile[j] == pile) return 32;
+        }
+        if (!valid_amount(g->rules, g->piles[pile], qty)) return 33;
+        m->pile[i] = (int)pile;
+        m->qty[i] = (uint32_t)qty;
+    }
+    return 0;
+}
+
+// take qty stones from a pile, keeping the board text in step
+static void take(game_t *g, int pile, uint32_t qty) {
+    int old_width = digits(g->piles[pile]);
+    if (g->piles[pile] >= g->rules->min
+        && g->piles[pile] - qty < g->rules->min) {
+        g->live--;
+    }
     g->piles[pile] -= qty;
-    g->current_player = (g->current_player == 1 ? 2 : 1);
+
+    // rewrite just this pile's digits; only a change in digit count
+    // shifts the rest of the text (left, since piles only shrink)
+    int width = digits(g->piles[pile]);
+    char *at = g->board + g->pile_off[pile];
+    if (width != old_width) {
+        size_t shift = (size_t)(old_width - width);
+        size_t tail = g->board_len - (g->pile_off[pile] + (size_t)old_width);
+        memmove(at + width, at + old_width, tail + 1);
+        g->board_len -= shift;
+        for (int i = pile + 1; i < g->layout->piles; i++) {
+            g->pile_off[i] -= (uint32_t)shift;
+        }
+    }
+    put_digits(at, g->piles[pile], width);
+}
+
+int game_restore(game_t *g, const game_layout_t *l, const uint32_t *piles,
+                 int current_player) {
+    if (current_player != 1 && current_player != 2) return -1;
+    for (int i = 0; i < l->piles; i++) {
+        if (piles[i] > l->start[i]) return -1;
+    }
+    game_init(g, l);
+    for (int i = 0; i < l->piles; i++) {
+        if (piles[i] != l->start[i]) take(g, i, l->start[i] - piles[i]);
+    }
+    g->current_player = current_player;
+    return 0;
+}
+
+void game_apply_move(game_t *g, int pile, int qty) {
+    take(g, pile, (uint32_t)qty);
+    g->current_player = (g->current_player == 1) ? 2 : 1;
+}
+
+void game_play(game_t *g, const game_move_t *m) {
+    for (int i = 0; i < m->count; i++) {
+        take(g, m->pile[i], m->qty[i]);
+    }
+    g->current_player = (g->current_player == 1) ? 2 : 1;
 }
@@ -1,23 +1,99 @@
 #ifndef GAME_H
 #define GAME_H
 
-#define NIM_PILES 5
+#include <stddef.h>
+#include <stdint.h>
 
+#define NIM_MAX_PILES 4096
+#define NIM_MAX_STONES 1000000000u   // per pile
+#define GAME_MAX_TAKE 4      // piles one move may take from (see rules.h)
+
+// Which moves are legal and who wins; see rules.h
+typedef struct game_rules game_rules_t;
+
+// The board a game starts from: how many piles, and the stones in each.
+// Set up once (see game_layout_parse) and shared, read-only, by every
+// game that starts from it.
 typedef struct {
-    int piles[NIM_PILES];   // e.g., {1,3,5,7,9}
+    int piles;
+    const uint32_t *start;  // starting stones per pile
+    size_t board_cap;       // bytes for the board text, with its NUL
+    const game_rules_t *rules;  // NULL: plain Nim
+} game_layout_t;
+
+// The classic board, 1 3 5 7 9
+const game_layout_t *game_default_layout(void);
+
+// Parse a layout from comma-separated pile counts, where "NxC" stands
+// for N piles of C stones: "1,3,5,7,9", "300x1000", "5x1,2x7".
+// Returns 0, or -1 if spec is malformed, names no piles, more than
+// NIM_MAX_PILES, or a pile over NIM_MAX_STONES (or out of memory).
+int game_layout_parse(game_layout_t *l, const char *spec);
+
+// A game in progress. It is variable-sized: the piles, pile offsets and
+// board text follow the struct, so a game takes game_size() bytes, all
+// in one block (a slab object, or the end of a session). Copy one only
+// with game_copy, which fixes up the pointers.
+typedef struct {
+    const game_layout_t *layout;
+    const game_rules_t *rules;  // never NULL
+    int live;               // piles a move can still take from; the
+                            // game ends at 0
     int current_player;     // 1 or 2
+    size_t board_len;
+    uint32_t *piles;
+    uint32_t *pile_off;     // offset of each pile in board
+    // board text for PLAY/OVER, kept in sync with piles by the functions
+    // below so it is never reformatted from scratch on the turn path
+    char *board;
 } game_t;
 
-// Initialize the Nim board and starting player
-void game_init(game_t *g);
+// Bytes a game started from l takes, struct included
+size_t game_size(const game_layout_t *l);
+
+// Initialize a game (game_size(l) bytes at g) to l's board, player 1
+// to move
+void game_init(game_t *g, const game_layout_t *l);
 
-// Check if the game is over (all piles empty)
+// Copy src into dst, which must also hold game_size() bytes
+void game_copy(game_t *dst, const game_t *src);
+
+// Initialize a game (game_size(l) bytes at g) to a position reached
+// from l's board: piles left in each pile, and the player to move.
+// Returns 0, or -1 if a pile holds more than it started with or
+// current_player is not 1 or 2.
+int game_restore(game_t *g, const game_layout_t *l, const uint32_t *piles,
+                 int current_player);
+
+// A move: stones taken from one pile, or from several in variants
+// that allow it
+typedef struct {
+    int count;                   // piles taken from
+    int pile[GAME_MAX_TAKE];
+    uint32_t qty[GAME_MAX_TAKE];
+} game_move_t;
+
+// Check if the game is over (no move is left); O(1)
 int game_is_over(const game_t *g);
 
-// Validate a move; returns 1 if valid, 0 if invalid
+// The winner (1 or 2) of a game that is over
+int game_winner(const game_t *g);
+
+// Validate a single-pile move; returns 1 if valid, 0 if invalid
 int game_is_valid_move(const game_t *g, int pile, int qty);
 
-// Apply a move (assumes it's valid) and flip current_player
+// Read a MOVE's numeric fields (ngp_numbers), pile and quantity pairs
+// with -1 for a field that is not a number, into m and check it against
+// the rules. Returns 0 if it is legal, or the FAIL code: 32 for a bad
+// or repeated pile index, 33 for a bad quantity, a pile with no
+// quantity, or more pairs than the rules allow in one move.
+int game_read_move(const game_t *g, const long *values, int count,
+                   game_move_t *m);
+
+// Apply a single-pile move (assumes it's valid) and flip current_player
 void game_apply_move(game_t *g, int pile, int qty);
 
+// Apply a move checked by game_read_move and flip current_player
+void game_play(game_t *g, const game_move_t *m);
+
 #endif
@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "wire.h"
+
+#define CHUNK_BYTES 65536
+#define CHUNK_FDS 250            /* the kernel takes at most 253 per message */
+#define MIN_CAP 4096
+
+void handoff_init(handoff_t *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+void handoff_free(handoff_t *h) {
+    if (h->owns_fds) {
+        for (int i = h->fd_pos; i < h->nfds; i++) {
+            close(h->fds[i]);
+        }
+    }
+    free(h->buf);
+    free(h->fds);
+    handoff_init(h);
+}
+
+/* --------------------------
+   Writing
+   -------------------------- */
+
+static int reserve(handoff_t *h, size_t n) {
+    if (h->failed) return -1;
+    if (h->len + n <= h->cap) return 0;
+    size_t cap = h->cap ? h->cap : MIN_CAP;
+    while (cap < h->len + n) cap *= 2;
+    unsigned char *buf = realloc(h->buf, cap);
+    if (!buf) {
+        h->failed = 1;
+        return -1;
+    }
+    h->buf = buf;
+    h->cap = cap;
+    return 0;
+}
+
+void handoff_put(handoff_t *h, uint64_t v) {
+    if (reserve(h, WIRE_VARINT_MAX) != 0) return;
+    unsigned char *p = wire_put_varint(h->buf + h->len, v);
+    h->len = (size_t)(p - h->buf);
+}
+
+void handoff_put_bytes(handoff_t *h, const void *data, size_t len) {
+    handoff_put(h, len);
+    if (len == 0 || reserve(h, len) != 0) return;
+    memcpy(h->buf + h->len, data, len);
+    h->len += len;
+}
+
+void handoff_put_fd(handoff_t *h, int fd) {
+    if (h->failed) return;
+    if (h->nfds == h->fds_cap) {
+        int cap = h->fds_cap ? h->fds_cap * 2 : 64;
+        int *fds = realloc(h->fds, (size_t)cap * sizeof(*fds));
+        if (!fds) {
+            h->failed = 1;
+            return;
+        }
+        h->fds = fds;
+        h->fds_cap = cap;
+    }
+    h->fds[h->nfds++] = fd;
+}
+
+/* --------------------------
+   Reading
+   -------------------------- */
+
+uint64_t handoff_get(handoff_t *h) {
+    uint64_t v;
+    const unsigned char *p = wire_get_varint(h->buf + h->pos,
+                                             h->buf + h->len, &v);
+    if (!p) {
+        h->failed = 1;
+        return 0;
+    }
+    h->pos = (size_t)(p - h->buf);
+    return v;
+}
+
+const void *handoff_get_bytes(handoff_t *h, size_t *len) {
+    uint64_t n = handoff_get(h);
+    if (h->failed || n > h->len - h->pos) {
+        h->failed = 1;
+        *len = 0;
+        return "";
+    }
+    const void *p = h->buf + h->pos;
+    h->pos += (size_t)n;
+    *len = (size_t)n;
+    return p;
+}
+
+size_t handoff_get_str(handoff_t *h, char *out, size_t cap) {
+    size_t len;
+    const void *p = handoff_get_bytes(h, &len);
+    if (len >= cap) {
+        h->failed = 1;
+        len = 0;
+    }
+    memcpy(out, p, len);
+    out[len] = '\0';
+    return len;
+}
+
+int handoff_get_fd(handoff_t *h) {
+    if (h->fd_pos >= h->nfds) {
+        h->failed = 1;
+        return -1;
+    }
+    return h->fds[h->fd_pos++];
+}
+
+/* --------------------------
+   Transport
+   -------------------------- */
+
+/* one chunk: the header carries the fds, then the bytes follow */
+static int send_chunk(int sock, const unsigned char *data, size_t len,
+                      const int *fds, int nfds) {
+    unsigned char hdr[8];
+    wire_put_u32(hdr, (uint32_t)len);
+    wire_put_u32(hdr + 4, (uint32_t)nfds);
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(CHUNK_FDS * sizeof(int))];
+    } control;
+    struct iovec iov[2] = {
+        { hdr, sizeof(hdr) },
+        { (void *)data, len },
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len ? 2 : 1;
+    if (nfds > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE((size_t)nfds * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN((size_t)nfds * sizeof(int));
+        memcpy(CMSG_DATA(c), fds, (size_t)nfds * sizeof(int));
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return -1;
+
+    /* the fds went with the first byte; send whatever is left plainly */
+    size_t sent = (size_t)n;
+    size_t total = sizeof(hdr) + len;
+    while (sent < total) {
+        const unsigned char *p = (sent < sizeof(hdr))
+            ? hdr + sent : data + (sent - sizeof(hdr));
+        size_t left = (sent < sizeof(hdr))
+            ? sizeof(hdr) - sent : total - sent;
+        n = send(sock, p, left, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        sent += (size_t)n;
+    }
+    return 0;
+}
+
+int handoff_send(handoff_t *h, int sock) {
+    if (h->failed) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t off = 0;
+    int fd_off = 0;
+    while (off < h->len || fd_off < h->nfds) {
+        size_t len = h->len - off;
+        if (len > CHUNK_BYTES) len = CHUNK_BYTES;
+        int nfds = h->nfds - fd_off;
+        if (nfds > CHUNK_FDS) nfds = CHUNK_FDS;
+        if (send_chunk(sock, h->buf + off, len, h->fds + fd_off, nfds) != 0) {
+            return -1;
+        }
+        off += len;
+        fd_off += nfds;
+    }
+    return send_chunk(sock, NULL, 0, NULL, 0);
+}
+
+/* read exactly len bytes into buf, keeping any fds that come with them */
+static int recv_full(handoff_t *h, int sock, unsigned char *buf, size_t len) {
+    while (len > 0) {
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(CHUNK_FDS * sizeof(int))];
+        } control;
+        struct iovec iov = { buf, len };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = ECONNRESET;
+            return -1;
+        }
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c;
+             c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            int count = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            int *fds = (int *)CMSG_DATA(c);
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, fds + i, sizeof(fd));
+                handoff_put_fd(h, fd);
+                if (h->failed) close(fd);
+            }
+        }
+        if (msg.msg_flags & MSG_CTRUNC) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int handoff_recv(handoff_t *h, int sock) {
+    h->owns_fds = 1;
+    int expected = 0;
+    for (;;) {
+        unsigned char hdr[8];
+        if (recv_full(h, sock, hdr, sizeof(hdr)) != 0) return -1;
+        uint32_t len = wire_get_u32(hdr);
+        expected += (int)wire_get_u32(hdr + 4);
+        if (len == 0 && wire_get_u32(hdr + 4) == 0) break;
+        if (len > CHUNK_BYTES || reserve(h, len) != 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (recv_full(h, sock, h->buf + h->len, len) != 0) return -1;
+        h->len += len;
+    }
+    if (h->failed || h->nfds != expected) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+int handoff_connect(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
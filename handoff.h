@@ -0,0 +1,56 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A message carrying a process's state and the file descriptors it
+// refers to, for a hot upgrade (see reactor.h). The sender appends
+// varints, byte strings and fds; the receiver reads them back in the
+// same order. Over the Unix socket it is sent as chunks: a header of
+// two u32s (little-endian), the chunk's byte count and fd count, then
+// the bytes, with the fds passed as SCM_RIGHTS on the header. A chunk
+// with neither ends the message.
+//
+// Reads past the end, or of the wrong kind, return 0 (or -1 for an fd)
+// and set failed, so a reader can check once at the end.
+
+typedef struct {
+    unsigned char *buf;
+    size_t len;
+    size_t cap;
+    size_t pos;         // next byte to read
+    int *fds;
+    int nfds;
+    int fds_cap;
+    int fd_pos;         // next fd to read
+    int owns_fds;       // received: fds not read are closed by free
+    int failed;         // out of memory, or read past the end
+} handoff_t;
+
+void handoff_init(handoff_t *h);
+void handoff_free(handoff_t *h);
+
+void handoff_put(handoff_t *h, uint64_t v);
+void handoff_put_bytes(handoff_t *h, const void *data, size_t len);
+void handoff_put_fd(handoff_t *h, int fd);
+
+uint64_t handoff_get(handoff_t *h);
+// The next byte string, pointing into h; its length is stored in *len
+const void *handoff_get_bytes(handoff_t *h, size_t *len);
+// Copy the next byte string into out (with a NUL) if it is shorter
+// than cap; returns its length
+size_t handoff_get_str(handoff_t *h, char *out, size_t cap);
+// The next fd, now owned by the caller
+int handoff_get_fd(handoff_t *h);
+
+// Send or receive a whole message on a blocking socket.
+// Returns 0, or -1 with errno set.
+int handoff_send(handoff_t *h, int sock);
+int handoff_recv(handoff_t *h, int sock);
+
+// Connect to the Unix socket at path; returns the socket, or -1 with
+// errno set (ENOENT or ECONNREFUSED: nothing is listening there)
+int handoff_connect(const char *path);
+
+#endif
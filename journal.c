@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "journal.h"
+#include "log.h"
+#include "wire.h"
+
+#define SMALL_RECORD 256            /* inline bytes; longer games grow */
+#define BATCH_SIZE (256 * 1024)     /* bytes per write() */
+#define MAX_PENDING (64 << 20)      /* queued bytes before games are dropped */
+
+struct journal_game {
+    struct journal_game *next;      /* pending stack */
+    long long started_ms;           /* monotonic, for the duration */
+    int npiles;
+    int failed;                     /* out of memory; dropped at the end */
+    int flags;                      /* JOURNAL_FLAG_* */
+    size_t len;
+    size_t cap;
+    unsigned char *buf;             /* small, or a heap copy once it grows */
+    unsigned char small[SMALL_RECORD];
+};
+
+static int journal_on;
+static char *journal_dir;
+static int sync_ms;
+static size_t segment_limit;
+
+/* finished games, pushed by any thread, taken all at once by the writer */
+static journal_game_t *pending;
+static size_t pending_bytes;
+
+/* the writer blocks on wake_fd once it has nothing to do; a push that
+   finds it asleep writes the eventfd */
+static int wake_fd = -1;
+static int sleeping;
+
+static unsigned long long written;
+static unsigned long long dropped;
+
+/* journal_flush's request, and the writer's count of requests done */
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static unsigned flush_asked;
+static unsigned flush_done;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* wake the writer if it is blocked waiting for work; called after the
+   work is published, with a full barrier, as the writer publishes that
+   it sleeps before its last look for work */
+static void writer_wake(void) {
+    if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST)
+        && __atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        (void)write(wake_fd, &one, sizeof(one));
+    }
+}
+
+/* --------------------------
+   Shared helpers
+   -------------------------- */
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t crc_table[256];
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+uint32_t journal_crc32(const void *buf, size_t len) {
+    pthread_once(&crc_once, crc_init);
+    const unsigned char *p = buf;
+    uint32_t c = 0xFFFFFFFFu;
+    while (len--) {
+        c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+
+const char *journal_end_name(int how) {
+    static const char *const names[] = {
+        "normal", "disconnect", "timeout", "forfeit", "aborted"
+    };
+    if (how < 0 || how > JOURNAL_END_ABORTED) return "unknown";
+    return names[how];
+}
+
+unsigned long long journal_written(void) {
+    return __atomic_load_n(&written, __ATOMIC_RELAXED);
+}
+
+unsigned long long journal_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+/* --------------------------
+   Building a record
+   -------------------------- */
+
+/* make room for n more bytes; returns 0, or -1 (and marks the game
+   failed) if memory runs out */
+static int reserve(journal_game_t *g, size_t n) {
+    if (g->failed) return -1;
+    if (g->len + n <= g->cap) return 0;
+    size_t cap = g->cap * 2;
+    while (cap < g->len + n) cap *= 2;
+    unsigned char *buf = malloc(cap);
+    if (!buf) {
+        g->failed = 1;
+        return -1;
+    }
+    memcpy(buf, g->buf, g->len);
+    if (g->buf != g->small) free(g->buf);
+    g->buf = buf;
+    g->cap = cap;
+    return 0;
+}
+
+static void put_varint(journal_game_t *g, uint64_t v) {
+    if (reserve(g, WIRE_VARINT_MAX) != 0) return;
+    unsigned char *p = wire_put_varint(g->buf + g->len, v);
+    g->len = (size_t)(p - g->buf);
+}
+
+static void put_bytes(journal_game_t *g, const void *src, size_t n) {
+    if (reserve(g, n) != 0) return;
+    memcpy(g->buf + g->len, src, n);
+    g->len += n;
+}
+
+static void put_name(journal_game_t *g, const char *name) {
+    size_t n = strlen(name);
+    put_varint(g, n);
+    put_bytes(g, name, n);
+}
+
+static void game_free(journal_game_t *g) {
+    if (g->buf != g->small) free(g->buf);
+    free(g);
+}
+
+journal_game_t *journal_begin(const char *name1, const char *name2,
+                              const uint32_t *piles, int npiles) {
+    if (!journal_on) return NULL;
+    journal_game_t *g = malloc(sizeof(*g));
+    if (!g) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    g->started_ms = now_ms();
+    g->npiles = npiles;
+    g->failed = 0;
+    g->flags = 0;
+    g->buf = g->small;
+    g->cap = sizeof(g->small);
+    g->len = JOURNAL_REC_HEADER;   /* filled in by journal_end */
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    put_varint(g, (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000);
+    put_name(g, name1);
+    put_name(g, name2);
+    put_varint(g, (uint64_t)npiles);
+    for (int i = 0; i < npiles; i++) {
+        put_varint(g, piles[i]);
+    }
+    return g;
+}
+
+void journal_set_bot(journal_game_t *g, int player) {
+    if (!g) return;
+    g->flags |= (player == 1) ? JOURNAL_FLAG_BOT1 : JOURNAL_FLAG_BOT2;
+}
+
+void journal_move(journal_game_t *g, int pile, int qty) {
+    if (!g) return;
+    put_varint(g, ((uint64_t)qty * (uint64_t)g->npiles + (uint64_t)pile) << 1);
+}
+
+void journal_move_more(journal_game_t *g, int pile, int qty) {
+    if (!g) return;
+    put_varint(g, JOURNAL_EV_MORE);
+    journal_move(g, pile, qty);
+}
+
+void journal_fail(journal_game_t *g, int player, int code) {
+    if (!g) return;
+    put_varint(g, (uint64_t)code << 2 | (uint64_t)(player - 1) << 1 | 1);
+}
+
+void journal_end(journal_game_t *g, int winner, journal_end_t how) {
+    if (!g) return;
+    put_varint(g, 0);
+    put_varint(g, (uint64_t)(now_ms() - g->started_ms));
+    unsigned char tail[3] = { (unsigned char)winner, (unsigned char)how,
+                              (unsigned char)g->flags };
+    put_bytes(g, tail, g->flags ? 3 : 2);
+
+    size_t queued = __atomic_load_n(&pending_bytes, __ATOMIC_RELAXED);
+    if (g->failed || queued + g->len > MAX_PENDING) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        game_free(g);
+        return;
+    }
+    size_t payload = g->len - JOURNAL_REC_HEADER;
+    wire_put_u32(g->buf, (uint32_t)payload);
+    wire_put_u32(g->buf + 4,
+                 journal_crc32(g->buf + JOURNAL_REC_HEADER, payload));
+
+    __atomic_fetch_add(&pending_bytes, g->len, __ATOMIC_RELAXED);
+    journal_game_t *head = __atomic_load_n(&pending, __ATOMIC_RELAXED);
+    do {
+        g->next = head;
+    } while (!__atomic_compare_exchange_n(&pending, &head, g, 1,
+                                          __ATOMIC_SEQ_CST,
+                                          __ATOMIC_RELAXED));
+    writer_wake();
+}
+
+size_t journal_save(const journal_game_t *g, const void **data,
+                    long long *started_ms, int *flags) {
+    if (!g || g->failed) return 0;
+    *data = g->buf + JOURNAL_REC_HEADER;
+    *started_ms = g->started_ms;
+    *flags = g->flags;
+    return g->len - JOURNAL_REC_HEADER;
+}
+
+journal_game_t *journal_resume(const void *data, size_t len, int npiles,
+                               long long started_ms, int flags) {
+    if (!journal_on) return NULL;
+    journal_game_t *g = malloc(sizeof(*g));
+    if (!g) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    g->started_ms = started_ms;
+    g->npiles = npiles;
+    g->failed = 0;
+    g->flags = flags;
+    g->buf = g->small;
+    g->cap = sizeof(g->small);
+    g->len = JOURNAL_REC_HEADER;
+    put_bytes(g, data, len);
+    return g;
+}
+
+/* --------------------------
+   Writer
+   -------------------------- */
+
+static int seg_fd = -1;
+static unsigned seg_seq;
+static size_t seg_bytes;
+static int seg_dirty;          /* written since the last fdatasync */
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* the highest segment number already in dir, or 0 */
+static unsigned last_segment(const char *dir) {
+    unsigned last = 0;
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        unsigned seq;
+        char tail[4];
+        if (sscanf(e->d_name, "%8u.%3s", &seq, tail) == 2
+            && strcmp(tail, "nj") == 0 && seq > last) {
+            last = seq;
+        }
+    }
+    closedir(d);
+    return last;
+}
+
+/* start the next segment: a new file holding only the magic, with its
+   directory entry synced so a crash cannot lose the file itself */
+static int segment_open(void) {
+    char path[4096];
+    int fd;
+    do {
+        /* numbers taken by another process (an upgrade that was
+           abandoned) are skipped */
+        snprintf(path, sizeof(path), "%s/%08u.nj", journal_dir, ++seg_seq);
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC,
+                  0644);
+    } while (fd < 0 && errno == EEXIST);
+    if (fd < 0) {
+        log_text(LOG_ERROR, "journal: %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (write_all(fd, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0) {
+        log_text(LOG_ERROR, "journal: %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    int dfd = open(journal_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0) {
+        (void)fsync(dfd);
+        close(dfd);
+    }
+    seg_fd = fd;
+    seg_bytes = JOURNAL_MAGIC_LEN;
+    seg_dirty = 1;
+    return 0;
+}
+
+static void segment_sync(void) {
+    if (seg_fd >= 0 && seg_dirty) {
+        if (fdatasync(seg_fd) != 0) {
+            log_text(LOG_ERROR, "journal: fdatasync: %s", strerror(errno));
+        }
+        seg_dirty = 0;
+    }
+}
+
+/* write out batch[0..len) holding count games; on failure the games are
+   dropped and the segment abandoned, so the next batch starts a fresh
+   one rather than appending after a partial record */
+static void batch_flush(const unsigned char *batch, size_t len,
+                        unsigned long long count) {
+    if (len == 0) return;
+    if (seg_fd < 0 && segment_open() != 0) {
+        __atomic_fetch_add(&dropped, count, __ATOMIC_RELAXED);
+        return;
+    }
+    if (write_all(seg_fd, batch, len) != 0) {
+        log_text(LOG_ERROR, "journal: write: %s", strerror(errno));
+        __atomic_fetch_add(&dropped, count, __ATOMIC_RELAXED);
+        close(seg_fd);
+        seg_fd = -1;
+        return;
+    }
+    seg_bytes += len;
+    seg_dirty = 1;
+    __atomic_fetch_add(&written, count, __ATOMIC_RELAXED);
+}
+
+static void *writer_run(void *arg) {
+    (void)arg;
+    unsigned char *batch = malloc(BATCH_SIZE);
+    if (!batch) return NULL;
+    long long last_sync = now_ms();
+
+    for (;;) {
+        journal_game_t *list = __atomic_exchange_n(&pending, NULL,
+                                                   __ATOMIC_ACQUIRE);
+        /* the stack is newest first; write in the order games ended */
+        journal_game_t *fifo = NULL;
+        while (list) {
+            journal_game_t *next = list->next;
+            list->next = fifo;
+            fifo = list;
+            list = next;
+        }
+
+        size_t len = 0;
+        unsigned long long count = 0;
+        while (fifo) {
+            journal_game_t *g = fifo;
+            fifo = g->next;
+
+            /* rotate before a record that would overflow the segment */
+            if (seg_fd >= 0
+                && seg_bytes + len + g->len > segment_limit
+                && seg_bytes + len > JOURNAL_MAGIC_LEN) {
+                batch_flush(batch, len, count);
+                len = 0;
+                count = 0;
+                segment_sync();
+                if (seg_fd >= 0) close(seg_fd);
+                seg_fd = -1;
+            }
+            if (len + g->len > BATCH_SIZE) {
+                batch_flush(batch, len, count);
+                len = 0;
+                count = 0;
+            }
+            if (g->len > BATCH_SIZE) {
+                batch_flush(g->buf, g->len, 1);
+            } else {
+                memcpy(batch + len, g->buf, g->len);
+                len += g->len;
+                count++;
+            }
+            __atomic_fetch_sub(&pending_bytes, g->len, __ATOMIC_RELAXED);
+            game_free(g);
+        }
+        batch_flush(batch, len, count);
+
+        /* group commit: one fdatasync covers every game written since
+           the last one */
+        long long now = now_ms();
+        if (seg_dirty && now - last_sync >= sync_ms) {
+            segment_sync();
+            last_sync = now;
+        }
+
+        if (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) != NULL) {
+            continue;
+        }
+        /* everything pushed before a flush request is written now */
+        pthread_mutex_lock(&flush_lock);
+        unsigned asked = flush_asked;
+        pthread_mutex_unlock(&flush_lock);
+        if (asked != flush_done) {
+            segment_sync();
+            last_sync = now_ms();
+            pthread_mutex_lock(&flush_lock);
+            flush_done = asked;
+            pthread_cond_broadcast(&flush_cond);
+            pthread_mutex_unlock(&flush_lock);
+            continue;
+        }
+
+        /* nothing to do: block until a push or flush request wakes
+           us, or until unsynced games are due their fdatasync */
+        __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&flush_lock);
+        asked = flush_asked;
+        pthread_mutex_unlock(&flush_lock);
+        if (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) != NULL
+            || asked != flush_done) {
+            __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+        int timeout = -1;
+        if (seg_dirty) {
+            long long left = last_sync + sync_ms - now_ms();
+            timeout = (left > 0) ? (int)left : 0;
+        }
+        if (poll(&pfd, 1, timeout) > 0) {
+            uint64_t count;
+            (void)read(wake_fd, &count, sizeof(count));
+        }
+        __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+void journal_flush(void) {
+    if (!journal_on) return;
+    pthread_mutex_lock(&flush_lock);
+    unsigned asked = ++flush_asked;
+    pthread_mutex_unlock(&flush_lock);
+    writer_wake();
+    pthread_mutex_lock(&flush_lock);
+    while ((int)(flush_done - asked) < 0) {
+        pthread_cond_wait(&flush_cond, &flush_lock);
+    }
+    pthread_mutex_unlock(&flush_lock);
+}
+
+int journal_open(const char *dir, int sync_interval_ms, size_t segment_size) {
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    journal_dir = strdup(dir);
+    if (!journal_dir) {
+        return -1;
+    }
+    sync_ms = sync_interval_ms;
+    segment_limit = segment_size;
+    seg_seq = last_segment(dir);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0 || segment_open() != 0) {
+        return -1;
+    }
+
+    /* the writer takes no signals; they belong to the event loops */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t tid;
+    int rc = pthread_create(&tid, NULL, writer_run, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    pthread_detach(tid);
+    journal_on = 1;
+    return 0;
+}
@@ -0,0 +1,100 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only binary journal of finished games. A game builds its
+// record in memory as it is played (journal_begin, journal_move,
+// journal_fail) and hands it off with journal_end, which pushes it on
+// a lock-free stack. A writer thread appends the records to segment
+// files under a directory and fdatasync()s them at most once per
+// durability interval (group commit), so a crash loses at most that
+// interval's games. Segments are rotated once they reach a size limit.
+// Every function is a no-op when the journal is not open, or when
+// given the NULL that journal_begin returns in that case.
+//
+// On disk a segment is the 8-byte magic "NIMJRNL1" followed by records:
+//
+//   u32 length (little-endian), u32 CRC-32 of the payload, payload:
+//     varint  start time (ms since the epoch)
+//     name1, name2         (varint length, then the bytes)
+//     varint  pile count, then one varint per pile (the opening board)
+//     events, each a varint, ended by a 0:
+//       move  ((qty * piles + pile) << 1); movers alternate from player 1
+//       FAIL  (code << 2 | (player - 1) << 1 | 1)
+//       1     the next move is part of the same turn (variants that
+//             take from several piles; see rules.h)
+//     varint  duration (ms)
+//     u8      winner (1 or 2, or 0 if the game was aborted)
+//     u8      how it ended (JOURNAL_END_*)
+//     u8      flags (JOURNAL_FLAG_*); only present if any are set
+//
+// A torn record at the end of a segment (a crash mid-write) fails its
+// length or CRC check; readers stop there.
+
+#define JOURNAL_MAGIC "NIMJRNL1"
+#define JOURNAL_MAGIC_LEN 8
+#define JOURNAL_REC_HEADER 8
+#define JOURNAL_EV_MORE 1
+
+#define JOURNAL_DEFAULT_SYNC_MS 100
+#define JOURNAL_DEFAULT_SEGMENT (64 << 20)
+
+typedef enum {
+    JOURNAL_END_NORMAL,       // last stone taken
+    JOURNAL_END_DISCONNECT,   // loser hung up
+    JOURNAL_END_TIMEOUT,      // loser's move clock ran out
+    JOURNAL_END_FORFEIT,      // loser broke the protocol or stopped reading
+    JOURNAL_END_ABORTED       // server error; no winner
+} journal_end_t;
+
+// Record flags
+#define JOURNAL_FLAG_BOT1 0x01   // player 1 was the server's bot
+#define JOURNAL_FLAG_BOT2 0x02   // player 2 was the server's bot
+
+typedef struct journal_game journal_game_t;
+
+// Open (creating if needed) dir and start the writer thread. New games
+// go to a fresh segment numbered after any already in dir.
+// Returns 0, or -1 with errno set.
+int journal_open(const char *dir, int sync_ms, size_t segment_bytes);
+
+// Start recording a game; returns NULL if the journal is not open
+journal_game_t *journal_begin(const char *name1, const char *name2,
+                              const uint32_t *piles, int npiles);
+
+// Mark player (1 or 2) as the server's bot (see --bot-after)
+void journal_set_bot(journal_game_t *g, int player);
+
+// Record a valid move, or a FAIL sent to player (1 or 2)
+void journal_move(journal_game_t *g, int pile, int qty);
+// Record another pile taken from by the move just recorded
+void journal_move_more(journal_game_t *g, int pile, int qty);
+void journal_fail(journal_game_t *g, int player, int code);
+
+// Finish the record and queue it for the writer; g is consumed
+void journal_end(journal_game_t *g, int winner, journal_end_t how);
+
+// Hot upgrade (see reactor.h). journal_save points *data at the record
+// of a game still being played and returns its length (0 if g is NULL
+// or was dropped), with when it started and its flags; journal_resume
+// continues that record in the new process. journal_flush waits until
+// every game finished so far is written and synced, so the new process
+// can open its own segment after them.
+size_t journal_save(const journal_game_t *g, const void **data,
+                    long long *started_ms, int *flags);
+journal_game_t *journal_resume(const void *data, size_t len, int npiles,
+                               long long started_ms, int flags);
+void journal_flush(void);
+
+// Games written, and games dropped because the writer fell too far
+// behind or a segment could not be written
+unsigned long long journal_written(void);
+unsigned long long journal_dropped(void);
+
+// Helpers shared with the reader (nimjournal)
+uint32_t journal_crc32(const void *buf, size_t len);
+const char *journal_end_name(int how);
+
+#endif
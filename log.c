@@ -0,0 +1,408 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "server.h"
+
+#define RING_SLOTS 256              /* records per thread (power of two) */
+#define TEXT_LEN (2 * (MAX_NAME_LEN + 1))
+#define BATCH_SIZE 65536            /* formatted bytes per write() */
+#define LINE_MAX_LEN 768            /* longest formatted record */
+
+typedef struct {
+    int64_t ts_ns;                  /* CLOCK_REALTIME */
+    uint8_t level;
+    uint8_t event;
+    int32_t n;
+    union {
+        struct {
+            char a[MAX_NAME_LEN + 1];
+            char b[MAX_NAME_LEN + 1];
+        } names;
+        char text[TEXT_LEN];
+    } u;
+} record_t;
+
+/* single producer (the owning thread), single consumer (the writer).
+   The producer owns tail, the writer owns head; each publishes its
+   index with a release store. */
+typedef struct ring {
+    size_t head;
+    char pad1[64 - sizeof(size_t)];
+    size_t tail;
+    unsigned long long dropped;
+    unsigned long long dropped_seen;  /* writer's copy, for reporting */
+    int closed;                       /* owning thread has exited */
+    struct ring *next;
+    record_t slots[RING_SLOTS];
+} ring_t;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static ring_t *rings;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread ring_t *this_ring;
+
+static int out_fd = 1;
+static int min_level = LOG_INFO;
+static unsigned long long dropped_total;
+
+/* log_flush waits for the writer to finish a pass begun after it asked */
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long long flush_asked;
+static unsigned long long flush_done;
+static int writer_running;
+
+/* the writer blocks on wake_fd once every ring is empty; a producer that
+   finds it asleep writes the eventfd */
+static int wake_fd = -1;
+static int sleeping;
+
+static const char *const level_names[] = { "debug", "info", "warn", "error" };
+
+int log_parse_level(const char *name) {
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++) {
+        if (strcmp(name, level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+unsigned long long log_dropped(void) {
+    unsigned long long n = __atomic_load_n(&dropped_total, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&rings_lock);
+    for (ring_t *r = rings; r; r = r->next) {
+        n += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED) - r->dropped_seen;
+    }
+    pthread_mutex_unlock(&rings_lock);
+    return n;
+}
+
+/* --------------------------
+   Producers
+   -------------------------- */
+
+static void close_ring(void *arg) {
+    ring_t *r = arg;
+    /* the writer frees it once drained */
+    __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+}
+
+static void make_key(void) {
+    pthread_key_create(&ring_key, close_ring);
+}
+
+static ring_t *register_ring(void) {
+    pthread_once(&key_once, make_key);
+    void *mem;
+    if (posix_memalign(&mem, 64, sizeof(ring_t)) != 0) {
+        return NULL;
+    }
+    ring_t *r = mem;
+    memset(r, 0, offsetof(ring_t, slots));
+
+    pthread_mutex_lock(&rings_lock);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+
+    pthread_setspecific(ring_key, r);
+    this_ring = r;
+    return r;
+}
+
+/* the next free slot in this thread's ring, or NULL (counted as a
+   drop) if the writer has fallen a whole ring behind */
+static record_t *reserve(log_level_t level, log_event_t ev) {
+    ring_t *r = this_ring;
+    if (!r && !(r = register_ring())) return NULL;
+
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (r->tail - head == RING_SLOTS) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    record_t *rec = &r->slots[r->tail & (RING_SLOTS - 1)];
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->ts_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec->level = (uint8_t)level;
+    rec->event = (uint8_t)ev;
+    rec->n = 0;
+    return rec;
+}
+
+/* wake the writer if it is blocked; the store that published the work
+   and the load of sleeping are both sequentially consistent, as are the
+   writer's store of sleeping and its last look at the rings */
+static void writer_wake(void) {
+    if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST)
+        && __atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        (void)write(wake_fd, &one, sizeof(one));
+    }
+}
+
+static void publish(void) {
+    ring_t *r = this_ring;
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+    writer_wake();
+}
+
+static void copy_name(char *dst, const char *src) {
+    size_t n = src ? strnlen(src, MAX_NAME_LEN) : 0;
+    memcpy(dst, src ? src : "", n);
+    dst[n] = '\0';
+}
+
+void log_event(log_level_t level, log_event_t ev,
+               const char *a, const char *b, int n) {
+    if ((int)level < min_level) return;
+    record_t *rec = reserve(level, ev);
+    if (!rec) return;
+    rec->n = n;
+    copy_name(rec->u.names.a, a);
+    copy_name(rec->u.names.b, b);
+    publish();
+}
+
+void log_text(log_level_t level, const char *fmt, ...) {
+    if ((int)level < min_level) return;
+    record_t *rec = reserve(level, LOG_EV_TEXT);
+    if (!rec) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(rec->u.text, sizeof(rec->u.text), fmt, ap);
+    va_end(ap);
+    publish();
+}
+
+/* --------------------------
+   Writer
+   -------------------------- */
+
+/* append s as a logfmt quoted value; names may hold any byte but '|' */
+static size_t put_quoted(char *p, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    char *start = p;
+    *p++ = '"';
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = (char)c;
+        } else if (c < 0x20 || c == 0x7f) {
+            *p++ = '\\';
+            *p++ = 'x';
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 15];
+        } else {
+            *p++ = (char)c;
+        }
+    }
+    *p++ = '"';
+    return (size_t)(p - start);
+}
+
+/* format one record as a line; out holds LINE_MAX_LEN bytes, enough for
+   two names even if every byte is escaped */
+static size_t format_record(char *out, const record_t *rec) {
+    time_t secs = (time_t)(rec->ts_ns / 1000000000);
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+    char *p = out;
+    p += strftime(p, 32, "ts=%Y-%m-%dT%H:%M:%S", &tm);
+    p += sprintf(p, ".%06ldZ level=%s ", (long)(rec->ts_ns % 1000000000) / 1000,
+                 level_names[rec->level]);
+
+    switch (rec->event) {
+    case LOG_EV_TEXT:
+        p += sprintf(p, "msg=");
+        p += put_quoted(p, rec->u.text);
+        break;
+    case LOG_EV_GAME_START:
+        p += sprintf(p, "event=game_start p1=");
+        p += put_quoted(p, rec->u.names.a);
+        p += sprintf(p, " p2=");
+        p += put_quoted(p, rec->u.names.b);
+        break;
+    case LOG_EV_GAME_OVER:
+        p += sprintf(p, "event=game_over winner=");
+        p += put_quoted(p, rec->u.names.a);
+        p += sprintf(p, " loser=");
+        p += put_quoted(p, rec->u.names.b);
+        break;
+    case LOG_EV_FORFEIT:
+        p += sprintf(p, "event=forfeit loser=");
+        p += put_quoted(p, rec->u.names.a);
+        p += sprintf(p, " winner=");
+        p += put_quoted(p, rec->u.names.b);
+        p += sprintf(p, " reason=%s",
+                     rec->n == LOG_FORFEIT_TIMEOUT ? "timeout" : "disconnect");
+        break;
+    case LOG_EV_LOBBY_TIMEOUT:
+        p += sprintf(p, "event=lobby_timeout player=");
+        p += put_quoted(p, rec->u.names.a);
+        break;
+    }
+    *p++ = '\n';
+    return (size_t)(p - out);
+}
+
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(out_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;   /* nowhere to report it; the lines are lost */
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+/* format whatever the rings hold into batch, freeing the rings of
+   exited threads once they are empty. Returns the bytes formatted. */
+static size_t collect(char *batch) {
+    size_t len = 0;
+    unsigned long long new_drops = 0;
+
+    pthread_mutex_lock(&rings_lock);
+    ring_t **link = &rings;
+    while (*link) {
+        ring_t *r = *link;
+        int closed = __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE);
+        size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        size_t head = r->head;
+        while (head != tail && len + LINE_MAX_LEN <= BATCH_SIZE) {
+            len += format_record(batch + len, &r->slots[head & (RING_SLOTS - 1)]);
+            head++;
+        }
+        __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+
+        unsigned long long d = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        new_drops += d - r->dropped_seen;
+        r->dropped_seen = d;
+
+        if (closed && head == tail) {
+            *link = r->next;
+            free(r);
+        } else {
+            link = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (new_drops > 0) {
+        __atomic_fetch_add(&dropped_total, new_drops, __ATOMIC_RELAXED);
+        if (len + LINE_MAX_LEN <= BATCH_SIZE) {
+            record_t rec;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            rec.ts_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+            rec.level = LOG_WARN;
+            rec.event = LOG_EV_TEXT;
+            snprintf(rec.u.text, sizeof(rec.u.text),
+                     "log rings full; %llu records dropped", new_drops);
+            len += format_record(batch + len, &rec);
+        }
+    }
+    return len;
+}
+
+/* 1 if any ring holds a record the writer has not taken */
+static int rings_pending(void) {
+    int any = 0;
+    pthread_mutex_lock(&rings_lock);
+    for (ring_t *r = rings; r && !any; r = r->next) {
+        any = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != r->head;
+    }
+    pthread_mutex_unlock(&rings_lock);
+    return any;
+}
+
+static void *writer_run(void *arg) {
+    (void)arg;
+    char *batch = malloc(BATCH_SIZE);
+    if (!batch) return NULL;
+
+    for (;;) {
+        pthread_mutex_lock(&flush_lock);
+        unsigned long long asked = flush_asked;
+        pthread_mutex_unlock(&flush_lock);
+
+        size_t len = collect(batch);
+        if (len > 0) {
+            /* no lock is held here, so a stalled reader of out_fd only
+               ever costs dropped records, never a blocked producer */
+            write_all(batch, len);
+            continue;
+        }
+
+        pthread_mutex_lock(&flush_lock);
+        flush_done = asked;
+        pthread_cond_broadcast(&flush_cond);
+        pthread_mutex_unlock(&flush_lock);
+
+        /* nothing queued: block until a producer or log_flush wakes us */
+        __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&flush_lock);
+        int flush_wanted = flush_asked != flush_done;
+        pthread_mutex_unlock(&flush_lock);
+        if (!flush_wanted && !rings_pending()) {
+            uint64_t count;
+            (void)read(wake_fd, &count, sizeof(count));
+        }
+        __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int log_init(int fd, log_level_t level) {
+    out_fd = fd;
+    min_level = level;
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        return -1;
+    }
+
+    /* the writer takes no signals; they belong to the event loops */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t tid;
+    int rc = pthread_create(&tid, NULL, writer_run, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    writer_running = 1;
+    return 0;
+}
+
+void log_flush(void) {
+    if (!writer_running) return;
+    pthread_mutex_lock(&flush_lock);
+    unsigned long long want = ++flush_asked;
+    pthread_mutex_unlock(&flush_lock);
+    writer_wake();
+    pthread_mutex_lock(&flush_lock);
+    while (flush_done < want) {
+        pthread_cond_wait(&flush_cond, &flush_lock);
+    }
+    pthread_mutex_unlock(&flush_lock);
+}
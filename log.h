@@ -0,0 +1,53 @@
+#ifndef LOG_H
+#define LOG_H
+
+// Asynchronous logger. Each thread appends fixed-size binary records to
+// its own single-producer ring; a background writer thread formats them
+// as logfmt lines ("ts=... level=info event=game_start p1=\"a\" ...")
+// and writes them out. Logging never takes a lock or waits for the
+// output; its only syscalls are reading the clock and, when the writer
+// is idle, waking it. When a thread's ring is full the record is
+// dropped and counted instead.
+// Lines from different threads may appear slightly out of time order.
+
+typedef enum {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR
+} log_level_t;
+
+typedef enum {
+    LOG_EV_TEXT,           // preformatted message (log_text)
+    LOG_EV_GAME_START,     // a: player 1, b: player 2
+    LOG_EV_GAME_OVER,      // a: winner, b: loser
+    LOG_EV_FORFEIT,        // a: loser, b: winner, n: LOG_FORFEIT_*
+    LOG_EV_LOBBY_TIMEOUT   // a: player
+} log_event_t;
+
+#define LOG_FORFEIT_DISCONNECT 0
+#define LOG_FORFEIT_TIMEOUT    1
+
+// Start the writer thread, writing to fd and keeping records at or
+// above min_level. Returns 0, or -1 if the thread could not start.
+int log_init(int fd, log_level_t min_level);
+
+// Parse "debug", "info", "warn" or "error"; returns -1 if unknown
+int log_parse_level(const char *name);
+
+// Queue an event; a and b may be NULL
+void log_event(log_level_t level, log_event_t ev,
+               const char *a, const char *b, int n);
+
+// Queue a printf-style message (formatted by the caller, so keep it
+// off hot paths; long messages are truncated)
+void log_text(log_level_t level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Records dropped because a ring was full, over the process lifetime
+unsigned long long log_dropped(void);
+
+// Wait until everything queued so far has been written
+void log_flush(void);
+
+#endif
@@ -0,0 +1,536 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "ngp.h"
+#include "game.h"
+#include "rules.h"
+#include "stats.h"
+
+/* Microbenchmarks for the per-message and per-move functions in ngp.c
+   (in both NGP encodings) and game.c, and position evaluation in
+   rules.c. Each one runs over a corpus of realistic inputs (frames
+   and board positions taken from randomly played games), pinned to one
+   CPU. A benchmark is timed in several runs of about RUN_NS each and
+   the fastest run is reported, which filters out interrupts and
+   migrations. Cycles come from a perf_event counter when the kernel
+   allows one; otherwise only ns/op is reported.
+
+   The stats benchmarks time metric recording in stats.c, which needs
+   no corpus.
+
+   Built without the sanitizers (see "make bench"). */
+
+#define RUNS 7
+#define RUN_NS 50000000LL     /* 50 ms per timed run */
+#define CORPUS 4096           /* entries per corpus (power of two) */
+#define MAX_RESULTS 16
+
+typedef struct {
+    const char *name;
+    double ns_per_op;
+    double cycles_per_op;     /* < 0 if unavailable */
+    long long ops;
+} result_t;
+
+static result_t results[MAX_RESULTS];
+static int result_count;
+static int cycles_fd = -1;
+
+/* keeps results alive so the compiler cannot drop the work */
+static volatile size_t sink;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* CPU cycles spent in this thread, or -1 without a counter */
+static long long read_cycles(void) {
+    long long v;
+    if (cycles_fd < 0 || read(cycles_fd, &v, sizeof(v)) != sizeof(v)) {
+        return -1;
+    }
+    return v;
+}
+
+static void open_cycle_counter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    cycles_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* --------------------------
+   Corpora
+   -------------------------- */
+
+static unsigned long long rng = 0x2545F4914F6CDD1DULL;
+
+static unsigned rand_below(unsigned n) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (unsigned)((rng * 2685821657736338717ULL) >> 33) % n;
+}
+
+/* positions reached in random games, including finished ones; games
+   are variable-sized, so position(k) finds the k-th */
+static const game_layout_t *layout;
+static size_t game_bytes;
+static unsigned char *positions;
+static game_t *scratch;        /* a copy to apply moves to */
+
+static game_t *position(size_t k) {
+    return (game_t *)(positions + k * game_bytes);
+}
+
+/* moves against positions[i]: about one in eight is invalid */
+static int move_pile[CORPUS];
+static int move_qty[CORPUS];
+
+/* incoming and outgoing frames as a server sees them, and the same
+   messages in NGP v1 */
+static char frames[CORPUS][NGP_MAX_MSG];
+static size_t frame_len[CORPUS];
+static char frames1[CORPUS][NGP_MAX_MSG];
+static size_t frame1_len[CORPUS];
+
+static void random_move(const game_t *g, int *pile, int *qty) {
+    do {
+        *pile = (int)rand_below((unsigned)layout->piles);
+    } while (g->piles[*pile] == 0);
+    *qty = 1 + (int)rand_below(g->piles[*pile]);
+}
+
+static int build_corpora(void) {
+    game_bytes = game_size(layout);
+    positions = malloc(CORPUS * game_bytes);
+    scratch = malloc(game_bytes);
+    game_t *g = malloc(game_bytes);
+    if (!positions || !scratch || !g) return -1;
+
+    game_init(g, layout);
+    for (int i = 0; i < CORPUS; i++) {
+        if (game_is_over(g)) {
+            game_init(g, layout);
+        }
+        game_copy(position((size_t)i), g);
+        random_move(g, &move_pile[i], &move_qty[i]);
+        if (rand_below(8) == 0) {
+            /* what clients get wrong: bad index or too many stones */
+            if (rand_below(2)) {
+                move_pile[i] = layout->piles + (int)rand_below(3);
+            } else {
+                move_qty[i] = (int)g->piles[move_pile[i]] + 1;
+            }
+        } else {
+            game_apply_move(g, move_pile[i], move_qty[i]);
+        }
+    }
+    free(g);
+
+    /* mostly MOVE and PLAY, as in a game; some OPEN, NAME and OVER */
+    for (int i = 0; i < CORPUS; i++) {
+        char *f = frames[i];
+        char *f1 = frames1[i];
+        const game_t *p = position((size_t)i);
+        int piles = p->layout->piles;
+        unsigned kind = rand_below(16);
+        if (kind < 7) {
+            int pile = move_pile[i] % 10;
+            frame_len[i] = ngp_build_move(f, NGP_MAX_MSG, pile, move_qty[i]);
+            frame1_len[i] = ngp1_build_move(f1, NGP_MAX_MSG,
+                                            pile, move_qty[i]);
+        } else if (kind < 13) {
+            frame_len[i] = ngp_build_play(f, NGP_MAX_MSG,
+                                          p->current_player, p->board);
+            frame1_len[i] = ngp1_build_play(f1, NGP_MAX_MSG,
+                                            p->current_player,
+                                            p->piles, piles);
+        } else if (kind == 13) {
+            char name[24];
+            int len = 3 + (int)rand_below(20);
+            for (int j = 0; j < len; j++) {
+                name[j] = (char)('a' + rand_below(26));
+            }
+            name[len] = '\0';
+            frame_len[i] = ngp_build_open(f, NGP_MAX_MSG, name);
+            frame1_len[i] = ngp1_build_open(f1, NGP_MAX_MSG, name);
+        } else if (kind == 14) {
+            frame_len[i] = ngp_build_name(f, NGP_MAX_MSG, 2, "opponent");
+            frame1_len[i] = ngp1_build_name(f1, NGP_MAX_MSG, 2, "opponent");
+        } else {
+            int forfeit = (int)rand_below(2);
+            frame_len[i] = ngp_build_over(f, NGP_MAX_MSG, 1, p->board,
+                                          forfeit);
+            frame1_len[i] = ngp1_build_over(f1, NGP_MAX_MSG, 1,
+                                            p->piles, piles, forfeit);
+        }
+        if (frame_len[i] == 0) {
+            /* a board too long for a frame; parse a MOVE instead */
+            frame_len[i] = ngp_build_move(f, NGP_MAX_MSG, 0, 1);
+            frame1_len[i] = ngp1_build_move(f1, NGP_MAX_MSG, 0, 1);
+        }
+    }
+    return 0;
+}
+
+/* --------------------------
+   Benchmarks
+   Each runs `ops` operations, cycling through its corpus.
+   -------------------------- */
+
+static void bench_parse(long long ops) {
+    char buf[NGP_MAX_MSG];
+    ngp_message msg;
+    size_t acc = 0;
+    for (long long i = 0; i < ops; i++) {
+        size_t k = (size_t)i & (CORPUS - 1);
+        /* ngp_parse splits fields in place, so parse a fresh copy */
+        memcpy(buf, frames[k], frame_len[k]);
+        acc += (size_t)ngp_parse(buf, frame_len[k], &msg) + msg.field_count;
+    }
+    sink = acc;
+}
+
+static void bench_parse1(long long ops) {
+    char buf[NGP_MAX_MSG];
+    ngp_message msg;
+    size_t acc = 0;
+    for (long long i = 0; i < ops; i++) {
+        size_t k = (size_t)i & (CORPUS - 1);
+        memcpy(buf, frames1[k], frame1_len[k]);
+        acc += (size_t)ngp_parse(buf, frame1_len[k], &msg) + msg.field_count;
+    }
+    sink = acc;
+}
+
+static void bench_build_play(long long ops) {
+    char out[NGP_MAX_MSG];
+    size_t acc = 0;
+    for (long long i = 0; i < ops; i++) {
+        const game_t *g = position((size_t)i & (CORPUS - 1));
+        acc += ngp_build_play(out, sizeof(out), g->current_player, g->board);
+    }
+    sink = acc + (size_t)out[5];
+}
+
+static void bench_build_over(long long ops) {
+    char out[NGP_MAX_MSG];
+    size_t acc = 0;
+    for (long long i = 0; i < ops; i++) {
+        const game_t *g = position((size_t)i & (CORPUS - 1));
+        acc += ngp_build_over(out, sizeof(out), g->current_player, g->board,
+                              (int)(i & 1));
+    }
+    sink = acc + (size_t)out[5];
+}
+
+static void bench_build_play1(long long ops) {
+    char out[NGP_MAX_MSG];
+    size_t acc = 0;
+    for (long long i = 0; i < ops; i++) {
+        const game_t *g = position((size_t)i & (CORPUS - 1));
+        acc += ngp1_build_play(out, sizeof(out), g->current_player,
+                               g->piles, g->layout->piles);
+    }
+    sink = acc + (size_t)out[3];
+}
+
+static void bench_build_over1(long long ops) {
+    char out[NGP_MAX_MSG];
+    size_t acc = 0;
+    for (long long i = 0; i < ops; i++) {
+        const game_t *g = position((size_t)i & (CORPUS - 1));
+        acc += ngp1_build_over(out, sizeof(out), g->current_player,
+                               g->piles, g->layout->piles, (int)(i & 1));
+    }
+    sink = acc + (size_t)out[3];
+}
+
+/* the board text behind PLAY and OVER; rendered in full only when a
+   game starts or a pile's digit count changes (see game.c) */
+static void bench_board_render(long long ops) {
+    size_t acc = 0;
+    for (long long i = 0; i < ops; i++) {
+        game_init(scratch, layout);
+        acc += scratch->board_len;
+    }
+    sink = acc;
+}
+
+static void bench_is_valid_move(long long ops) {
+    size_t acc = 0;
+    for (long long i = 0; i < ops; i++) {
+        size_t k = (size_t)i & (CORPUS - 1);
+        acc += (size_t)game_is_valid_move(position(k), move_pile[k],
+                                          move_qty[k]);
+    }
+    sink = acc;
+}
+
+static void bench_apply_move(long long ops) {
+    size_t acc = 0;
+    for (long long i = 0; i < ops; i++) {
+        size_t k = (size_t)i & (CORPUS - 1);
+        /* game_apply_move changes its game; apply to a copy */
+        game_t *g = scratch;
+        game_copy(g, position(k));
+        if (move_pile[k] < layout->piles
+            && (uint32_t)move_qty[k] <= g->piles[move_pile[k]]) {
+            game_apply_move(g, move_pile[k], move_qty[k]);
+        }
+        acc += g->board_len + g->piles[0];
+    }
+    sink = acc;
+}
+
+/* position evaluation, as the bot does it; one op is one position */
+static void bench_is_winning(long long ops) {
+    size_t acc = 0;
+    for (long long i = 0; i < ops; i++) {
+        acc += (size_t)rules_is_winning(position((size_t)i & (CORPUS - 1)));
+    }
+    sink = acc;
+}
+
+static void bench_best_move(long long ops) {
+    size_t acc = 0;
+    game_move_t m;
+    for (long long i = 0; i < ops; i++) {
+        const game_t *g = position((size_t)i & (CORPUS - 1));
+        if (!game_is_over(g) && rules_best_move(g, &m)) {
+            acc += m.qty[0];
+        }
+    }
+    sink = acc;
+}
+
+/* metric recording, as every event loop does it per message: a bump
+   of this thread's block, and a bucket lookup for a latency */
+static void bench_stats_count(long long ops) {
+    for (long long i = 0; i < ops; i++) {
+        stats_count(STAT_MOVES);
+    }
+}
+
+static void bench_stats_record(long long ops) {
+    for (long long i = 0; i < ops; i++) {
+        /* latencies spread over the first few decades of buckets */
+        stats_record(STAT_MOVE_TO_PLAY,
+                     (long long)(i * 2654435761u & 0xfffff));
+    }
+}
+
+/* the corpus copy and bookkeeping that bench_parse and
+   bench_apply_move include, to subtract by eye */
+static void bench_baseline(long long ops) {
+    char buf[NGP_MAX_MSG];
+    size_t acc = 0;
+    for (long long i = 0; i < ops; i++) {
+        size_t k = (size_t)i & (CORPUS - 1);
+        memcpy(buf, frames[k], frame_len[k]);
+        game_copy(scratch, position(k));
+        acc += (size_t)buf[frame_len[k] - 1] + scratch->board_len;
+    }
+    sink = acc;
+}
+
+static void run(const char *name, void (*fn)(long long)) {
+    /* calibrate: grow ops until one run takes about RUN_NS */
+    long long ops = 1024;
+    for (;;) {
+        long long t0 = now_ns();
+        fn(ops);
+        long long dt = now_ns() - t0;
+        if (dt >= RUN_NS / 4 || ops > (1LL << 40)) {
+            ops = (long long)((double)ops * RUN_NS / (dt > 0 ? dt : 1));
+            break;
+        }
+        ops *= 4;
+    }
+    if (ops < 1) ops = 1;
+
+    double best_ns = -1, best_cycles = -1;
+    for (int r = 0; r < RUNS; r++) {
+        long long c0 = read_cycles();
+        long long t0 = now_ns();
+        fn(ops);
+        long long t1 = now_ns();
+        long long c1 = read_cycles();
+
+        double ns = (double)(t1 - t0) / (double)ops;
+        if (best_ns < 0 || ns < best_ns) best_ns = ns;
+        if (c0 >= 0 && c1 >= 0) {
+            double cycles = (double)(c1 - c0) / (double)ops;
+            if (best_cycles < 0 || cycles < best_cycles) best_cycles = cycles;
+        }
+    }
+
+    result_t *res = &results[result_count++];
+    res->name = name;
+    res->ns_per_op = best_ns;
+    res->cycles_per_op = best_cycles;
+    res->ops = ops;
+}
+
+/* --------------------------
+   Output
+   -------------------------- */
+
+/* one result per line, so --compare can read it back with sscanf */
+static int write_json(const char *path, int cpu) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "{\n  \"cpu\": %d,\n  \"cycles\": %s,\n  \"results\": [\n",
+            cpu, cycles_fd >= 0 ? "true" : "false");
+    for (int i = 0; i < result_count; i++) {
+        const result_t *r = &results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"ns_per_op\": %.3f, ",
+                r->name, r->ns_per_op);
+        if (r->cycles_per_op >= 0) {
+            fprintf(f, "\"cycles_per_op\": %.2f, ", r->cycles_per_op);
+        } else {
+            fprintf(f, "\"cycles_per_op\": null, ");
+        }
+        fprintf(f, "\"ops\": %lld}%s\n", r->ops,
+                i + 1 < result_count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f);
+}
+
+/* ns/op recorded for name in an earlier --json file, or -1 */
+static double baseline_ns(const char *path, const char *name) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[256];
+    double found = -1;
+    while (fgets(line, sizeof(line), f)) {
+        char n[64];
+        double ns;
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"ns_per_op\": %lf",
+                   n, &ns) == 2 && strcmp(n, name) == 0) {
+            found = ns;
+            break;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr,
+            "  --cpu N           CPU to pin to (default: 0)\n"
+            "  --json PATH       write results as JSON\n"
+            "  --compare PATH    show the change from an earlier --json\n"
+            "  --board PILES     starting board, as for nimd --board\n"
+            "                    (default: 1,3,5,7,9)\n"
+            "  --rules RULES     rules to evaluate positions under, as for\n"
+            "                    nimd --rules (default: nim)\n");
+}
+
+int main(int argc, char **argv) {
+    int cpu = 0;
+    const char *json = NULL;
+    const char *compare = NULL;
+    static game_layout_t board;
+    static game_rules_t rules;
+    const char *rules_spec = NULL;
+    board = *game_default_layout();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            cpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            compare = argv[++i];
+        } else if (strcmp(argv[i], "--board") == 0 && i + 1 < argc
+                   && game_layout_parse(&board, argv[i + 1]) == 0) {
+            i++;
+        } else if (strcmp(argv[i], "--rules") == 0 && i + 1 < argc) {
+            rules_spec = argv[++i];
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (rules_spec) {
+        if (rules_parse(&rules, rules_spec) != 0) {
+            fprintf(stderr, "--rules: cannot use \"%s\"\n", rules_spec);
+            return EXIT_FAILURE;
+        }
+        board.rules = &rules;
+    }
+    layout = &board;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        perror("sched_setaffinity");
+    }
+    open_cycle_counter();
+    if (build_corpora() != 0) {
+        perror("build_corpora");
+        return EXIT_FAILURE;
+    }
+
+    run("ngp_parse", bench_parse);
+    run("ngp_build_play", bench_build_play);
+    run("ngp_build_over", bench_build_over);
+    run("ngp1_parse", bench_parse1);
+    run("ngp1_build_play", bench_build_play1);
+    run("ngp1_build_over", bench_build_over1);
+    run("board_render", bench_board_render);
+    run("game_is_valid_move", bench_is_valid_move);
+    run("game_apply_move", bench_apply_move);
+    run("rules_is_winning", bench_is_winning);
+    run("rules_best_move", bench_best_move);
+    run("stats_count", bench_stats_count);
+    run("stats_record", bench_stats_record);
+    run("baseline_copy", bench_baseline);
+
+    printf("CPU %d, %s\n", cpu, cycles_fd >= 0 ? "cycles from perf_event"
+                                              : "no cycle counter");
+    printf("%-20s %10s %12s", "benchmark", "ns/op", "cycles/op");
+    if (compare) printf(" %10s", "vs base");
+    printf("\n");
+    for (int i = 0; i < result_count; i++) {
+        const result_t *r = &results[i];
+        printf("%-20s %10.2f", r->name, r->ns_per_op);
+        if (r->cycles_per_op >= 0) printf(" %12.1f", r->cycles_per_op);
+        else printf(" %12s", "-");
+        if (compare) {
+            double base = baseline_ns(compare, r->name);
+            if (base > 0) {
+                printf(" %+9.1f%%", 100.0 * (r->ns_per_op - base) / base);
+            } else {
+                printf(" %10s", "-");
+            }
+        }
+        printf("\n");
+    }
+
+    if (json && write_json(json, cpu) != 0) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
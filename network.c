@@ -1,8 +1,10 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE   // SO_REUSEPORT
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <string.h>
 #include "network.h"
@@ -45,7 +47,7 @@ int connect_inet(char *host, char *service)
     return sock;
 }
 
-int open_listener(char *service, int queue_size)
+static int open_listener_opt(char *service, int queue_size, int reuseport)
 {
     struct addrinfo hint, *info_list, *info;
     int error, sock;
@@ -70,6 +72,16 @@ int open_listener(char *service, int queue_size)
         // if we could not create the socket, try the next method
         if (sock == -1) continue;
 
+        // let several sockets bind the same port; the kernel spreads
+        // incoming connections across them
+        if (reuseport) {
+            int one = 1;
+            if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+                close(sock);
+                continue;
+            }
+        }
+
         // bind socket to requested port
         error = bind(sock, info->ai_addr, info->ai_addrlen);
         if (error) {
@@ -98,3 +110,44 @@ int open_listener(char *service, int queue_size)
 
     return sock;
 }
+
+int open_listener(char *service, int queue_size)
+{
+    return open_listener_opt(service, queue_size, 0);
+}
+
+int open_reuseport_listener(char *service, int queue_size)
+{
+    return open_listener_opt(service, queue_size, 1);
+}
+
+int open_unix_listener(const char *path, int queue_size)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // a stale socket file from an earlier run would make bind fail
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))
+        || listen(sock, queue_size)) {
+        perror(path);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
@@ -1,2 +1,4 @@
 int connect_inet(char *host, char *service);
 int open_listener(char *service, int queue_size);
+int open_reuseport_listener(char *service, int queue_size);
+int open_unix_listener(const char *path, int queue_size);
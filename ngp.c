@@ -1,16 +1,28 @@
 #include "ngp.h"
+#include "wire.h"
 
+#include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+static int parse_v1(char *buf, size_t len, ngp_message *msg);
 
 // --------------------------
 // Parse NGP message
 // --------------------------
 
 int ngp_parse(char *buf, size_t len, ngp_message *msg) {
+    if (len > 0 && ((unsigned char)buf[0] == NGP1_VERSION
+                    || (unsigned char)buf[0] == NGP1_MUX)) {
+        return parse_v1(buf, len, msg);
+    }
     if (len == 0 || buf[len - 1] != '|') {
         return -1;
     }
+    msg->binary = 0;
+    msg->session = -1;
+    msg->version = (buf[0] >= '0' && buf[0] <= '9') ? buf[0] - '0' : 0;
 
     char *p   = buf;
     char *end = buf + len;
@@ -47,31 +59,379 @@ int ngp_parse(char *buf, size_t len, ngp_message *msg) {
     return 0;
 }
 
+// a text field as a number, or -1
+static long text_number(const char *field) {
+    char *endptr;
+    long v = strtol(field, &endptr, 10);
+    return (*endptr == '\0') ? v : -1;
+}
+
+int ngp_numbers(ngp_message *msg) {
+    if (!msg->binary) {
+        for (int i = 0; i < msg->field_count; i++) {
+            msg->values[i] = text_number(msg->fields[i]);
+        }
+    }
+    return msg->field_count;
+}
+
+long ngp_number(const ngp_message *msg, int i) {
+    if (i >= msg->field_count) return -1;
+    return msg->binary ? msg->values[i] : text_number(msg->fields[i]);
+}
+
+// --------------------------
+// Parse NGP v1
+// --------------------------
+
+static const char v1_types[][5] = {
+    [NGP1_WAIT] = "WAIT",
+    [NGP1_NAME] = "NAME",
+    [NGP1_PLAY] = "PLAY",
+    [NGP1_OVER] = "OVER",
+    [NGP1_FAIL] = "FAIL",
+    [NGP1_OPEN] = "OPEN",
+    [NGP1_MOVE] = "MOVE",
+    [NGP1_SPEC] = "SPEC",
+};
+
+// read the varint at *p, advancing past it; -1 if it runs past end or
+// does not fit in 32 bits
+static long get_varint(const unsigned char **p, const unsigned char *end) {
+    uint64_t v;
+    const unsigned char *next = wire_get_varint(*p, end, &v);
+    if (!next || v > UINT32_MAX) return -1;
+    *p = next;
+    return (long)v;
+}
+
+// a NUL-terminated string that ends the frame, or NULL. It may not
+// hold a '|', so that it can be passed on in a text frame.
+static char *get_str(const unsigned char *p, const unsigned char *end) {
+    if (p == end || memchr(p, '\0', (size_t)(end - p)) != end - 1
+        || memchr(p, '|', (size_t)(end - p)) != NULL) {
+        return NULL;
+    }
+    return (char *)p;
+}
+
+// a board that ends the frame: its pile count, or -1
+static long check_board(const unsigned char *p, const unsigned char *end) {
+    long count = get_varint(&p, end);
+    for (long i = 0; i < count; i++) {
+        if (get_varint(&p, end) < 0) return -1;
+    }
+    return (p == end) ? count : -1;
+}
+
+// fields are stored by position, as in text: numbers in values (with
+// fields[i] NULL), strings and boards in fields (with values[i] -1)
+static int parse_v1(char *buf, size_t len, ngp_message *msg) {
+    const unsigned char *p = (const unsigned char *)buf + NGP1_HEADER_LEN;
+    const unsigned char *end = (const unsigned char *)buf + len;
+    if (len <= NGP1_HEADER_LEN
+        || (unsigned char)buf[1] != len - NGP1_HEADER_LEN) {
+        return -1;
+    }
+    msg->session = -1;
+    if ((unsigned char)buf[0] == NGP1_MUX
+        && ((msg->session = get_varint(&p, end)) < 0 || p == end)) {
+        return -1;
+    }
+    int type = *p++;
+    if (type < NGP1_WAIT || type > NGP1_SPEC) return -1;
+    memcpy(msg->type, v1_types[type], sizeof(msg->type));
+    msg->binary = 1;
+    msg->version = 1;
+    msg->field_count = 0;
+
+    switch (type) {
+    case NGP1_WAIT:
+        return (p == end) ? 0 : -1;
+    case NGP1_OPEN:
+    case NGP1_SPEC:
+        msg->fields[0] = get_str(p, end);
+        msg->values[0] = -1;
+        msg->field_count = 1;
+        return msg->fields[0] ? 0 : -1;
+    case NGP1_MOVE:
+        while (p < end) {
+            if (msg->field_count == NGP_MAX_FIELDS) return -1;
+            long v = get_varint(&p, end);
+            if (v < 0) return -1;
+            msg->fields[msg->field_count] = NULL;
+            msg->values[msg->field_count++] = v;
+        }
+        return 0;
+    case NGP1_FAIL:
+        if (end - p != 1) return -1;
+        msg->fields[0] = NULL;
+        msg->values[0] = *p;
+        msg->field_count = 1;
+        return 0;
+    case NGP1_NAME:
+        if (p == end) return -1;
+        msg->fields[0] = NULL;
+        msg->values[0] = *p++;
+        msg->fields[1] = get_str(p, end);
+        msg->values[1] = -1;
+        msg->field_count = 2;
+        return msg->fields[1] ? 0 : -1;
+    default:    // PLAY, OVER
+        if (end - p < ((type == NGP1_OVER) ? 2 : 1)) return -1;
+        msg->fields[0] = NULL;
+        msg->values[0] = *p++;
+        msg->field_count = 2;
+        if (type == NGP1_OVER) {
+            msg->fields[2] = NULL;
+            msg->values[2] = *p++;
+            msg->field_count = 3;
+        }
+        msg->fields[1] = (char *)p;
+        msg->values[1] = check_board(p, end);
+        return (msg->values[1] < 0) ? -1 : 0;
+    }
+}
+
+int ngp1_board(const ngp_message *msg, uint32_t *piles, int cap) {
+    const unsigned char *p = (const unsigned char *)msg->fields[1];
+    const unsigned char *end = p + NGP_MAX_MSG;     // checked by parse_v1
+    long count = get_varint(&p, end);
+    int n = (count < cap) ? (int)count : cap;
+    for (int i = 0; i < n; i++) {
+        piles[i] = (uint32_t)get_varint(&p, end);
+    }
+    return n;
+}
+
+// --------------------------
+// Streaming framer
+// --------------------------
+
+#define RING_MASK (NGP_RING_SIZE - 1)
+
+void ngp_framer_init(ngp_framer_t *f) {
+    f->head = 0;
+    f->tail = 0;
+}
+
+ssize_t ngp_framer_read(ngp_framer_t *f, int fd) {
+    size_t used = f->tail - f->head;
+    size_t space = NGP_RING_SIZE - used;
+    if (space == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    // free space is at most two pieces: up to the end of the array,
+    // then from the start of the array up to head
+    size_t start = f->tail & RING_MASK;
+    size_t first = NGP_RING_SIZE - start;
+    if (first > space) first = space;
+
+    struct iovec iov[2];
+    iov[0].iov_base = f->data + start;
+    iov[0].iov_len  = first;
+    iov[1].iov_base = f->data;
+    iov[1].iov_len  = space - first;
+
+    ssize_t n = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+    if (n > 0) {
+        f->tail += (size_t)n;
+    }
+    return n;
+}
+
+// validate the "V|LL|" header; on success store the whole frame length
+static int framer_peek(const ngp_framer_t *f, size_t *frame_len) {
+    size_t avail = f->tail - f->head;
+    char hdr[NGP_HEADER_LEN];
+    size_t n = avail < NGP_HEADER_LEN ? avail : NGP_HEADER_LEN;
+
+    for (size_t i = 0; i < n; i++) {
+        hdr[i] = f->data[(f->head + i) & RING_MASK];
+    }
+
+    // NGP v1: a binary length byte
+    if (n > 0 && ((unsigned char)hdr[0] == NGP1_VERSION
+                  || (unsigned char)hdr[0] == NGP1_MUX)) {
+        if (n < NGP1_HEADER_LEN) return 0;
+        size_t body_len = (unsigned char)hdr[1];
+        if (body_len < 1 || NGP1_HEADER_LEN + body_len > NGP_MAX_MSG) {
+            return -1;
+        }
+        if (avail < NGP1_HEADER_LEN + body_len) return 0;
+        *frame_len = NGP1_HEADER_LEN + body_len;
+        return 1;
+    }
+
+    // reject as soon as any byte seen so far is wrong
+    if (n > 0 && (hdr[0] < '0' || hdr[0] > '9')) return -1;
+    if (n > 1 && hdr[1] != '|') return -1;
+    if (n > 2 && (hdr[2] < '0' || hdr[2] > '9')) return -1;
+    if (n > 3 && (hdr[3] < '0' || hdr[3] > '9')) return -1;
+    if (n > 4 && hdr[4] != '|') return -1;
+    if (n < NGP_HEADER_LEN) return 0;
+
+    // the shortest body is "TYPE|"
+    size_t body_len = (size_t)((hdr[2] - '0') * 10 + (hdr[3] - '0'));
+    if (body_len < 5) return -1;
+
+    if (avail < NGP_HEADER_LEN + body_len) return 0;
+    *frame_len = NGP_HEADER_LEN + body_len;
+    return 1;
+}
+
+int ngp_framer_ready(const ngp_framer_t *f) {
+    size_t frame_len;
+    return framer_peek(f, &frame_len);
+}
+
+int ngp_framer_next(ngp_framer_t *f, char *buf, size_t cap, size_t *len) {
+    size_t frame_len;
+    int rc = framer_peek(f, &frame_len);
+    if (rc <= 0) return rc;
+    if (frame_len > cap) return -1;
+
+    size_t start = f->head & RING_MASK;
+    size_t first = NGP_RING_SIZE - start;
+    if (first > frame_len) first = frame_len;
+    memcpy(buf, f->data + start, first);
+    memcpy(buf + first, f->data, frame_len - first);
+
+    f->head += frame_len;
+    *len = frame_len;
+    return 1;
+}
+
+size_t ngp_framer_save(const ngp_framer_t *f, char *out) {
+    size_t used = f->tail - f->head;
+    size_t start = f->head & RING_MASK;
+    size_t first = NGP_RING_SIZE - start;
+    if (first > used) first = used;
+    memcpy(out, f->data + start, first);
+    memcpy(out + first, f->data, used - first);
+    return used;
+}
+
+void ngp_framer_load(ngp_framer_t *f, const char *data, size_t len) {
+    if (len > NGP_RING_SIZE) len = NGP_RING_SIZE;
+    memcpy(f->data, data, len);
+    f->head = 0;
+    f->tail = len;
+}
+
+// --------------------------
+// Encoder
+//
+// Frames are written in one pass: the fixed-width "0|LL|" header is
+// reserved, the body is appended directly after it, and the two length
+// digits are filled in last. Nothing goes through snprintf or a
+// temporary body buffer.
+// --------------------------
+
+#define NGP_MAX_BODY 99   // two-digit length field
+
+#define FRAME(lit) { lit, sizeof(lit) - 1 }
+
+const ngp_frame ngp_wait_frame = FRAME("0|05|WAIT|");
+
+static const ngp_frame fail_frames[] = {
+    FRAME("0|16|FAIL|10 Invalid|"),
+    FRAME("0|18|FAIL|21 Long Name|"),
+    FRAME("0|24|FAIL|22 Already Playing|"),
+    FRAME("0|21|FAIL|23 Already Open|"),
+    FRAME("0|20|FAIL|24 Not Playing|"),
+    FRAME("0|19|FAIL|25 Lobby Full|"),
+    FRAME("0|18|FAIL|31 Impatient|"),
+    FRAME("0|19|FAIL|32 Pile Index|"),
+    FRAME("0|17|FAIL|33 Quantity|"),
+};
+
+const ngp_frame *ngp_fail_frame(int code) {
+    switch (code) {
+    case 10: return &fail_frames[0];
+    case 21: return &fail_frames[1];
+    case 22: return &fail_frames[2];
+    case 23: return &fail_frames[3];
+    case 24: return &fail_frames[4];
+    case 25: return &fail_frames[5];
+    case 31: return &fail_frames[6];
+    case 32: return &fail_frames[7];
+    case 33: return &fail_frames[8];
+    default: return NULL;
+    }
+}
+
+static size_t uint_len(unsigned v) {
+    size_t n = 1;
+    while (v >= 10) {
+        v /= 10;
+        n++;
+    }
+    return n;
+}
+
+static char *put_uint(char *p, unsigned v, size_t width) {
+    for (size_t i = width; i > 0; i--) {
+        p[i - 1] = (char)('0' + v % 10);
+        v /= 10;
+    }
+    return p + width;
+}
+
+static char *put_str(char *p, const char *s, size_t n) {
+    memcpy(p, s, n);
+    return p + n;
+}
+
+// check that a body of body_len bytes fits; returns the frame length
+// or 0 if it cannot be encoded into cap bytes
+static size_t frame_fits(size_t body_len, size_t cap) {
+    if (body_len > NGP_MAX_BODY) return 0;
+    if (NGP_HEADER_LEN + body_len > cap) return 0;
+    return NGP_HEADER_LEN + body_len;
+}
+
+static char *put_header(char *p, size_t body_len) {
+    p[0] = '0';
+    p[1] = '|';
+    p[2] = (char)('0' + body_len / 10);
+    p[3] = (char)('0' + body_len % 10);
+    p[4] = '|';
+    return p + NGP_HEADER_LEN;
+}
+
 // --------------------------
 // Build WAIT
 // --------------------------
 
 size_t ngp_build_wait(char *buf, size_t cap) {
-    const char *body = "WAIT|";
-    int body_len = (int)strlen(body); // bytes after length field
-
-    int written = snprintf(buf, cap, "0|%02d|%s", body_len, body);
-    if (written < 0) return 0;
-    return (size_t)written;
+    if (cap < ngp_wait_frame.len) return 0;
+    memcpy(buf, ngp_wait_frame.data, ngp_wait_frame.len);
+    return ngp_wait_frame.len;
 }
 
 // --------------------------
 // Build FAIL
+// FAIL|<code> <msg>|
 // --------------------------
 
 size_t ngp_build_fail(char *buf, size_t cap, int code, const char *msg) {
-    char body[256];
-    int blen = snprintf(body, sizeof(body), "FAIL|%d %s|", code, msg);
-    if (blen < 0) return 0;
+    if (code < 0) return 0;
+    size_t clen = uint_len((unsigned)code);
+    size_t mlen = strlen(msg);
+    size_t body_len = 5 + clen + 1 + mlen + 1;
+    size_t total = frame_fits(body_len, cap);
+    if (total == 0) return 0;
 
-    int written = snprintf(buf, cap, "0|%02d|%s", blen, body);
-    if (written < 0) return 0;
-    return (size_t)written;
+    char *p = put_header(buf, body_len);
+    p = put_str(p, "FAIL|", 5);
+    p = put_uint(p, (unsigned)code, clen);
+    *p++ = ' ';
+    p = put_str(p, msg, mlen);
+    *p = '|';
+    return total;
 }
 
 // --------------------------
@@ -81,14 +441,20 @@ size_t ngp_build_fail(char *buf, size_t cap, int code, const char *msg) {
 
 size_t ngp_build_name(char *buf, size_t cap,
                       int player_num, const char *opponent_name) {
-    char body[256];
-    int blen = snprintf(body, sizeof(body),
-                        "NAME|%d|%s|", player_num, opponent_name);
-    if (blen < 0) return 0;
+    if (player_num < 0) return 0;
+    size_t plen = uint_len((unsigned)player_num);
+    size_t nlen = strlen(opponent_name);
+    size_t body_len = 5 + plen + 1 + nlen + 1;
+    size_t total = frame_fits(body_len, cap);
+    if (total == 0) return 0;
 
-    int written = snprintf(buf, cap, "0|%02d|%s", blen, body);
-    if (written < 0) return 0;
-    return (size_t)written;
+    char *p = put_header(buf, body_len);
+    p = put_str(p, "NAME|", 5);
+    p = put_uint(p, (unsigned)player_num, plen);
+    *p++ = '|';
+    p = put_str(p, opponent_name, nlen);
+    *p = '|';
+    return total;
 }
 
 // --------------------------
@@ -99,14 +465,20 @@ size_t ngp_build_name(char *buf, size_t cap,
 
 size_t ngp_build_play(char *buf, size_t cap,
                       int next_player, const char *board_str) {
-    char body[256];
-    int blen = snprintf(body, sizeof(body),
-                        "PLAY|%d|%s|", next_player, board_str);
-    if (blen < 0) return 0;
+    if (next_player < 0) return 0;
+    size_t plen = uint_len((unsigned)next_player);
+    size_t blen = strlen(board_str);
+    size_t body_len = 5 + plen + 1 + blen + 1;
+    size_t total = frame_fits(body_len, cap);
+    if (total == 0) return 0;
 
-    int written = snprintf(buf, cap, "0|%02d|%s", blen, body);
-    if (written < 0) return 0;
-    return (size_t)written;
+    char *p = put_header(buf, body_len);
+    p = put_str(p, "PLAY|", 5);
+    p = put_uint(p, (unsigned)next_player, plen);
+    *p++ = '|';
+    p = put_str(p, board_str, blen);
+    *p = '|';
+    return total;
 }
 
 // --------------------------
@@ -117,13 +489,238 @@ size_t ngp_build_play(char *buf, size_t cap,
 
 size_t ngp_build_over(char *buf, size_t cap,
                       int winner, const char *board_str, int forfeit) {
-    char body[256];
-    const char *reason = forfeit ? "Forfeit" : "";
-    int blen = snprintf(body, sizeof(body),
-                        "OVER|%d|%s|%s|", winner, board_str, reason);
-    if (blen < 0) return 0;
-
-    int written = snprintf(buf, cap, "0|%02d|%s", blen, body);
-    if (written < 0) return 0;
-    return (size_t)written;
+    if (winner < 0) return 0;
+    size_t wlen = uint_len((unsigned)winner);
+    size_t blen = strlen(board_str);
+    size_t rlen = forfeit ? 7 : 0;
+    size_t body_len = 5 + wlen + 1 + blen + 1 + rlen + 1;
+    size_t total = frame_fits(body_len, cap);
+    if (total == 0) return 0;
+
+    char *p = put_header(buf, body_len);
+    p = put_str(p, "OVER|", 5);
+    p = put_uint(p, (unsigned)winner, wlen);
+    *p++ = '|';
+    p = put_str(p, board_str, blen);
+    *p++ = '|';
+    p = put_str(p, "Forfeit", rlen);
+    *p = '|';
+    return total;
+}
+
+// --------------------------
+// Client messages
+// OPEN|<name>|
+// MOVE|<pile>|<quantity>|
+// --------------------------
+
+size_t ngp_build_open(char *buf, size_t cap, const char *name) {
+    size_t nlen = strlen(name);
+    size_t body_len = 5 + nlen + 1;
+    size_t total = frame_fits(body_len, cap);
+    if (total == 0) return 0;
+
+    char *p = put_header(buf, body_len);
+    p = put_str(p, "OPEN|", 5);
+    p = put_str(p, name, nlen);
+    *p = '|';
+    return total;
+}
+
+size_t ngp_build_move(char *buf, size_t cap, int pile, int quantity) {
+    if (pile < 0 || quantity < 0) return 0;
+    size_t plen = uint_len((unsigned)pile);
+    size_t qlen = uint_len((unsigned)quantity);
+    size_t body_len = 5 + plen + 1 + qlen + 1;
+    size_t total = frame_fits(body_len, cap);
+    if (total == 0) return 0;
+
+    char *p = put_header(buf, body_len);
+    p = put_str(p, "MOVE|", 5);
+    p = put_uint(p, (unsigned)pile, plen);
+    *p++ = '|';
+    p = put_uint(p, (unsigned)quantity, qlen);
+    *p = '|';
+    return total;
+}
+
+// --------------------------
+// NGP v1 encoder
+//
+// The same one pass: the two header bytes are reserved, the body is
+// appended, and its length is filled in last.
+// --------------------------
+
+#define FRAME1(lit) { lit, sizeof(lit) - 1 }
+
+const ngp_frame ngp1_wait_frame = FRAME1("\x01\x01\x01");
+
+static const ngp_frame fail1_frames[] = {
+    FRAME1("\x01\x02\x05\x0a"),
+    FRAME1("\x01\x02\x05\x15"),
+    FRAME1("\x01\x02\x05\x16"),
+    FRAME1("\x01\x02\x05\x17"),
+    FRAME1("\x01\x02\x05\x18"),
+    FRAME1("\x01\x02\x05\x19"),
+    FRAME1("\x01\x02\x05\x1f"),
+    FRAME1("\x01\x02\x05\x20"),
+    FRAME1("\x01\x02\x05\x21"),
+};
+
+const ngp_frame *ngp1_fail_frame(int code) {
+    const ngp_frame *text = ngp_fail_frame(code);
+    return text ? &fail1_frames[text - fail_frames] : NULL;
+}
+
+// the most bytes a v1 frame may take in cap: every frame must also pass
+// the framer's NGP_MAX_MSG limit
+static char *frame1_limit(char *buf, size_t cap) {
+    return buf + ((cap < NGP_MAX_MSG) ? cap : NGP_MAX_MSG);
+}
+
+static size_t put_header1(char *buf, char *end) {
+    buf[0] = NGP1_VERSION;
+    buf[1] = (char)(end - buf - NGP1_HEADER_LEN);
+    return (size_t)(end - buf);
+}
+
+// a board; NULL if it runs past limit. A varint takes at most 5
+// bytes, so a board with room for that many is written unchecked.
+static char *put_board1(char *p, const char *limit,
+                        const uint32_t *piles, int count) {
+    if (count < 0 || (size_t)(limit - p) < wire_varint_len((uint32_t)count)) {
+        return NULL;
+    }
+    p = wire_put_varint(p, (uint32_t)count);
+    if ((size_t)(limit - p) >= 5 * (size_t)count) {
+        for (int i = 0; i < count; i++) {
+            p = wire_put_varint(p, piles[i]);
+        }
+        return p;
+    }
+    for (int i = 0; i < count; i++) {
+        if ((size_t)(limit - p) < wire_varint_len(piles[i])) return NULL;
+        p = wire_put_varint(p, piles[i]);
+    }
+    return p;
+}
+
+size_t ngp1_build_name(char *buf, size_t cap,
+                       int player_num, const char *opponent_name) {
+    size_t nlen = strlen(opponent_name) + 1;
+    if (player_num < 0 || player_num > 0xff) return 0;
+    if (NGP1_HEADER_LEN + 2 + nlen > (size_t)(frame1_limit(buf, cap) - buf)) {
+        return 0;
+    }
+    char *p = buf + NGP1_HEADER_LEN;
+    *p++ = NGP1_NAME;
+    *p++ = (char)player_num;
+    p = put_str(p, opponent_name, nlen);
+    return put_header1(buf, p);
+}
+
+size_t ngp1_build_play(char *buf, size_t cap, int next_player,
+                       const uint32_t *piles, int count) {
+    char *limit = frame1_limit(buf, cap);
+    if (next_player < 0 || next_player > 0xff
+        || limit - buf < NGP1_HEADER_LEN + 2) {
+        return 0;
+    }
+    char *p = buf + NGP1_HEADER_LEN;
+    *p++ = NGP1_PLAY;
+    *p++ = (char)next_player;
+    p = put_board1(p, limit, piles, count);
+    return p ? put_header1(buf, p) : 0;
+}
+
+size_t ngp1_build_over(char *buf, size_t cap, int winner,
+                       const uint32_t *piles, int count, int forfeit) {
+    char *limit = frame1_limit(buf, cap);
+    if (winner < 0 || winner > 0xff || limit - buf < NGP1_HEADER_LEN + 3) {
+        return 0;
+    }
+    char *p = buf + NGP1_HEADER_LEN;
+    *p++ = NGP1_OVER;
+    *p++ = (char)winner;
+    *p++ = (char)(forfeit != 0);
+    p = put_board1(p, limit, piles, count);
+    return p ? put_header1(buf, p) : 0;
+}
+
+size_t ngp1_build_open(char *buf, size_t cap, const char *name) {
+    size_t nlen = strlen(name) + 1;
+    if (NGP1_HEADER_LEN + 1 + nlen > (size_t)(frame1_limit(buf, cap) - buf)) {
+        return 0;
+    }
+    char *p = buf + NGP1_HEADER_LEN;
+    *p++ = NGP1_OPEN;
+    p = put_str(p, name, nlen);
+    return put_header1(buf, p);
+}
+
+size_t ngp1_build_move(char *buf, size_t cap, int pile, int quantity) {
+    if (pile < 0 || quantity < 0) return 0;
+    size_t body_len = 1 + wire_varint_len((uint32_t)pile)
+                    + wire_varint_len((uint32_t)quantity);
+    if (NGP1_HEADER_LEN + body_len > (size_t)(frame1_limit(buf, cap) - buf)) {
+        return 0;
+    }
+    char *p = buf + NGP1_HEADER_LEN;
+    *p++ = NGP1_MOVE;
+    p = wire_put_varint(p, (uint32_t)pile);
+    p = wire_put_varint(p, (uint32_t)quantity);
+    return put_header1(buf, p);
+}
+
+size_t ngp1_tag(char *buf, size_t cap, uint32_t session,
+                const char *frame, size_t len) {
+    size_t body_len = len - NGP1_HEADER_LEN;
+    char *limit = frame1_limit(buf, cap);
+    if (len <= NGP1_HEADER_LEN || (size_t)(limit - buf)
+        < NGP1_HEADER_LEN + wire_varint_len(session) + body_len) {
+        return 0;
+    }
+    char *p = wire_put_varint(buf + NGP1_HEADER_LEN, session);
+    p = put_str(p, frame + NGP1_HEADER_LEN, body_len);
+    buf[0] = NGP1_MUX;
+    buf[1] = (char)(p - buf - NGP1_HEADER_LEN);
+    return (size_t)(p - buf);
+}
+
+// --------------------------
+// Board frames
+// --------------------------
+
+void ngp_board_frame_init(ngp_board_frame_t *f, int type, int player,
+                          int forfeit, const char *board,
+                          const uint32_t *piles, int count) {
+    f->type = type;
+    f->player = player;
+    f->forfeit = forfeit;
+    f->board = board;
+    f->piles = piles;
+    f->count = count;
+    f->len[0] = 0;
+    f->len[1] = 0;
+}
+
+size_t ngp_board_frame(ngp_board_frame_t *f, int version,
+                       const char **data) {
+    int v = (version == 1);
+    char *buf = f->data[v];
+    if (f->len[v] == 0) {
+        if (f->type == NGP1_PLAY) {
+            f->len[v] = v ? ngp1_build_play(buf, NGP_MAX_MSG, f->player,
+                                            f->piles, f->count)
+                          : ngp_build_play(buf, NGP_MAX_MSG, f->player,
+                                           f->board);
+        } else {
+            f->len[v] = v ? ngp1_build_over(buf, NGP_MAX_MSG, f->player,
+                                            f->piles, f->count, f->forfeit)
+                          : ngp_build_over(buf, NGP_MAX_MSG, f->player,
+                                           f->board, f->forfeit);
+        }
+    }
+    *data = buf;
+    return f->len[v];
 }
@@ -2,19 +2,141 @@
 #define NGP_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #define NGP_MAX_FIELDS 8
+#define NGP_HEADER_LEN 5     // "0|LL|"
+#define NGP_MAX_MSG    104   // header + at most 99 body bytes
+#define NGP_RING_SIZE  512   // per-connection input buffer (power of two)
+
+// NGP v1 is a binary encoding of the same messages. A client selects it
+// by sending version 1 in its OPEN, either as text ("1|LL|OPEN|name|")
+// or as a binary frame, and is sent binary frames from then on. Both
+// encodings can share a stream: a binary frame starts with the byte
+// NGP1_VERSION, which no text frame does.
+//
+//   u8  NGP1_VERSION
+//   u8  body length (the type byte and the fields)
+//   u8  type (NGP1_*)
+//   fields, by type:
+//     OPEN, SPEC  name, NUL-terminated
+//     MOVE        varint pile, varint quantity; more pairs for variants
+//                 that take from several piles (rules.h)
+//     WAIT        none
+//     NAME        u8 player number, opponent's name NUL-terminated
+//     PLAY        u8 next player, board
+//     OVER        u8 winner, u8 1 if by forfeit, board
+//     FAIL        u8 code
+//   board: varint pile count, then a varint per pile
+//
+// Varints are LEB128: 7 bits per byte, low bits first, the high bit set
+// on every byte but the last. No binary frame is longer than the text
+// one for the same message, so every board a text client can be sent
+// fits in a binary frame too.
+//
+// A multiplexed connection (nimd --mux) carries many players, each
+// under a session id the client picks in its OPEN. Its frames are v1
+// frames tagged with the id, in both directions:
+//
+//   u8  NGP1_MUX
+//   u8  body length (the id, the type byte and the fields)
+//   varint session id
+//   u8  type, fields as above
+
+#define NGP1_VERSION    0x01
+#define NGP1_MUX        0x02
+#define NGP1_HEADER_LEN 2
+
+enum {
+    NGP1_WAIT = 1,
+    NGP1_NAME,
+    NGP1_PLAY,
+    NGP1_OVER,
+    NGP1_FAIL,
+    NGP1_OPEN,
+    NGP1_MOVE,
+    NGP1_SPEC
+};
 
 typedef struct {
     char type[5];           // "OPEN", "MOVE", etc, null-terminated
     int  field_count;
     char *fields[NGP_MAX_FIELDS]; // pointers into the original buffer
+    int  version;           // the version field: 0, or 1 if asked for
+    int  binary;            // 1 for an NGP v1 frame
+    long session;           // an NGP1_MUX frame's session id, else -1
+    // numeric fields, by position: filled by ngp_parse for binary frames
+    // (and for text MOVEs by ngp_numbers); a binary PLAY or OVER has the
+    // pile count in values[1] and its board (for ngp1_board) in fields[1]
+    long values[NGP_MAX_FIELDS];
 } ngp_message;
 
-// Parse one complete NGP message from buf[0..len-1] into msg.
-// Returns 0 on success, non-zero on error.
+// Parse one complete NGP message, text or binary, from buf[0..len-1]
+// into msg. Returns 0 on success, non-zero on error.
 int ngp_parse(char *buf, size_t len, ngp_message *msg);
 
+// Fill msg->values from a text message's fields (binary ones are parsed
+// that way): each field as a decimal number, or -1 if it is not one.
+// Returns field_count.
+int ngp_numbers(ngp_message *msg);
+
+// Numeric field i of either version, or -1
+long ngp_number(const ngp_message *msg, int i);
+
+// Decode the board of a binary PLAY or OVER into piles (at most cap);
+// returns the pile count
+int ngp1_board(const ngp_message *msg, uint32_t *piles, int cap);
+
+// Incremental framer over a per-connection ring buffer. Bytes are read
+// from the socket in batches and complete frames are pulled out one at
+// a time using the "0|LL|" length prefix (or v1's length byte); a
+// partial frame stays buffered until the rest arrives.
+typedef struct {
+    char   data[NGP_RING_SIZE];
+    size_t head;   // next byte to consume (free-running)
+    size_t tail;   // next byte to fill (free-running)
+} ngp_framer_t;
+
+void ngp_framer_init(ngp_framer_t *f);
+
+// Read as many bytes as fit from fd. Returns the byte count, 0 on EOF,
+// or -1 with errno set (EAGAIN on a non-blocking socket with no data).
+ssize_t ngp_framer_read(ngp_framer_t *f, int fd);
+
+// Inspect the buffered bytes: 1 if a complete frame is available,
+// 0 if more bytes are needed, -1 if the header is malformed (bad
+// version or length field) and the stream cannot be resynchronized.
+int ngp_framer_ready(const ngp_framer_t *f);
+
+// Copy the next complete frame into buf (cap >= NGP_MAX_MSG) and store
+// its length in *len. Same return values as ngp_framer_ready.
+int ngp_framer_next(ngp_framer_t *f, char *buf, size_t cap, size_t *len);
+
+// Copy the bytes buffered but not yet consumed into out (NGP_RING_SIZE
+// bytes) and return their count; ngp_framer_load puts them back into a
+// fresh framer, as when a connection moves to a new process
+size_t ngp_framer_save(const ngp_framer_t *f, char *out);
+void ngp_framer_load(ngp_framer_t *f, const char *data, size_t len);
+
+// A complete, pre-encoded frame
+typedef struct {
+    const char *data;
+    size_t len;
+} ngp_frame;
+
+// Constant frames, encoded once at compile time
+extern const ngp_frame ngp_wait_frame;
+extern const ngp_frame ngp1_wait_frame;
+
+// FAIL frame for a protocol error code (10, 21-25, 31-33), or NULL
+const ngp_frame *ngp_fail_frame(int code);
+const ngp_frame *ngp1_fail_frame(int code);
+
+// Builders write the header and body in one pass straight into buf and
+// return the frame length, or 0 if it does not fit in cap bytes (or in
+// the two-digit length field).
+
 // Build simple messages
 size_t ngp_build_wait(char *buf, size_t cap);
 size_t ngp_build_fail(char *buf, size_t cap, int code, const char *msg);
@@ -29,4 +151,46 @@ size_t ngp_build_play(char *buf, size_t cap,
 size_t ngp_build_over(char *buf, size_t cap,
                       int winner, const char *board_str, int forfeit);
 
+// Client messages, for test and load-generating clients
+size_t ngp_build_open(char *buf, size_t cap, const char *name);
+size_t ngp_build_move(char *buf, size_t cap, int pile, int quantity);
+
+// The same in NGP v1; boards are pile counts instead of text
+size_t ngp1_build_name(char *buf, size_t cap,
+                       int player_num, const char *opponent_name);
+size_t ngp1_build_play(char *buf, size_t cap, int next_player,
+                       const uint32_t *piles, int count);
+size_t ngp1_build_over(char *buf, size_t cap, int winner,
+                       const uint32_t *piles, int count, int forfeit);
+size_t ngp1_build_open(char *buf, size_t cap, const char *name);
+size_t ngp1_build_move(char *buf, size_t cap, int pile, int quantity);
+
+// Tag a v1 frame with a session id, for a multiplexed connection
+size_t ngp1_tag(char *buf, size_t cap, uint32_t session,
+                const char *frame, size_t len);
+
+// A PLAY or OVER frame, encoded in each version the first time it is
+// asked for: a board sent to players who speak different versions (and
+// to spectators, who read text) is encoded at most twice, and a board
+// only binary clients see is never rendered into a text frame
+typedef struct {
+    int type;               // NGP1_PLAY or NGP1_OVER
+    int player;             // next player, or the winner
+    int forfeit;            // OVER only
+    const char *board;      // text, "1 3 5 7 9"
+    const uint32_t *piles;  // the same board as pile counts
+    int count;
+    size_t len[2];          // per version; 0 until built
+    char data[2][NGP_MAX_MSG];
+} ngp_board_frame_t;
+
+void ngp_board_frame_init(ngp_board_frame_t *f, int type, int player,
+                          int forfeit, const char *board,
+                          const uint32_t *piles, int count);
+
+// The frame in version (0 or 1); returns its length, or 0 if it does
+// not fit in a frame
+size_t ngp_board_frame(ngp_board_frame_t *f, int version,
+                       const char **data);
+
 #endif
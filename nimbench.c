@@ -0,0 +1,635 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "network.h"
+#include "ngp.h"
+#include "outq.h"
+#include "wheel.h"
+#include "game.h"
+
+/* nimbench: load generator for nimd. Simulated players connect, play
+   whole games against each other through the server and measure how
+   long it takes to be paired (OPEN -> NAME) and to see a move take
+   effect (MOVE -> PLAY).
+
+   closed loop (default): --players N are always connected; a player
+   whose game ends reconnects at once, so load follows server speed.
+   open loop (--rate N): N new players arrive per second whatever the
+   server does; each plays one game. Latencies are measured from the
+   scheduled arrival, so a slow server cannot hide its own backlog. */
+
+#define MAX_EVENTS 256
+#define RETRY_MS 100       /* reconnect delay after a failed connect */
+
+typedef enum { STRAT_RANDOM, STRAT_GREEDY, STRAT_OPTIMAL } strategy_t;
+
+typedef struct {
+    char *host;
+    char *service;
+    int players;           /* closed loop: concurrent players */
+    double rate;           /* open loop: arrivals per second (0: closed) */
+    int duration_s;
+    int think_ms;          /* mean think time before each MOVE */
+    strategy_t strategy;
+    int threads;
+    int binary;            /* speak NGP v1 */
+} bench_config_t;
+
+/* every thread stops measuring before any closes its players, which
+   would hand their opponents on other threads a forfeit */
+static pthread_barrier_t stop_barrier;
+
+static bench_config_t config = {
+    .host = "localhost",
+    .players = 1000,
+    .duration_s = 10,
+    .strategy = STRAT_RANDOM,
+    .threads = 1,
+};
+
+/* a growable array of latency samples, in microseconds */
+typedef struct {
+    long long *v;
+    size_t n;
+    size_t cap;
+} samples_t;
+
+typedef struct bench bench_t;
+
+/* an NGP frame has room for at most 42 one-digit piles */
+#define BOARD_MAX_PILES 42
+
+typedef struct bot {
+    int fd;
+    int num;                      /* 1 or 2 once NAME arrives */
+    int done;                     /* OVER seen */
+    char name[24];
+    ngp_framer_t in;
+    outq_t out;
+    long long open_us;            /* OPEN sent, or its scheduled time */
+    long long move_us;            /* MOVE sent, no PLAY yet; -1 if none */
+    int npiles;
+    uint32_t piles[BOARD_MAX_PILES];
+    wheel_timer_t timer;          /* think time, or reconnect delay */
+    bench_t *b;
+    struct bot *prev;             /* the thread's live players */
+    struct bot *next;
+} bot_t;
+
+/* one per thread; merged once every thread has finished */
+struct bench {
+    int id;
+    int epfd;
+    wheel_t timers;
+    unsigned long long rng;
+    unsigned seq;                 /* names spawned so far */
+    long long stop_us;
+    double interval_us;           /* open loop: time between arrivals */
+    double next_arrival_us;
+    int target;                   /* closed loop: players to keep */
+    bot_t *bots;
+
+    samples_t open_name;
+    samples_t move_play;
+    unsigned long long overs;     /* OVER frames, not forfeits */
+    unsigned long long forfeits;  /* OVER ... Forfeit */
+    unsigned long long sent;
+    unsigned long long received;
+    unsigned long long fails;
+    unsigned long long drops;     /* disconnected before OVER */
+    unsigned long long connect_errors;
+};
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned rand_below(bench_t *b, unsigned n) {
+    /* xorshift64* */
+    b->rng ^= b->rng >> 12;
+    b->rng ^= b->rng << 25;
+    b->rng ^= b->rng >> 27;
+    return (unsigned)((b->rng * 2685821657736338717ULL) >> 33) % n;
+}
+
+static void sample_add(samples_t *s, long long us) {
+    if (s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        long long *v = realloc(s->v, cap * sizeof(*v));
+        if (!v) return;
+        s->v = v;
+        s->cap = cap;
+    }
+    s->v[s->n++] = us;
+}
+
+/* --------------------------
+   Players
+   -------------------------- */
+
+static void bot_spawn(bench_t *b, long long open_us);
+
+static void bot_send(bot_t *p, const char *buf, size_t len) {
+    if (outq_write(&p->out, p->fd, buf, len, DEFAULT_OUTQ_LIMIT) == OUTQ_OK) {
+        p->b->sent++;
+    }
+}
+
+static void bot_free(bot_t *p) {
+    bench_t *b = p->b;
+    if (p->prev) p->prev->next = p->next;
+    else b->bots = p->next;
+    if (p->next) p->next->prev = p->prev;
+    wheel_cancel(&p->timer);
+    if (p->fd >= 0) close(p->fd);
+    outq_free(&p->out);
+    free(p);
+}
+
+/* the game is over or the connection failed; in the closed loop a
+   new player takes this one's place */
+static void bot_end(bot_t *p) {
+    bench_t *b = p->b;
+    if (!p->done) b->drops++;
+    bot_free(p);
+    if (config.rate == 0 && now_us() < b->stop_us) {
+        bot_spawn(b, now_us());
+    }
+}
+
+static void choose_move(bot_t *p, int *pile, int *qty) {
+    bench_t *b = p->b;
+    int largest = 0;
+    for (int i = 1; i < p->npiles; i++) {
+        if (p->piles[i] > p->piles[largest]) largest = i;
+    }
+
+    if (config.strategy == STRAT_OPTIMAL) {
+        /* leave a position whose nim-sum is zero, if there is one */
+        unsigned x = 0;
+        for (int i = 0; i < p->npiles; i++) x ^= p->piles[i];
+        for (int i = 0; x && i < p->npiles; i++) {
+            if ((p->piles[i] ^ x) < p->piles[i]) {
+                *pile = i;
+                *qty = (int)(p->piles[i] - (p->piles[i] ^ x));
+                return;
+            }
+        }
+        *pile = largest;
+        *qty = 1;
+    } else if (config.strategy == STRAT_GREEDY) {
+        *pile = largest;
+        *qty = (int)p->piles[largest];
+    } else {
+        int live[BOARD_MAX_PILES], n = 0;
+        for (int i = 0; i < p->npiles; i++) {
+            if (p->piles[i] > 0) live[n++] = i;
+        }
+        *pile = n ? live[rand_below(b, (unsigned)n)] : largest;
+        *qty = 1 + (int)rand_below(b, p->piles[*pile] ? p->piles[*pile] : 1);
+    }
+}
+
+static void bot_move(bot_t *p) {
+    int pile, qty;
+    choose_move(p, &pile, &qty);
+    char out[NGP_MAX_MSG];
+    size_t len = config.binary ? ngp1_build_move(out, sizeof(out), pile, qty)
+                               : ngp_build_move(out, sizeof(out), pile, qty);
+    p->move_us = now_us();
+    bot_send(p, out, len);
+}
+
+static void on_bot_timer(wheel_timer_t *t, void *ctx) {
+    bot_t *p = (bot_t *)((char *)t - offsetof(bot_t, timer));
+    if (p->fd < 0) {
+        /* connect failed earlier; try again as a fresh player */
+        bench_t *b = p->b;
+        bot_free(p);
+        bot_spawn(b, now_us());
+        return;
+    }
+    bot_move(p);
+}
+
+/* board text "a b c ..." into piles */
+static void parse_board(bot_t *p, const char *board) {
+    char *end;
+    p->npiles = 0;
+    while (p->npiles < BOARD_MAX_PILES) {
+        unsigned long v = strtoul(board, &end, 10);
+        if (end == board) break;
+        p->piles[p->npiles++] = (unsigned)v;
+        board = end;
+    }
+}
+
+static void on_play(bot_t *p, ngp_message *msg, long long now) {
+    if (p->move_us >= 0) {
+        sample_add(&p->b->move_play, now - p->move_us);
+        p->move_us = -1;
+    }
+    if (msg->field_count < 2 || ngp_number(msg, 0) != p->num) {
+        return;
+    }
+    if (msg->binary) {
+        p->npiles = ngp1_board(msg, p->piles, BOARD_MAX_PILES);
+    } else {
+        parse_board(p, msg->fields[1]);
+    }
+
+    int think = 0;
+    if (config.think_ms > 0) {
+        /* uniform over [0, 2 * mean] */
+        think = (int)rand_below(p->b, 2 * (unsigned)config.think_ms + 1);
+    }
+    if (think == 0) {
+        bot_move(p);
+    } else {
+        wheel_arm(&p->b->timers, &p->timer, now / 1000 + think);
+    }
+}
+
+/* handle one frame; returns -1 once the player is finished */
+static int on_frame(bot_t *p, ngp_message *msg) {
+    bench_t *b = p->b;
+    long long now = now_us();
+    b->received++;
+
+    if (strcmp(msg->type, "NAME") == 0) {
+        sample_add(&b->open_name, now - p->open_us);
+        p->num = (int)ngp_number(msg, 0);
+    } else if (strcmp(msg->type, "PLAY") == 0) {
+        on_play(p, msg, now);
+    } else if (strcmp(msg->type, "OVER") == 0) {
+        int forfeit = msg->binary
+            ? ngp_number(msg, 2) == 1
+            : msg->field_count >= 3 && strcmp(msg->fields[2], "Forfeit") == 0;
+        if (forfeit) {
+            b->forfeits++;
+        } else {
+            b->overs++;
+        }
+        p->done = 1;
+        return -1;
+    } else if (strcmp(msg->type, "FAIL") == 0) {
+        b->fails++;
+    }
+    return 0;
+}
+
+static void on_bot_event(bot_t *p, uint32_t events) {
+    if ((events & EPOLLOUT) && outq_pending(&p->out)
+        && outq_flush(&p->out, p->fd) != OUTQ_OK) {
+        bot_end(p);
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+
+    for (;;) {
+        char frame[NGP_MAX_MSG];
+        size_t len;
+        int rc = ngp_framer_next(&p->in, frame, sizeof(frame), &len);
+        if (rc > 0) {
+            ngp_message msg;
+            if (ngp_parse(frame, len, &msg) != 0 || on_frame(p, &msg) < 0) {
+                bot_end(p);
+                return;
+            }
+            continue;
+        }
+        if (rc < 0) {
+            bot_end(p);
+            return;
+        }
+
+        ssize_t n = ngp_framer_read(&p->in, p->fd);
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        bot_end(p);
+        return;
+    }
+}
+
+/* connect a new player and send its OPEN; open_us is when the OPEN
+   counts as sent (the scheduled arrival in the open loop) */
+static void bot_spawn(bench_t *b, long long open_us) {
+    bot_t *p = calloc(1, sizeof(*p));
+    if (!p) return;
+    p->b = b;
+    p->next = b->bots;
+    if (b->bots) b->bots->prev = p;
+    b->bots = p;
+    p->move_us = -1;
+    p->open_us = open_us;
+    ngp_framer_init(&p->in);
+    outq_init(&p->out);
+    wheel_timer_init(&p->timer, on_bot_timer);
+    snprintf(p->name, sizeof(p->name), "nb%d_%u", b->id, b->seq++);
+
+    p->fd = connect_inet(config.host, config.service);
+    if (p->fd < 0) {
+        b->connect_errors++;
+        if (config.rate == 0) {
+            wheel_arm(&b->timers, &p->timer, now_us() / 1000 + RETRY_MS);
+        } else {
+            bot_free(p);
+        }
+        return;
+    }
+
+    int one = 1;
+    setsockopt(p->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int flags = fcntl(p->fd, F_GETFL, 0);
+    fcntl(p->fd, F_SETFL, flags | O_NONBLOCK);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = p;
+    if (epoll_ctl(b->epfd, EPOLL_CTL_ADD, p->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        bot_free(p);
+        return;
+    }
+
+    char out[NGP_MAX_MSG];
+    size_t len = config.binary ? ngp1_build_open(out, sizeof(out), p->name)
+                               : ngp_build_open(out, sizeof(out), p->name);
+    bot_send(p, out, len);
+}
+
+/* --------------------------
+   Load loop
+   -------------------------- */
+
+/* open loop: start every player whose arrival time has come; returns
+   the ms until the next one */
+static int arrivals(bench_t *b, long long now) {
+    while (b->next_arrival_us <= (double)now && now < b->stop_us) {
+        bot_spawn(b, (long long)b->next_arrival_us);
+        b->next_arrival_us += b->interval_us;
+    }
+    long long wait = (long long)b->next_arrival_us - now;
+    return (int)((wait + 999) / 1000);
+}
+
+static void *bench_run(void *arg) {
+    bench_t *b = arg;
+    long long start = now_us();
+
+    if (config.rate > 0) {
+        /* threads take turns: thread i starts i arrivals in */
+        b->next_arrival_us = (double)start + b->id * 1e6 / config.rate;
+    } else {
+        for (int i = 0; i < b->target; i++) {
+            bot_spawn(b, now_us());
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        long long now = now_us();
+        if (now >= b->stop_us) break;
+
+        wheel_advance(&b->timers, now / 1000, b);
+        int timeout = wheel_timeout(&b->timers, now / 1000);
+        if (config.rate > 0) {
+            int next = arrivals(b, now);
+            if (timeout < 0 || next < timeout) timeout = next;
+        }
+        int left = (int)((b->stop_us - now + 999) / 1000);
+        if (timeout < 0 || timeout > left) timeout = left;
+
+        int n = epoll_wait(b->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            on_bot_event(events[i].data.ptr, events[i].events);
+        }
+    }
+
+    /* games still in flight are abandoned, not counted */
+    pthread_barrier_wait(&stop_barrier);
+    while (b->bots) {
+        bot_free(b->bots);
+    }
+    close(b->epfd);
+    return NULL;
+}
+
+/* --------------------------
+   Report
+   -------------------------- */
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static long long percentile(const samples_t *s, double q) {
+    if (s->n == 0) return 0;
+    size_t i = (size_t)(q * (double)(s->n - 1) + 0.5);
+    return s->v[i];
+}
+
+static void merge(samples_t *dst, const samples_t *src) {
+    for (size_t i = 0; i < src->n; i++) sample_add(dst, src->v[i]);
+}
+
+static void print_latency(const char *label, samples_t *s) {
+    qsort(s->v, s->n, sizeof(*s->v), cmp_ll);
+    printf("%-12s p50 %lld us  p99 %lld us  p999 %lld us  max %lld us"
+           "  (%zu samples)\n", label,
+           percentile(s, 0.5), percentile(s, 0.99), percentile(s, 0.999),
+           percentile(s, 1.0), s->n);
+}
+
+static void report(bench_t *benches, double secs) {
+    bench_t total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < config.threads; i++) {
+        bench_t *b = &benches[i];
+        merge(&total.open_name, &b->open_name);
+        merge(&total.move_play, &b->move_play);
+        free(b->open_name.v);
+        free(b->move_play.v);
+        total.overs += b->overs;
+        total.forfeits += b->forfeits;
+        total.sent += b->sent;
+        total.received += b->received;
+        total.fails += b->fails;
+        total.drops += b->drops;
+        total.connect_errors += b->connect_errors;
+    }
+
+    /* both players see a normal OVER; only the winner sees a forfeit */
+    unsigned long long games = total.overs / 2 + total.forfeits;
+    unsigned long long msgs = total.sent + total.received;
+    printf("games:       %llu (%.1f/s), %llu by forfeit\n",
+           games, (double)games / secs, total.forfeits);
+    printf("messages:    %llu sent, %llu received (%.1f/s)\n",
+           total.sent, total.received, (double)msgs / secs);
+    printf("errors:      %llu FAIL, %llu dropped, %llu connect failures\n",
+           total.fails, total.drops, total.connect_errors);
+    print_latency("OPEN->NAME", &total.open_name);
+    print_latency("MOVE->PLAY", &total.move_play);
+    free(total.open_name.v);
+    free(total.move_play.v);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <port>\n", prog);
+    fprintf(stderr,
+            "  --host HOST        server to load (default: localhost)\n"
+            "  --players N        closed loop: players kept connected;\n"
+            "                     each reconnects when its game ends\n"
+            "                     (default: %d)\n"
+            "  --rate N           open loop instead: N new players per\n"
+            "                     second, each playing one game\n"
+            "  --duration S       seconds to run (default: %d)\n"
+            "  --think MS         mean think time before each move,\n"
+            "                     uniform over [0, 2*MS] (default: 0)\n"
+            "  --strategy S       random, greedy (empty the largest pile)\n"
+            "                     or optimal (nim-sum) (default: random)\n"
+            "  --threads N        client threads, each with its own share\n"
+            "                     of the players (default: 1)\n"
+            "  --binary           speak NGP v1, the binary encoding\n",
+            config.players, config.duration_s);
+}
+
+/* parse a positive integer option argument; returns -1 if invalid */
+static int parse_count(const char *arg) {
+    char *endptr;
+    long v = strtol(arg, &endptr, 10);
+    if (*arg == '\0' || *endptr != '\0' || v < 1 || v > 1000000000L) {
+        return -1;
+    }
+    return (int)v;
+}
+
+int main(int argc, char **argv) {
+    int rate = 0;
+    for (int i = 1; i < argc; i++) {
+        int *target = NULL;
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            config.host = argv[++i];
+            continue;
+        } else if (strcmp(argv[i], "--strategy") == 0 && i + 1 < argc) {
+            const char *s = argv[++i];
+            if (strcmp(s, "random") == 0) config.strategy = STRAT_RANDOM;
+            else if (strcmp(s, "greedy") == 0) config.strategy = STRAT_GREEDY;
+            else if (strcmp(s, "optimal") == 0) config.strategy = STRAT_OPTIMAL;
+            else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            continue;
+        } else if (strcmp(argv[i], "--binary") == 0) {
+            config.binary = 1;
+            continue;
+        } else if (strcmp(argv[i], "--players") == 0) {
+            target = &config.players;
+        } else if (strcmp(argv[i], "--rate") == 0) {
+            target = &rate;
+        } else if (strcmp(argv[i], "--duration") == 0) {
+            target = &config.duration_s;
+        } else if (strcmp(argv[i], "--think") == 0) {
+            target = &config.think_ms;
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            target = &config.threads;
+        } else if (argv[i][0] != '-' && config.service == NULL) {
+            config.service = argv[i];
+            continue;
+        }
+
+        if (target == NULL || i + 1 >= argc
+            || (*target = parse_count(argv[++i])) < 0) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (config.service == NULL) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    config.rate = rate;
+
+    /* every player is a socket */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    bench_t *benches = calloc((size_t)config.threads, sizeof(*benches));
+    pthread_t *tids = calloc((size_t)config.threads, sizeof(*tids));
+    if (!benches || !tids) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    if (config.rate > 0) {
+        printf("nimbench: open loop, %d players/s", rate);
+    } else {
+        printf("nimbench: closed loop, %d players", config.players);
+    }
+    printf(", %s strategy, think %d ms, %d thread%s, %d s against %s:%s%s\n",
+           config.strategy == STRAT_RANDOM ? "random"
+           : config.strategy == STRAT_GREEDY ? "greedy" : "optimal",
+           config.think_ms, config.threads, config.threads == 1 ? "" : "s",
+           config.duration_s, config.host, config.service,
+           config.binary ? " (NGP v1)" : "");
+    fflush(stdout);
+
+    pthread_barrier_init(&stop_barrier, NULL, (unsigned)config.threads);
+    long long start = now_us();
+    for (int i = 0; i < config.threads; i++) {
+        bench_t *b = &benches[i];
+        b->id = i;
+        b->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (b->epfd < 0) {
+            perror("epoll_create1");
+            return EXIT_FAILURE;
+        }
+        wheel_init(&b->timers, start / 1000);
+        b->rng = 0x9E3779B97F4A7C15ULL * (unsigned long long)(i + 1)
+                 ^ (unsigned long long)start;
+        b->stop_us = start + (long long)config.duration_s * 1000000;
+        /* split players and arrivals evenly across threads */
+        b->target = config.players / config.threads
+                    + (i < config.players % config.threads);
+        b->interval_us = 1e6 * config.threads / (config.rate ? config.rate : 1);
+        if (pthread_create(&tids[i], NULL, bench_run, b) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < config.threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    report(benches, (now_us() - start) / 1e6);
+    free(benches);
+    free(tids);
+    return EXIT_SUCCESS;
+}
@@ -1,293 +1,396 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <time.h>
 #include <errno.h>
 #include <pthread.h>
 
-#include "network.h"
 #include "ngp.h"
 #include "game.h"
-
-#define BUF_SIZE 512
-#define MAX_NAME_LEN 72   // per spec
-#define MAX_WAITING 16    // max lobby size
-
-/* Check whether a socket is still alive (no disconnect yet). */
-static int fd_alive(int fd) {
-    char c;
-    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
-    if (n == 0) {
-        /* peer has closed the connection */
-        return 0;
-    }
-    if (n < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            /* no data, but connection is still open */
-            return 1;
-        }
-        /* other error: treat as dead */
-        return 0;
-    }
-    /* n > 0: there is data, so it's alive */
-    return 1;
+#include "rules.h"
+#include "server.h"
+#include "reactor.h"
+#include "registry.h"
+#include "outq.h"
+#include "coro.h"
+#include "stats.h"
+#include "log.h"
+#include "journal.h"
+#include "players.h"
+#include "spectate.h"
+
+/* high-water mark for each player's output queue (--max-outq) */
+static size_t outq_limit = DEFAULT_OUTQ_LIMIT;
+
+/* board every game starts from (--board) */
+static const game_layout_t *board_layout;
+
+/* time allowed for each move (--turn-timeout) */
+static int turn_timeout_ms = DEFAULT_TURN_TIMEOUT_MS;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+/* utility: queue a frame for a player without blocking.
+   Returns 0, or -1 if the player must be dropped: the connection
+   failed, or the player stopped reading and its queue passed the
+   high-water mark. Either way the opponent is never held up. */
+static int send_player(player_t *p, const char *buf, size_t len) {
+    int rc = outq_write(&p->out, p->fd, buf, len, outq_limit);
+    return (rc == OUTQ_OK) ? 0 : -1;
+}
 
-typedef struct {
-    int  fd;
-    char name[MAX_NAME_LEN + 1];
-} player_t;
-
-/* global list of players currently in a game, for FAIL 22 Already Playing */
+/* utility: send a pre-encoded FAIL frame */
+static int send_fail(player_t *p, int code) {
+    const ngp_frame *f = p->version ? ngp1_fail_frame(code)
+                                    : ngp_fail_frame(code);
+    stats_fail(code);
+    return send_player(p, f->data, f->len);
+}
 
-typedef struct active_player {
-    char name[MAX_NAME_LEN + 1];
-    struct active_player *next;
-} active_player_t;
+/* utility: send NAME in the player's version */
+static int send_name(player_t *p, int player_num, const char *opponent) {
+    char out[NGP_MAX_MSG];
+    size_t outlen = p->version
+        ? ngp1_build_name(out, sizeof(out), player_num, opponent)
+        : ngp_build_name(out, sizeof(out), player_num, opponent);
+    return send_player(p, out, outlen);
+}
 
-static active_player_t *active_head = NULL;
-static pthread_mutex_t active_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* utility: send a PLAY or OVER in the player's version */
+static int send_board(player_t *p, ngp_board_frame_t *f) {
+    const char *data;
+    size_t len = ngp_board_frame(f, p->version, &data);
+    return send_player(p, data, len);
+}
 
-/* waiting lobby (not yet in a game) */
-static player_t waiting[MAX_WAITING];
-static int waiting_count = 0;
+/* utility: a PLAY (type NGP1_PLAY) or OVER of game's board */
+static void board_frame(ngp_board_frame_t *f, const game_t *game,
+                        int type, int player, int forfeit) {
+    ngp_board_frame_init(f, type, player, forfeit, game->board,
+                         game->piles, game->layout->piles);
+}
 
-/* utility: format board as "a b c d e" */
-static void format_board(const game_t *g, char *buf, size_t cap) {
-    snprintf(buf, cap, "%d %d %d %d %d",
-             g->piles[0], g->piles[1], g->piles[2],
-             g->piles[3], g->piles[4]);
+/* utility: show a PLAY or OVER to sg's spectators, who read text */
+static void spectate_board(spectate_game_t *sg, ngp_board_frame_t *f) {
+    if (!sg) return;
+    const char *data;
+    size_t len = ngp_board_frame(f, 0, &data);
+    spectate_frame(sg, data, len);
 }
 
-/* utility: read and parse a single NGP message from fd */
-static int read_ngp(int fd, char *buf, size_t cap, ngp_message *msg) {
-    ssize_t n = read(fd, buf, cap);
-    if (n <= 0) {
+/* utility: read and parse the next NGP message from a player.
+   Reads from the socket only when no complete frame is buffered.
+   Returns 0 with msg filled in, 1 if the frame is still incomplete,
+   or -1 on disconnect or a malformed message. */
+static int read_ngp(player_t *p, char *buf, size_t cap, ngp_message *msg) {
+    size_t len;
+    int rc = ngp_framer_next(&p->in, buf, cap, &len);
+    if (rc == 0) {
+        ssize_t n = ngp_framer_read(&p->in, p->fd);
+        if (n <= 0) {
+            return -1;
+        }
+        rc = ngp_framer_next(&p->in, buf, cap, &len);
+    }
+    if (rc < 0) {
         return -1;
     }
-    if (ngp_parse(buf, (size_t)n, msg) != 0) {
+    if (rc == 0) {
+        return 1;
+    }
+    if (ngp_parse(buf, len, msg) != 0) {
         return -1;
     }
     return 0;
 }
 
-/* active player list helpers (must be called with active_mutex held) */
+/* wait until either player has input, flushing queued output as their
+   sockets drain. Returns 0 with *ready1 and *ready2 set, 1 or 2 if that
+   player's connection failed while flushing, -1 on a poll error, or -2
+   once deadline (ms, or -1 for none) has passed. */
+static int wait_players(player_t *p1, player_t *p2,
+                        int *ready1, int *ready2, long long deadline) {
+    for (;;) {
+        int timeout = -1;
+        if (deadline >= 0) {
+            long long left = deadline - now_ms();
+            if (left <= 0) return -2;
+            timeout = (int)left;
+        }
+
+        struct pollfd pfds[2];
+        pfds[0].fd = p1->fd;
+        pfds[0].events = POLLIN | (outq_pending(&p1->out) ? POLLOUT : 0);
+        pfds[1].fd = p2->fd;
+        pfds[1].events = POLLIN | (outq_pending(&p2->out) ? POLLOUT : 0);
 
-static int active_name_in_use_locked(const char *name) {
-    for (active_player_t *p = active_head; p; p = p->next) {
-        if (strcmp(p->name, name) == 0) {
+        int rc = coro_poll(pfds, 2, timeout);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        if ((pfds[0].revents & POLLOUT)
+            && outq_flush(&p1->out, p1->fd) != OUTQ_OK) {
             return 1;
         }
+        if ((pfds[1].revents & POLLOUT)
+            && outq_flush(&p2->out, p2->fd) != OUTQ_OK) {
+            return 2;
+        }
+
+        *ready1 = (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+        *ready2 = (pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+        if (*ready1 || *ready2) {
+            return 0;
+        }
     }
-    return 0;
 }
 
-static void active_add_locked(const char *name) {
-    active_player_t *node = malloc(sizeof(*node));
-    if (!node) return;
-    strncpy(node->name, name, MAX_NAME_LEN);
-    node->name[MAX_NAME_LEN] = '\0';
-    node->next = active_head;
-    active_head = node;
-}
+/* end the game: give queued output a bounded time to drain, then close */
+static void finish_game(player_t *p1, player_t *p2) {
+    player_t *players[2] = { p1, p2 };
+    long long deadline = now_ms() + DRAIN_TIMEOUT_MS;
 
-static void active_remove_locked(const char *name) {
-    active_player_t **pp = &active_head;
-    while (*pp) {
-        if (strcmp((*pp)->name, name) == 0) {
-            active_player_t *tmp = *pp;
-            *pp = tmp->next;
-            free(tmp);
-            return;
+    for (;;) {
+        struct pollfd pfds[2];
+        player_t *pending[2];
+        int n = 0;
+        for (int i = 0; i < 2; i++) {
+            if (outq_pending(&players[i]->out)) {
+                pfds[n].fd = players[i]->fd;
+                pfds[n].events = POLLOUT;
+                pending[n++] = players[i];
+            }
+        }
+        long long left = deadline - now_ms();
+        if (n == 0 || left <= 0) break;
+
+        int rc = coro_poll(pfds, (nfds_t)n, (int)left);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) break;
+
+        for (int i = 0; i < n; i++) {
+            if (pfds[i].revents
+                && outq_flush(&pending[i]->out, pending[i]->fd) != OUTQ_OK) {
+                outq_free(&pending[i]->out);
+            }
         }
-        pp = &(*pp)->next;
     }
+
+    close(p1->fd);
+    close(p2->fd);
+    outq_free(&p1->out);
+    outq_free(&p2->out);
 }
 
-/* struct passed to each game thread */
+/* `winner` (1 or 2) wins by forfeit: send them OVER and end the game */
+static void forfeit(const game_t *game, journal_game_t *jg,
+                    spectate_game_t *sg, player_t *p1, player_t *p2,
+                    int winner, journal_end_t how) {
+    journal_end(jg, winner, how);
+    players_record((winner == 1) ? p1->name : p2->name,
+                   (winner == 1) ? p2->name : p1->name, 1);
+    stats_count(STAT_FORFEITS);
+    ngp_board_frame_t f;
+    board_frame(&f, game, NGP1_OVER, winner, 1);
+    (void)send_board((winner == 1) ? p1 : p2, &f);
+    spectate_board(sg, &f);
+    finish_game(p1, p2);
+}
 
-typedef struct {
-    player_t p1;
-    player_t p2;
-} game_pair_t;
+/* send a FAIL to player `num` (1 or 2) of a game and journal it */
+static int game_fail(journal_game_t *jg, player_t *p, int num, int code) {
+    journal_fail(jg, num, code);
+    return send_fail(p, code);
+}
 
-/* full Nim game between p1 and p2 (runs in its own thread) */
-static void run_game(player_t *p1, player_t *p2) {
-    game_t game;
-    game_init(&game);
+/* full Nim game between p1 and p2, played in game (game_size() bytes)
+   and shown to sg's spectators (runs in its own thread, or as a
+   coroutine: its only blocking calls go through coro_poll) */
+static void run_game(game_t *game, spectate_game_t *sg,
+                     player_t *p1, player_t *p2) {
+    game_init(game, board_layout);
+    journal_game_t *jg = journal_begin(p1->name, p2->name, game->piles,
+                                       board_layout->piles);
 
-    printf("Starting game between '%s' and '%s'\n", p1->name, p2->name);
+    log_event(LOG_INFO, LOG_EV_GAME_START, p1->name, p2->name, 0);
 
-    char out[256];
-    char board[64];
+    ngp_board_frame_t f;
     ngp_message msg;
-    char inbuf[BUF_SIZE];
-    size_t outlen;
+    char inbuf[NGP_MAX_MSG];
+    long long moved_us = -1;   /* when the last valid MOVE was read */
 
     /* send NAME to each player */
-    outlen = ngp_build_name(out, sizeof(out), 1, p2->name);
-    (void)write(p1->fd, out, outlen);
+    if (send_name(p1, 1, p2->name) != 0) {
+        forfeit(game, jg, sg, p1, p2, 2, JOURNAL_END_FORFEIT);
+        return;
+    }
 
-    outlen = ngp_build_name(out, sizeof(out), 2, p1->name);
-    (void)write(p2->fd, out, outlen);
+    if (send_name(p2, 2, p1->name) != 0) {
+        forfeit(game, jg, sg, p1, p2, 1, JOURNAL_END_FORFEIT);
+        return;
+    }
 
     /* main turn loop */
-    while (!game_is_over(&game)) {
+    while (!game_is_over(game)) {
         /* 1. send PLAY to both with current player + board */
-        format_board(&game, board, sizeof(board));
-        outlen = ngp_build_play(out, sizeof(out), game.current_player, board);
-        (void)write(p1->fd, out, outlen);
-        (void)write(p2->fd, out, outlen);
+        board_frame(&f, game, NGP1_PLAY, game->current_player, 0);
+        if (send_board(p1, &f) != 0) {
+            forfeit(game, jg, sg, p1, p2, 2, JOURNAL_END_FORFEIT);
+            return;
+        }
+        if (send_board(p2, &f) != 0) {
+            forfeit(game, jg, sg, p1, p2, 1, JOURNAL_END_FORFEIT);
+            return;
+        }
+        spectate_board(sg, &f);
+        if (moved_us >= 0) {
+            stats_record(STAT_MOVE_TO_PLAY, stats_now_us() - moved_us);
+        }
 
-        player_t *current = (game.current_player == 1) ? p1 : p2;
-        player_t *other   = (game.current_player == 1) ? p2 : p1;
+        player_t *current = (game->current_player == 1) ? p1 : p2;
+        player_t *other   = (game->current_player == 1) ? p2 : p1;
+        int current_num   = game->current_player;
+        int other_num     = (current_num == 1) ? 2 : 1;
+        long long turn_deadline = (turn_timeout_ms > 0)
+            ? now_ms() + turn_timeout_ms : -1;
 
         /* 2. wait for a valid MOVE from the current player, but
            also watch the other player for out-of-turn or disconnect. */
         for (;;) {
-            fd_set rfds;
-            FD_ZERO(&rfds);
-            FD_SET(current->fd, &rfds);
-            FD_SET(other->fd, &rfds);
-            int maxfd = (current->fd > other->fd) ? current->fd : other->fd;
-
-            int rc = select(maxfd + 1, &rfds, NULL, NULL, NULL);
-            if (rc < 0) {
-                if (errno == EINTR) continue;
-                /* fatal select error: end game */
-                close(p1->fd);
-                close(p2->fd);
-                return;
+            /* frames already buffered (pipelined messages) count as
+               ready without waiting on the socket */
+            int other_ready   = ngp_framer_ready(&other->in) != 0;
+            int current_ready = ngp_framer_ready(&current->in) != 0;
+
+            if (!other_ready && !current_ready) {
+                int ready1, ready2;
+                int rc = wait_players(p1, p2, &ready1, &ready2,
+                                      turn_deadline);
+                if (rc == -2) {
+                    /* move clock ran out; current forfeits */
+                    log_event(LOG_INFO, LOG_EV_FORFEIT, current->name,
+                              other->name, LOG_FORFEIT_TIMEOUT);
+                    forfeit(game, jg, sg, p1, p2, other_num,
+                            JOURNAL_END_TIMEOUT);
+                    return;
+                }
+                if (rc < 0) {
+                    /* fatal poll error: end game */
+                    journal_end(jg, 0, JOURNAL_END_ABORTED);
+                    finish_game(p1, p2);
+                    return;
+                }
+                if (rc > 0) {
+                    /* player rc's connection failed while flushing */
+                    forfeit(game, jg, sg, p1, p2, (rc == 1) ? 2 : 1,
+                            JOURNAL_END_FORFEIT);
+                    return;
+                }
+                other_ready   = (other == p1) ? ready1 : ready2;
+                current_ready = (current == p1) ? ready1 : ready2;
             }
 
             /* handle other player's activity first: Impatient / disconnect */
-            if (FD_ISSET(other->fd, &rfds)) {
-                if (read_ngp(other->fd, inbuf, sizeof(inbuf), &msg) != 0) {
+            if (other_ready) {
+                int rc = read_ngp(other, inbuf, sizeof(inbuf), &msg);
+                if (rc > 0) {
+                    /* partial message; wait for the rest */
+                    continue;
+                }
+                if (rc < 0) {
                     /* other disconnected; current wins by forfeit */
-                    printf("%s disconnected; %s wins by forfeit\n",
-                           other->name, current->name);
-                    format_board(&game, board, sizeof(board));
-                    outlen = ngp_build_over(out, sizeof(out),
-                                            (current == p1) ? 1 : 2,
-                                            board, 1);
-                    (void)write(current->fd, out, outlen);
-                    close(p1->fd);
-                    close(p2->fd);
+                    log_event(LOG_INFO, LOG_EV_FORFEIT, other->name,
+                              current->name, LOG_FORFEIT_DISCONNECT);
+                    forfeit(game, jg, sg, p1, p2, current_num,
+                            JOURNAL_END_DISCONNECT);
                     return;
                 }
 
                 if (strcmp(msg.type, "MOVE") == 0) {
                     /* out-of-turn MOVE => FAIL 31 Impatient */
-                    outlen = ngp_build_fail(out, sizeof(out),
-                                            31, "Impatient");
-                    (void)write(other->fd, out, outlen);
+                    if (game_fail(jg, other, other_num, 31) != 0) {
+                        forfeit(game, jg, sg, p1, p2, current_num,
+                                JOURNAL_END_FORFEIT);
+                        return;
+                    }
                     /* do not change turn; loop again */
                     continue;
                 } else if (strcmp(msg.type, "OPEN") == 0) {
-                    /* Already Open during game */
-                    outlen = ngp_build_fail(out, sizeof(out),
-                                            23, "Already Open");
-                    (void)write(other->fd, out, outlen);
-
-                    /* current wins by forfeit */
-                    format_board(&game, board, sizeof(board));
-                    outlen = ngp_build_over(out, sizeof(out),
-                                            (current == p1) ? 1 : 2,
-                                            board, 1);
-                    (void)write(current->fd, out, outlen);
-                    close(p1->fd);
-                    close(p2->fd);
+                    /* Already Open during game; current wins by forfeit */
+                    (void)game_fail(jg, other, other_num, 23);
+                    forfeit(game, jg, sg, p1, p2, current_num,
+                            JOURNAL_END_FORFEIT);
                     return;
                 } else {
                     /* any other message from other => general invalid + forfeit */
-                    outlen = ngp_build_fail(out, sizeof(out),
-                                            10, "Invalid");
-                    (void)write(other->fd, out, outlen);
-                    format_board(&game, board, sizeof(board));
-                    outlen = ngp_build_over(out, sizeof(out),
-                                            (current == p1) ? 1 : 2,
-                                            board, 1);
-                    (void)write(current->fd, out, outlen);
-                    close(p1->fd);
-                    close(p2->fd);
+                    (void)game_fail(jg, other, other_num, 10);
+                    forfeit(game, jg, sg, p1, p2, current_num,
+                            JOURNAL_END_FORFEIT);
                     return;
                 }
             }
 
             /* now handle current player's move, if ready */
-            if (FD_ISSET(current->fd, &rfds)) {
-                if (read_ngp(current->fd, inbuf, sizeof(inbuf), &msg) != 0) {
+            if (current_ready) {
+                int rc = read_ngp(current, inbuf, sizeof(inbuf), &msg);
+                if (rc > 0) {
+                    continue;
+                }
+                if (rc < 0) {
                     /* current disconnected; other wins by forfeit */
-                    printf("%s disconnected; %s wins by forfeit\n",
-                           current->name, other->name);
-                    format_board(&game, board, sizeof(board));
-                    outlen = ngp_build_over(out, sizeof(out),
-                                            (current == p1) ? 2 : 1,
-                                            board, 1);
-                    (void)write(other->fd, out, outlen);
-                    close(p1->fd);
-                    close(p2->fd);
+                    log_event(LOG_INFO, LOG_EV_FORFEIT, current->name,
+                              other->name, LOG_FORFEIT_DISCONNECT);
+                    forfeit(game, jg, sg, p1, p2, other_num,
+                            JOURNAL_END_DISCONNECT);
                     return;
                 }
 
                 if (strcmp(msg.type, "MOVE") == 0 && msg.field_count >= 2) {
                     /* fall through to parse/validate below */
                 } else if (strcmp(msg.type, "OPEN") == 0) {
-                    outlen = ngp_build_fail(out, sizeof(out),
-                                            23, "Already Open");
-                    (void)write(current->fd, out, outlen);
-                    format_board(&game, board, sizeof(board));
-                    outlen = ngp_build_over(out, sizeof(out),
-                                            (current == p1) ? 2 : 1,
-                                            board, 1);
-                    (void)write(other->fd, out, outlen);
-                    close(p1->fd);
-                    close(p2->fd);
+                    (void)game_fail(jg, current, current_num, 23);
+                    forfeit(game, jg, sg, p1, p2, other_num, JOURNAL_END_FORFEIT);
                     return;
                 } else {
                     /* wrong type in-game from current => invalid + forfeit */
-                    outlen = ngp_build_fail(out, sizeof(out),
-                                            10, "Invalid");
-                    (void)write(current->fd, out, outlen);
-                    format_board(&game, board, sizeof(board));
-                    outlen = ngp_build_over(out, sizeof(out),
-                                            (current == p1) ? 2 : 1,
-                                            board, 1);
-                    (void)write(other->fd, out, outlen);
-                    close(p1->fd);
-                    close(p2->fd);
+                    (void)game_fail(jg, current, current_num, 10);
+                    forfeit(game, jg, sg, p1, p2, other_num, JOURNAL_END_FORFEIT);
                     return;
                 }
 
-                /* parse pile and quantity */
-                char *endptr;
-                int pile = (int)strtol(msg.fields[0], &endptr, 10);
-                if (*endptr != '\0') pile = -1;
-
-                int qty = (int)strtol(msg.fields[1], &endptr, 10);
-                if (*endptr != '\0') qty = -1;
-
-                /* validate move: index vs quantity to choose error codes */
-                if (pile < 0 || pile >= NIM_PILES) {
-                    outlen = ngp_build_fail(out, sizeof(out),
-                                            32, "Pile Index");
-                    (void)write(current->fd, out, outlen);
+                /* parse and validate: index vs quantity to choose error
+                   codes */
+                game_move_t move;
+                int code = game_read_move(game, msg.values,
+                                          ngp_numbers(&msg), &move);
+                if (code != 0) {
                     /* do NOT change turn; ask again */
-                    continue;
-                }
-
-                if (qty <= 0 || qty > game.piles[pile]) {
-                    outlen = ngp_build_fail(out, sizeof(out),
-                                            33, "Quantity");
-                    (void)write(current->fd, out, outlen);
+                    if (game_fail(jg, current, current_num, code) != 0) {
+                        forfeit(game, jg, sg, p1, p2, other_num,
+                                JOURNAL_END_FORFEIT);
+                        return;
+                    }
                     continue;
                 }
 
                 /* apply move */
-                game_apply_move(&game, pile, qty);
+                moved_us = stats_now_us();
+                stats_count(STAT_MOVES);
+                journal_move(jg, move.pile[0], (int)move.qty[0]);
+                for (int i = 1; i < move.count; i++) {
+                    journal_move_more(jg, move.pile[i], (int)move.qty[i]);
+                }
+                game_play(game, &move);
 
                 /* finished a valid move, break inner loop to check game over */
                 break;
@@ -297,205 +400,468 @@ static void run_game(player_t *p1, player_t *p2) {
         }
 
         /* after a valid move, check for end of game */
-        if (game_is_over(&game)) {
-            int winner = (game.current_player == 1) ? 2 : 1;
-            format_board(&game, board, sizeof(board));
-            outlen = ngp_build_over(out, sizeof(out),
-                                    winner, board, 0);
-            (void)write(p1->fd, out, outlen);
-            (void)write(p2->fd, out, outlen);
-            close(p1->fd);
-            close(p2->fd);
+        if (game_is_over(game)) {
+            int winner = game_winner(game);
+            log_event(LOG_DEBUG, LOG_EV_GAME_OVER,
+                      (winner == 1) ? p1->name : p2->name,
+                      (winner == 1) ? p2->name : p1->name, 0);
+            journal_end(jg, winner, JOURNAL_END_NORMAL);
+            players_record((winner == 1) ? p1->name : p2->name,
+                           (winner == 1) ? p2->name : p1->name, 0);
+            board_frame(&f, game, NGP1_OVER, winner, 0);
+            (void)send_board(p1, &f);
+            (void)send_board(p2, &f);
+            spectate_board(sg, &f);
+            finish_game(p1, p2);
             return;
         }
 
-        /* otherwise, next iteration: game.current_player already flipped
-           by game_apply_move. */
+        /* otherwise, next iteration: game->current_player already flipped
+           by game_play. */
     }
 
-    close(p1->fd);
-    close(p2->fd);
+    journal_end(jg, 0, JOURNAL_END_ABORTED);
+    finish_game(p1, p2);
 }
 
-/* thread entry: run a game, then remove players from active list */
+/* game over or never started: free both names and the pair */
+static void end_pair(player_pair_t *pair) {
+    stats_count(STAT_GAMES_FINISHED);
+    registry_release(pair->p1.name);
+    registry_release(pair->p2.name);
+    reactor_pair_free(pair);
+}
+
+/* thread entry: run a game, then release both names */
 static void *game_thread(void *arg) {
-    game_pair_t pair = *(game_pair_t *)arg;
-    free(arg);
+    player_pair_t *pair = arg;
+    long long started_us = stats_now_us();
+    spectate_game_t *sg = spectate_begin(pair->p1.name, pair->p2.name);
+    run_game(&pair->game, sg, &pair->p1, &pair->p2);
+    spectate_end(sg);
+    stats_record(STAT_GAME_DURATION, stats_now_us() - started_us);
+    end_pair(pair);
+    return NULL;
+}
 
-    run_game(&pair.p1, &pair.p2);
+/* reactor hook: run each matched pair on its own detached thread */
+static void spawn_game_thread(player_pair_t *pair) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, game_thread, pair) != 0) {
+        perror("pthread_create");
+        finish_game(&pair->p1, &pair->p2);
+        end_pair(pair);
+        return;
+    }
 
-    pthread_mutex_lock(&active_mutex);
-    active_remove_locked(pair.p1.name);
-    active_remove_locked(pair.p2.name);
-    pthread_mutex_unlock(&active_mutex);
+    pthread_detach(tid);
+}
 
-    return NULL;
+/* coroutine entry: same as game_thread */
+static void game_coroutine(void *arg) {
+    (void)game_thread(arg);
 }
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        return EXIT_FAILURE;
+/* a coroutine that got no stack: tell both players there is no room
+   for their game and close them, without waiting on the scheduler */
+static void refuse_game_coroutine(void *arg) {
+    player_pair_t *pair = arg;
+    player_t *players[2] = { &pair->p1, &pair->p2 };
+    for (int i = 0; i < 2; i++) {
+        (void)send_fail(players[i], 25);
+        close(players[i]->fd);
+        outq_free(&players[i]->out);
     }
+    end_pair(pair);
+}
 
-    int listener = open_listener(argv[1], 10);
-    if (listener < 0) {
-        fprintf(stderr, "Failed to open listener\n");
-        return EXIT_FAILURE;
+/* reactor hook: run each matched pair as a coroutine */
+static void spawn_game_coroutine(player_pair_t *pair) {
+    if (coro_spawn(game_coroutine, refuse_game_coroutine, pair) != 0) {
+        finish_game(&pair->p1, &pair->p2);
+        end_pair(pair);
     }
+}
 
-    printf("nimd listening on %s...\n", argv[1]);
+static int use_coroutines;
+static int max_spectators;
+static const char *journal_dir;
+static const char *players_path;
+
+/* extra SIGUSR1 output: coroutine, journal and player totals */
+static void report(void) {
+    if (use_coroutines) {
+        log_text(LOG_INFO,
+                 "coroutines: %d live, %d stacks, %zu bytes per session",
+                 coro_live(), coro_stacks(),
+                 coro_session_bytes() + reactor_game_bytes());
+    }
+    if (journal_dir) {
+        log_text(LOG_INFO, "journal: %llu games written, %llu dropped",
+                 journal_written(), journal_dropped());
+    }
+    if (players_path) {
+        log_text(LOG_INFO, "players: %llu names known",
+                 (unsigned long long)players_count());
+    }
+    if (max_spectators) {
+        log_text(LOG_INFO, "spectators: %d/%d watching",
+                 spectate_watchers(), max_spectators);
+    }
+}
 
-    for (;;) {
-        int fd = accept(listener, NULL, NULL);
-        if (fd < 0) {
-            perror("accept");
-            continue;
-        }
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <port>\n", prog);
+    fprintf(stderr,
+            "  --game-workers N        game pool threads, each running many\n"
+            "                          games on its own epoll loop\n"
+            "                          (default: one per CPU)\n"
+            "  --games-per-worker N    games each pool thread runs at once;\n"
+            "                          further pairs wait (default: %d)\n"
+            "  --epoll                 run every game on the acceptor loops\n"
+            "                          instead of a game pool\n"
+            "  --threads               run each game on its own thread\n"
+            "  --coroutines            run each game as a coroutine on\n"
+            "                          --game-workers scheduler threads\n"
+            "  --coro-stack BYTES      stack per coroutine (default: %d)\n"
+            "  --workers N             acceptor loops, each with its own\n"
+            "                          SO_REUSEPORT listener (default: one\n"
+            "                          per CPU with --epoll, otherwise 1)\n"
+            "  --backlog N             listen() queue length (default: %d)\n"
+            "  --handshake-timeout MS  close clients that send no OPEN\n"
+            "                          within MS milliseconds (default: %d)\n"
+            "  --lobby-timeout MS      close players who wait longer than\n"
+            "                          MS for an opponent; 0 for no limit\n"
+            "                          (default: %d)\n"
+            "  --turn-timeout MS       a player who takes longer than MS\n"
+            "                          to move forfeits; 0 for no limit\n"
+            "                          (default: %d)\n"
+            "  --max-outq BYTES        drop a player (forfeit) whose unsent\n"
+            "                          output passes BYTES (default: %d)\n"
+            "  --max-lobby N           players each event loop queues for\n"
+            "                          an opponent before answering OPEN\n"
+            "                          with FAIL 25 (default: %d)\n"
+            "  --max-games N           live games at once; further pairs\n"
+            "                          wait in the lobby (default: no limit)\n"
+            "  --bot-after MS          a player left without an opponent for\n"
+            "                          MS plays the server's bot, \"%s\"\n"
+            "                          (default: never)\n"
+            "  --bot-strength PCT      percent of the bot's moves that are\n"
+            "                          optimal, 0-100 (default: %d)\n"
+            "  --spectators N          let up to N clients at once watch a\n"
+            "                          game by sending SPEC|name| instead of\n"
+            "                          OPEN (default: none)\n"
+            "  --mux N                 let one connection carry up to N\n"
+            "                          players, tagged with session ids\n"
+            "                          (NGP1_MUX frames) (default: off)\n"
+            "  --admin PATH            serve counters and latency histograms\n"
+            "                          to clients of the Unix socket PATH\n"
+            "  --upgrade PATH          hand listeners and live games to a\n"
+            "                          new nimd started with the same PATH;\n"
+            "                          take them over if one is listening\n"
+            "  --board PILES           starting piles, comma-separated; NxC\n"
+            "                          is N piles of C stones (default:\n"
+            "                          1,3,5,7,9)\n"
+            "  --rules RULES           nim, misere (last stone loses),\n"
+            "                          subtract:A,B,... (take one of these\n"
+            "                          amounts) or moore:K (take from up to\n"
+            "                          K piles at once) (default: nim)\n"
+            "  --journal DIR           record every game in segment files\n"
+            "                          under DIR (read with nimjournal)\n"
+            "  --journal-sync MS       fdatasync the journal at most this\n"
+            "                          often (default: %d)\n"
+            "  --journal-segment BYTES start a new segment past this size\n"
+            "                          (default: %d)\n"
+            "  --players PATH          keep games, wins, losses and forfeits\n"
+            "                          per name in the table at PATH\n"
+            "                          (read with nimplayers)\n"
+            "  --log-level LEVEL       debug, info, warn or error; game\n"
+            "                          ends are logged at debug (default: info)\n",
+            DEFAULT_GAMES_PER_WORKER, DEFAULT_CORO_STACK, SOMAXCONN,
+            DEFAULT_HANDSHAKE_TIMEOUT_MS, DEFAULT_LOBBY_TIMEOUT_MS,
+            DEFAULT_TURN_TIMEOUT_MS, DEFAULT_OUTQ_LIMIT,
+            DEFAULT_MAX_LOBBY, BOT_NAME, DEFAULT_BOT_STRENGTH,
+            JOURNAL_DEFAULT_SYNC_MS,
+            JOURNAL_DEFAULT_SEGMENT);
+}
 
-        char buf[BUF_SIZE];
-        ssize_t n = read(fd, buf, sizeof(buf));
-        if (n <= 0) {
-            close(fd);
-            continue;
-        }
+/* parse an integer option argument of at least min (0 or 1); returns
+   -1 if invalid */
+static int parse_count(const char *arg, long min) {
+    char *endptr;
+    long v = strtol(arg, &endptr, 10);
+    if (*arg == '\0' || *endptr != '\0' || v < min || v > 1000000000L) {
+        return -1;
+    }
+    return (int)v;
+}
 
-        ngp_message msg;
-        if (ngp_parse(buf, (size_t)n, &msg) != 0) {
-            char out[128];
-            size_t outlen = ngp_build_fail(out, sizeof(out),
-                                           10, "Invalid");
-            (void)write(fd, out, outlen);
-            close(fd);
+int main(int argc, char **argv) {
+    reactor_config_t cfg = {
+        .service = NULL,
+        .workers = 0,
+        .backlog = SOMAXCONN,
+        .handshake_timeout_ms = DEFAULT_HANDSHAKE_TIMEOUT_MS,
+        .lobby_timeout_ms = DEFAULT_LOBBY_TIMEOUT_MS,
+        .turn_timeout_ms = DEFAULT_TURN_TIMEOUT_MS,
+        .max_lobby = DEFAULT_MAX_LOBBY,
+        .start_game = NULL,
+        .game_workers = 0,
+        .games_per_worker = DEFAULT_GAMES_PER_WORKER,
+        .bot_strength = DEFAULT_BOT_STRENGTH,
+    };
+    int epoll_only = 0;
+    int coro_stack = DEFAULT_CORO_STACK;
+    int max_outq = DEFAULT_OUTQ_LIMIT;
+    int log_level = LOG_INFO;
+    int journal_sync = JOURNAL_DEFAULT_SYNC_MS;
+    static game_layout_t layout;
+    static game_rules_t rules;
+    const char *rules_spec = NULL;
+    int journal_segment = JOURNAL_DEFAULT_SEGMENT;
+
+    for (int i = 1; i < argc; i++) {
+        int *target = NULL;
+        long min = 1;
+        if (strcmp(argv[i], "--epoll") == 0) {
+            epoll_only = 1;
             continue;
-        }
-
-        if (strcmp(msg.type, "OPEN") == 0) {
-            /* continue below */
-        } else if (strcmp(msg.type, "MOVE") == 0) {
-            char out[128];
-            size_t outlen = ngp_build_fail(out, sizeof(out),
-                                           24, "Not Playing");
-            (void)write(fd, out, outlen);
-            close(fd);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            cfg.start_game = spawn_game_thread;
+            cfg.game_model = "threads";
             continue;
-        } else {
-            char out[128];
-            size_t outlen = ngp_build_fail(out, sizeof(out),
-                                           10, "Invalid");
-            (void)write(fd, out, outlen);
-            close(fd);
+        } else if (strcmp(argv[i], "--coroutines") == 0) {
+            use_coroutines = 1;
             continue;
-        }
-
-        if (msg.field_count < 1) {
-            char out[128];
-            size_t outlen = ngp_build_fail(out, sizeof(out),
-                                           10, "Invalid");
-            (void)write(fd, out, outlen);
-            close(fd);
+        } else if (strcmp(argv[i], "--coro-stack") == 0) {
+            target = &coro_stack;
+        } else if (strcmp(argv[i], "--game-workers") == 0) {
+            target = &cfg.game_workers;
+        } else if (strcmp(argv[i], "--games-per-worker") == 0) {
+            target = &cfg.games_per_worker;
+        } else if (strcmp(argv[i], "--workers") == 0) {
+            target = &cfg.workers;
+        } else if (strcmp(argv[i], "--backlog") == 0) {
+            target = &cfg.backlog;
+        } else if (strcmp(argv[i], "--handshake-timeout") == 0) {
+            target = &cfg.handshake_timeout_ms;
+        } else if (strcmp(argv[i], "--lobby-timeout") == 0) {
+            target = &cfg.lobby_timeout_ms;
+            min = 0;        /* 0 turns the limit off */
+        } else if (strcmp(argv[i], "--turn-timeout") == 0) {
+            target = &cfg.turn_timeout_ms;
+            min = 0;
+        } else if (strcmp(argv[i], "--max-outq") == 0) {
+            target = &max_outq;
+        } else if (strcmp(argv[i], "--max-lobby") == 0) {
+            target = &cfg.max_lobby;
+        } else if (strcmp(argv[i], "--max-games") == 0) {
+            target = &cfg.max_games;
+        } else if (strcmp(argv[i], "--bot-after") == 0) {
+            target = &cfg.bot_after_ms;
+        } else if (strcmp(argv[i], "--bot-strength") == 0) {
+            /* 0 is allowed: a bot that only plays at random */
+            char *endptr;
+            long v = (i + 1 < argc) ? strtol(argv[++i], &endptr, 10) : -1;
+            if (v < 0 || v > 100 || *argv[i] == '\0' || *endptr != '\0') {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            cfg.bot_strength = (int)v;
             continue;
-        }
-
-        const char *name = msg.fields[0];
-        size_t name_len = strlen(name);
-        if (name_len == 0 || name_len > MAX_NAME_LEN) {
-            char out[128];
-            size_t outlen = ngp_build_fail(out, sizeof(out),
-                                           21, "Long Name");
-            (void)write(fd, out, outlen);
-            close(fd);
+        } else if (strcmp(argv[i], "--spectators") == 0) {
+            target = &max_spectators;
+        } else if (strcmp(argv[i], "--mux") == 0) {
+            target = &cfg.mux_players;
+        } else if (strcmp(argv[i], "--journal-sync") == 0) {
+            target = &journal_sync;
+        } else if (strcmp(argv[i], "--journal-segment") == 0) {
+            target = &journal_segment;
+        } else if (strcmp(argv[i], "--board") == 0) {
+            if (i + 1 >= argc || game_layout_parse(&layout, argv[++i]) != 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            board_layout = &layout;
+            continue;
+        } else if (strcmp(argv[i], "--rules") == 0) {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            rules_spec = argv[++i];
+            continue;
+        } else if (strcmp(argv[i], "--journal") == 0) {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            journal_dir = argv[++i];
+            continue;
+        } else if (strcmp(argv[i], "--players") == 0) {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            players_path = argv[++i];
+            continue;
+        } else if (strcmp(argv[i], "--log-level") == 0) {
+            if (i + 1 >= argc || (log_level = log_parse_level(argv[++i])) < 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            continue;
+        } else if (strcmp(argv[i], "--admin") == 0) {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            cfg.admin_path = argv[++i];
+            continue;
+        } else if (strcmp(argv[i], "--upgrade") == 0) {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            cfg.upgrade_path = argv[++i];
+            continue;
+        } else if (argv[i][0] != '-' && cfg.service == NULL) {
+            cfg.service = argv[i];
             continue;
         }
 
-        /* check 22 Already Playing: name already in an active game,
-           or already in the waiting lobby. */
-        int name_in_use = 0;
-        pthread_mutex_lock(&active_mutex);
-        if (active_name_in_use_locked(name)) {
-            name_in_use = 1;
-        } else {
-            for (int i = 0; i < waiting_count; i++) {
-                if (strcmp(waiting[i].name, name) == 0) {
-                    name_in_use = 1;
-                    break;
-                }
-            }
+        if (target == NULL || i + 1 >= argc
+            || (*target = parse_count(argv[++i], min)) < 0) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
         }
-        pthread_mutex_unlock(&active_mutex);
-
-        if (name_in_use) {
-            char out[128];
-            size_t outlen = ngp_build_fail(out, sizeof(out),
-                                           22, "Already Playing");
-            (void)write(fd, out, outlen);
-            close(fd);
-            continue;
+    }
+    if (cfg.service == NULL) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (log_init(STDOUT_FILENO, log_level) != 0) {
+        fprintf(stderr, "Failed to start the log writer\n");
+        return EXIT_FAILURE;
+    }
+
+    if (cfg.mux_players > MAX_MUX_PLAYERS) {
+        fprintf(stderr, "--mux: at most %d players per connection\n",
+                MAX_MUX_PLAYERS);
+        return EXIT_FAILURE;
+    }
+
+    if (!board_layout) {
+        layout = *game_default_layout();
+        board_layout = &layout;
+    }
+    if (rules_spec) {
+        /* built before any game starts: a subtraction set's Grundy
+           table is computed here, once */
+        if (rules_parse(&rules, rules_spec) != 0) {
+            fprintf(stderr, "--rules: cannot use \"%s\"\n", rules_spec);
+            return EXIT_FAILURE;
         }
+        layout.rules = &rules;
+    }
 
-        /* send WAIT to this client */
-        char out[128];
-        size_t outlen = ngp_build_wait(out, sizeof(out));
-        (void)write(fd, out, outlen);
-
-        /* add to waiting lobby */
-        if (waiting_count < MAX_WAITING) {
-            waiting[waiting_count].fd = fd;
-            strncpy(waiting[waiting_count].name, name, MAX_NAME_LEN);
-            waiting[waiting_count].name[MAX_NAME_LEN] = '\0';
-            waiting_count++;
+    /* every board a game passes through must fit in an NGP frame; the
+       starting one has the longest text, since piles only shrink */
+    game_t *start = malloc(game_size(board_layout));
+    char frame[NGP_MAX_MSG];
+    if (!start) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    game_init(start, board_layout);
+    int fits = ngp_build_over(frame, sizeof(frame), 2, start->board, 1) != 0;
+    int playable = !game_is_over(start);
+    free(start);
+    if (!fits) {
+        fprintf(stderr, "--board: the board text must fit in an NGP "
+                "frame (at most %d bytes)\n",
+                NGP_MAX_MSG - NGP_HEADER_LEN - 16);
+        return EXIT_FAILURE;
+    }
+    if (!playable) {
+        fprintf(stderr, "--rules: no move is possible on the starting "
+                "board\n");
+        return EXIT_FAILURE;
+    }
+    cfg.layout = board_layout;
+    if (rules_spec) {
+        char desc[256];
+        rules_describe(&rules, desc, sizeof(desc));
+        if (rules.kind == RULES_SUBTRACT) {
+            log_text(LOG_INFO, "rules: %s (Grundy values repeat every %u "
+                     "from %u)", desc, rules.period, rules.pre);
         } else {
-            /* lobby full; just close connection */
-            close(fd);
+            log_text(LOG_INFO, "rules: %s", desc);
         }
+    }
 
-        /* prune any waiting players whose connections died before game */
-        int write_idx = 0;
-        for (int i = 0; i < waiting_count; i++) {
-            if (fd_alive(waiting[i].fd)) {
-                if (write_idx != i) {
-                    waiting[write_idx] = waiting[i];
-                }
-                write_idx++;
-            } else {
-                /* client disconnected before game; drop them */
-                close(waiting[i].fd);
-            }
+    outq_limit = (size_t)max_outq;
+    cfg.outq_limit = outq_limit;
+    turn_timeout_ms = cfg.turn_timeout_ms;
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+
+    /* a running nimd hands over its state before this one opens the
+       journal and player table it is still writing */
+    if (cfg.upgrade_path) {
+        if (cfg.start_game || use_coroutines) {
+            fprintf(stderr, "--upgrade: games on their own threads or "
+                    "coroutines cannot be handed over\n");
+            return EXIT_FAILURE;
+        }
+        int taken = reactor_takeover(cfg.upgrade_path);
+        if (taken < 0) {
+            return EXIT_FAILURE;
         }
-        waiting_count = write_idx;
+        if (taken) {
+            log_text(LOG_INFO, "upgrade: taking over from the nimd on %s",
+                     cfg.upgrade_path);
+        }
+    }
 
-        /* if we have at least two waiting players, start games in new threads */
-        while (waiting_count >= 2) {
-            game_pair_t *pair = malloc(sizeof(*pair));
-            if (!pair) {
-                /* out of memory; try again later */
-                break;
-            }
+    if (journal_dir && journal_open(journal_dir, journal_sync,
+                                    (size_t)journal_segment) != 0) {
+        perror(journal_dir);
+        return EXIT_FAILURE;
+    }
 
-            pair->p1 = waiting[0];
-            pair->p2 = waiting[1];
+    if (players_path && players_open(players_path, 0) != 0) {
+        perror(players_path);
+        return EXIT_FAILURE;
+    }
 
-            /* shift remaining waiting players down */
-            for (int i = 2; i < waiting_count; i++) {
-                waiting[i - 2] = waiting[i];
-            }
-            waiting_count -= 2;
-
-            pthread_mutex_lock(&active_mutex);
-            active_add_locked(pair->p1.name);
-            active_add_locked(pair->p2.name);
-            pthread_mutex_unlock(&active_mutex);
-
-            pthread_t tid;
-            if (pthread_create(&tid, NULL, game_thread, pair) != 0) {
-                perror("pthread_create");
-                close(pair->p1.fd);
-                close(pair->p2.fd);
-                free(pair);
-                continue;
-            }
+    if (max_spectators && spectate_start(max_spectators) != 0) {
+        perror("spectators");
+        return EXIT_FAILURE;
+    }
 
-            pthread_detach(tid);
-        }
+    if (use_coroutines) {
+        coro_init(cfg.game_workers ? cfg.game_workers : (int)ncpu,
+                  (size_t)coro_stack);
+        cfg.start_game = spawn_game_coroutine;
+        cfg.game_model = "coroutines";
+        log_text(LOG_INFO, "coroutine stacks: %zu bytes per game",
+                 coro_session_bytes());
+    }
+    cfg.report = report;
+    if (epoll_only || cfg.start_game) {
+        cfg.game_workers = 0;
+    } else if (cfg.game_workers == 0) {
+        cfg.game_workers = (int)ncpu;
     }
+    if (cfg.workers == 0) {
+        cfg.workers = epoll_only ? (int)ncpu : 1;
+    }
+
+    reactor_serve(&cfg);
+    log_flush();
+    fprintf(stderr, "Failed to start server\n");
+    return EXIT_FAILURE;
 }
@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "game.h"
+#include "wire.h"
+
+/* Reader for the game journal written by nimd --journal (see journal.h
+   for the format). Each segment is mapped and walked in place, so the
+   only per-game work is the CRC check and varint decoding; with
+   --summary nothing is formatted at all.
+
+   Usage: nimjournal [--summary] DIR|SEGMENT...
+   A directory stands for all of its segments, in order. */
+
+#define MAX_EVENTS_TEXT 8192
+
+typedef struct {
+    unsigned long long segments;
+    unsigned long long games;
+    unsigned long long moves;
+    unsigned long long fails;
+    unsigned long long bytes;
+    unsigned long long torn;
+    unsigned long long bot_games;
+    unsigned long long by_end[JOURNAL_END_ABORTED + 1];
+} totals_t;
+
+static totals_t totals;
+static int summary_only;
+
+static const unsigned char *get_name(const unsigned char *p,
+                                     const unsigned char *end,
+                                     const char **name, int *len) {
+    uint64_t n;
+    p = wire_get_varint(p, end, &n);
+    if (!p || n > (uint64_t)(end - p)) return NULL;
+    *name = (const char *)p;
+    *len = (int)n;
+    return p + n;
+}
+
+/* print a name as a logfmt quoted value, as nimd's log does */
+static void print_quoted(const char *s, int len) {
+    putchar('"');
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            putchar('\\');
+            putchar(c);
+        } else if (c < 0x20 || c == 0x7f) {
+            printf("\\x%02x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+/* decode one payload, printing it unless --summary; returns 0, or -1
+   if it is malformed */
+static int read_game(const unsigned char *p, const unsigned char *end) {
+    uint64_t start_ms, npiles, duration_ms, v;
+    const char *name[2];
+    int name_len[2];
+    static unsigned piles[NIM_MAX_PILES];
+
+    if (!(p = wire_get_varint(p, end, &start_ms))) return -1;
+    if (!(p = get_name(p, end, &name[0], &name_len[0]))) return -1;
+    if (!(p = get_name(p, end, &name[1], &name_len[1]))) return -1;
+    if (!(p = wire_get_varint(p, end, &npiles)) || npiles == 0
+        || npiles > NIM_MAX_PILES) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < npiles; i++) {
+        if (!(p = wire_get_varint(p, end, &v))) return -1;
+        piles[i] = (unsigned)v;
+    }
+
+    char events[MAX_EVENTS_TEXT];
+    size_t elen = 0;
+    unsigned long long moves = 0, fails = 0;
+    int more = 0;
+    for (;;) {
+        if (!(p = wire_get_varint(p, end, &v))) return -1;
+        if (v == 0) break;
+        if (v == JOURNAL_EV_MORE) {
+            more = 1;
+        } else if (v & 1) {
+            fails++;
+            if (!summary_only && elen < sizeof(events) - 32) {
+                elen += (size_t)sprintf(events + elen, "%sF%llu/%llu",
+                                        elen ? " " : "",
+                                        (unsigned long long)(v >> 2),
+                                        (unsigned long long)((v >> 1 & 1) + 1));
+            }
+        } else {
+            /* a pile after the first of one move is not another move */
+            if (!more) moves++;
+            if (!summary_only && elen < sizeof(events) - 32) {
+                uint64_t m = v >> 1;
+                elen += (size_t)sprintf(events + elen, "%s%llu:%llu",
+                                        more ? "+" : elen ? " " : "",
+                                        (unsigned long long)(m % npiles),
+                                        (unsigned long long)(m / npiles));
+            }
+            more = 0;
+        }
+    }
+    if (!(p = wire_get_varint(p, end, &duration_ms))) return -1;
+    if (end - p != 2 && (end - p != 3 || p[2] == 0)) return -1;
+    int winner = p[0];
+    int how = p[1];
+    int flags = (end - p == 3) ? p[2] : 0;
+
+    totals.games++;
+    totals.moves += moves;
+    totals.fails += fails;
+    if (how <= JOURNAL_END_ABORTED) totals.by_end[how]++;
+    if (flags & (JOURNAL_FLAG_BOT1 | JOURNAL_FLAG_BOT2)) totals.bot_games++;
+    if (summary_only) return 0;
+
+    time_t secs = (time_t)(start_ms / 1000);
+    struct tm tm;
+    char ts[32];
+    gmtime_r(&secs, &tm);
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    static char board[NIM_MAX_PILES * 11];
+    size_t blen = 0;
+    for (uint64_t i = 0; i < npiles && blen < sizeof(board) - 12; i++) {
+        blen += (size_t)sprintf(board + blen, "%s%u", i ? "," : "", piles[i]);
+    }
+    events[elen] = '\0';
+    board[blen] = '\0';
+
+    printf("ts=%s.%03uZ p1=", ts, (unsigned)(start_ms % 1000));
+    print_quoted(name[0], name_len[0]);
+    printf(" p2=");
+    print_quoted(name[1], name_len[1]);
+    printf(" board=%s winner=%d end=%s duration_ms=%llu moves=%llu "
+           "events=\"%s\"", board, winner, journal_end_name(how),
+           (unsigned long long)duration_ms, moves, events);
+    if (flags & (JOURNAL_FLAG_BOT1 | JOURNAL_FLAG_BOT2)) {
+        printf(" bot=%d", (flags & JOURNAL_FLAG_BOT1) ? 1 : 2);
+    }
+    putchar('\n');
+    return 0;
+}
+
+static int read_segment(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < JOURNAL_MAGIC_LEN) {
+        fprintf(stderr, "%s: not a journal segment\n", path);
+        close(fd);
+        return -1;
+    }
+    const unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+
+    int rc = 0;
+    if (memcmp(map, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s: not a journal segment\n", path);
+        rc = -1;
+    } else {
+        totals.segments++;
+        size_t off = JOURNAL_MAGIC_LEN;
+        while (off < size) {
+            const unsigned char *rec = map + off;
+            size_t left = size - off;
+            uint32_t len = (left >= JOURNAL_REC_HEADER) ? wire_get_u32(rec) : 0;
+            if (left < JOURNAL_REC_HEADER || len > left - JOURNAL_REC_HEADER
+                || journal_crc32(rec + JOURNAL_REC_HEADER, len)
+                   != wire_get_u32(rec + 4)
+                || read_game(rec + JOURNAL_REC_HEADER,
+                             rec + JOURNAL_REC_HEADER + len) != 0) {
+                /* a crash mid-write leaves a torn record at the end */
+                fprintf(stderr, "%s: bad record at offset %zu; "
+                        "skipping the rest of the segment\n", path, off);
+                totals.torn++;
+                break;
+            }
+            off += JOURNAL_REC_HEADER + len;
+        }
+        totals.bytes += off;
+    }
+    munmap((void *)map, size);
+    return rc;
+}
+
+static int cmp_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* every *.nj segment in dir, in name (= sequence) order */
+static int read_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror(dir);
+        return -1;
+    }
+    char **paths = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        size_t n = strlen(e->d_name);
+        if (n < 4 || strcmp(e->d_name + n - 3, ".nj") != 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(paths, cap * sizeof(*paths));
+            if (!grown) break;
+            paths = grown;
+        }
+        size_t plen = strlen(dir) + n + 2;
+        if (!(paths[count] = malloc(plen))) break;
+        snprintf(paths[count], plen, "%s/%s", dir, e->d_name);
+        count++;
+    }
+    closedir(d);
+
+    if (count > 0) qsort(paths, count, sizeof(*paths), cmp_names);
+    int rc = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (read_segment(paths[i]) != 0) rc = -1;
+        free(paths[i]);
+    }
+    free(paths);
+    return rc;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--summary] DIR|SEGMENT...\n"
+            "  --summary   print only totals and read throughput\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    int first = 1;
+    if (argc > 1 && strcmp(argv[1], "--summary") == 0) {
+        summary_only = 1;
+        first = 2;
+    }
+    if (first >= argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    static char outbuf[1 << 20];
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+    double t0 = now_sec();
+    int rc = 0;
+    for (int i = first; i < argc; i++) {
+        struct stat st;
+        if (stat(argv[i], &st) != 0) {
+            perror(argv[i]);
+            rc = -1;
+        } else if (S_ISDIR(st.st_mode)) {
+            if (read_dir(argv[i]) != 0) rc = -1;
+        } else if (read_segment(argv[i]) != 0) {
+            rc = -1;
+        }
+    }
+    double elapsed = now_sec() - t0;
+
+    if (summary_only) {
+        printf("segments: %llu (%llu bytes, %llu with a bad record)\n",
+               totals.segments, totals.bytes, totals.torn);
+        printf("games: %llu (", totals.games);
+        for (int i = 0; i <= JOURNAL_END_ABORTED; i++) {
+            printf("%s%s %llu", i ? ", " : "", journal_end_name(i),
+                   totals.by_end[i]);
+        }
+        printf(")\n");
+        printf("bot games: %llu\n", totals.bot_games);
+        printf("moves: %llu, FAILs: %llu\n", totals.moves, totals.fails);
+        printf("read in %.3f s: %.0f games/s, %.1f MB/s\n", elapsed,
+               elapsed > 0 ? totals.games / elapsed : 0.0,
+               elapsed > 0 ? totals.bytes / elapsed / 1e6 : 0.0);
+    }
+    fflush(stdout);
+    return (rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "players.h"
+
+/* Reader for the player table kept by nimd --players (see players.h).
+
+   Usage: nimplayers PATH [NAME...]
+   With names, prints those players; otherwise prints every player,
+   most wins first. */
+
+typedef struct {
+    char *name;
+    player_stats_t st;
+} entry_t;
+
+typedef struct {
+    entry_t *v;
+    size_t count;
+    size_t cap;
+} entries_t;
+
+static void print_player(const char *name, const player_stats_t *st) {
+    printf("name=\"");
+    for (const char *p = name; *p; p++) {
+        if (*p == '"' || *p == '\\') putchar('\\');
+        putchar(*p);
+    }
+    printf("\" games=%llu wins=%llu losses=%llu forfeits=%llu\n",
+           (unsigned long long)st->games, (unsigned long long)st->wins,
+           (unsigned long long)st->losses, (unsigned long long)st->forfeits);
+}
+
+static void collect(const char *name, const player_stats_t *st, void *arg) {
+    entries_t *e = arg;
+    if (e->count == e->cap) {
+        size_t cap = e->cap ? e->cap * 2 : 1024;
+        entry_t *v = realloc(e->v, cap * sizeof(*v));
+        if (!v) return;
+        e->v = v;
+        e->cap = cap;
+    }
+    char *copy = strdup(name);
+    if (!copy) return;
+    e->v[e->count].name = copy;
+    e->v[e->count].st = *st;
+    e->count++;
+}
+
+static int by_wins(const void *a, const void *b) {
+    const entry_t *x = a, *y = b;
+    if (x->st.wins != y->st.wins) return (x->st.wins < y->st.wins) ? 1 : -1;
+    if (x->st.games != y->st.games) return (x->st.games < y->st.games) ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s PATH [NAME...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (players_open(argv[1], 1) != 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    if (argc > 2) {
+        int rc = EXIT_SUCCESS;
+        for (int i = 2; i < argc; i++) {
+            player_stats_t st;
+            if (players_lookup(argv[i], &st)) {
+                print_player(argv[i], &st);
+            } else {
+                fprintf(stderr, "%s: no such player\n", argv[i]);
+                rc = EXIT_FAILURE;
+            }
+        }
+        return rc;
+    }
+
+    entries_t e = { NULL, 0, 0 };
+    players_foreach(collect, &e);
+    if (e.count > 0) qsort(e.v, e.count, sizeof(*e.v), by_wins);
+    for (size_t i = 0; i < e.count; i++) {
+        print_player(e.v[i].name, &e.v[i].st);
+        free(e.v[i].name);
+    }
+    free(e.v);
+    return EXIT_SUCCESS;
+}
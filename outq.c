@@ -0,0 +1,96 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "outq.h"
+
+#define OUTQ_MIN_CAP 256
+
+void outq_init(outq_t *q) {
+    q->buf = NULL;
+    q->head = 0;
+    q->tail = 0;
+    q->cap = 0;
+}
+
+void outq_free(outq_t *q) {
+    free(q->buf);
+    outq_init(q);
+}
+
+size_t outq_pending(const outq_t *q) {
+    return q->tail - q->head;
+}
+
+/* non-blocking even on a blocking socket; MSG_NOSIGNAL so a dead peer
+   cannot kill the process with SIGPIPE */
+static ssize_t send_some(int fd, const char *p, size_t len) {
+    ssize_t n;
+    do {
+        n = send(fd, p, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    return n;
+}
+
+/* make room for len more bytes at the tail */
+static int reserve(outq_t *q, size_t len) {
+    size_t used = q->tail - q->head;
+    if (q->tail + len <= q->cap) {
+        return 0;
+    }
+    if (used + len <= q->cap) {
+        memmove(q->buf, q->buf + q->head, used);
+    } else {
+        size_t cap = q->cap ? q->cap : OUTQ_MIN_CAP;
+        while (cap < used + len) cap *= 2;
+        char *buf = malloc(cap);
+        if (!buf) return -1;
+        if (used) memcpy(buf, q->buf + q->head, used);
+        free(q->buf);
+        q->buf = buf;
+        q->cap = cap;
+    }
+    q->head = 0;
+    q->tail = used;
+    return 0;
+}
+
+int outq_write(outq_t *q, int fd, const void *data, size_t len, size_t limit) {
+    const char *p = data;
+
+    if (q->head == q->tail) {
+        ssize_t n = send_some(fd, p, len);
+        if (n < 0) return OUTQ_ERROR;
+        p += n;
+        len -= (size_t)n;
+        if (len == 0) return OUTQ_OK;
+    }
+
+    return outq_append(q, p, len, limit);
+}
+
+int outq_append(outq_t *q, const void *data, size_t len, size_t limit) {
+    if (outq_pending(q) + len > limit) return OUTQ_FULL;
+    if (reserve(q, len) != 0) return OUTQ_FULL;
+
+    memcpy(q->buf + q->tail, data, len);
+    q->tail += len;
+    return OUTQ_OK;
+}
+
+int outq_flush(outq_t *q, int fd) {
+    while (q->head < q->tail) {
+        ssize_t n = send_some(fd, q->buf + q->head, q->tail - q->head);
+        if (n < 0) return OUTQ_ERROR;
+        if (n == 0) return OUTQ_OK;
+        q->head += (size_t)n;
+    }
+    q->head = q->tail = 0;
+    return OUTQ_OK;
+}
@@ -0,0 +1,42 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+
+// Per-connection output queue. Writes go straight to the socket when
+// nothing is queued; whatever the socket does not accept is buffered and
+// flushed once the socket becomes writable again. Sends never block.
+
+#define OUTQ_OK      0
+#define OUTQ_ERROR  -1   // socket error; the peer is gone
+#define OUTQ_FULL   -2   // queue would pass its high-water mark
+
+#define DEFAULT_OUTQ_LIMIT 65536   // default high-water mark, in bytes
+
+typedef struct {
+    char  *buf;
+    size_t head;   // first queued byte
+    size_t tail;   // end of queued bytes
+    size_t cap;
+} outq_t;
+
+void outq_init(outq_t *q);
+void outq_free(outq_t *q);
+
+// Bytes queued but not yet accepted by the socket
+size_t outq_pending(const outq_t *q);
+
+// Send len bytes on fd, queueing what the socket does not accept.
+// Returns OUTQ_OK, OUTQ_ERROR, or OUTQ_FULL if the queue would hold more
+// than limit bytes (a slow consumer); nothing is queued on failure.
+int outq_write(outq_t *q, int fd, const void *data, size_t len, size_t limit);
+
+// Queue len bytes without sending them, for a writer that batches
+// several frames into one outq_flush. Same return values as outq_write.
+int outq_append(outq_t *q, const void *data, size_t len, size_t limit);
+
+// Write as much of the queue as the socket accepts.
+// Returns OUTQ_OK (check outq_pending for leftovers) or OUTQ_ERROR.
+int outq_flush(outq_t *q, int fd);
+
+#endif
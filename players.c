@@ -0,0 +1,485 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "players.h"
+#include "registry.h"
+#include "server.h"
+
+/* The file is a header followed by a power-of-two array of slots, an
+ * open-addressing hash table with linear probing, mapped MAP_SHARED.
+ * A slot's hash is stored last (with a release store), so readers never
+ * see a half-written name, and a crash mid-insert leaves the slot empty.
+ * Names are never removed.
+ *
+ * Lookups and counter updates hold table_lock for reading, which costs
+ * no system call unless the table is being switched. Inserts are
+ * serialized by insert_lock. Growth runs on a thread of its own, so no
+ * event loop waits for it: it copies the table into "<path>.tmp", syncs
+ * it and renames it over the old file while the old mapping stays in
+ * use. Meanwhile every insert and counter update lists the slot it
+ * changed; growth then holds table_lock for writing only to copy those
+ * slots again and switch the mapping. */
+
+#define PLAYERS_MAGIC "NIMPLYR1"
+#define HEADER_SIZE 128
+#define MIN_SLOTS 1024              /* power of two */
+#define DIRTY_MIN 256               /* changed-slot list, first size */
+#define DIRTY_FINAL 256             /* changed slots left to copy under
+                                       the write lock */
+#define CATCH_UP_PASSES 8
+
+typedef struct {
+    char magic[8];
+    uint64_t slots;
+    uint64_t count;
+} header_t;
+
+typedef struct {
+    uint32_t hash;                  /* 0 marks an empty slot */
+    uint32_t unused;
+    player_stats_t st;
+    char name[MAX_NAME_LEN + 1];
+} __attribute__((aligned(128))) slot_t;
+
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t insert_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *table_path;
+static int read_only;
+static void *map;
+static size_t map_size;
+static header_t *header;
+static slot_t *slots;
+static size_t mask;
+
+/* A table being built: its file, until renamed into place, and mapping */
+typedef struct {
+    int fd;
+    void *map;
+    size_t size;
+    header_t *header;
+    slot_t *slots;
+    size_t mask;
+} table_t;
+
+/* growth (insert_lock held to start it): grow_busy from the start until
+   the grow thread is done, growing while changed slots must be listed */
+static int grow_busy;
+static int growing;
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t *dirty;
+static size_t dirty_count;
+static size_t dirty_cap;
+static int dirty_lost;              /* the list ran out of memory */
+
+static size_t table_bytes(size_t nslots) {
+    return HEADER_SIZE + nslots * sizeof(slot_t);
+}
+
+/* the slot holding name, or NULL (with table_lock held) */
+static slot_t *find(uint32_t h, const char *name) {
+    size_t i = h & mask;
+    for (;;) {
+        uint32_t sh = __atomic_load_n(&slots[i].hash, __ATOMIC_ACQUIRE);
+        if (sh == 0) return NULL;
+        if (sh == h && strcmp(slots[i].name, name) == 0) return &slots[i];
+        i = (i + 1) & mask;
+    }
+}
+
+/* fsync the directory holding path, so a rename survives a crash */
+static void sync_dir(const char *path) {
+    char dir[4096];
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        strcpy(dir, ".");
+    } else {
+        size_t n = (size_t)(slash - path);
+        if (n == 0) n = 1;
+        if (n >= sizeof(dir)) return;
+        memcpy(dir, path, n);
+        dir[n] = '\0';
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        (void)fsync(fd);
+        close(fd);
+    }
+}
+
+/* copy slot from into table t, adding it if its name is new there;
+   from's counters must not change meanwhile, or the change is listed */
+static void table_put(table_t *t, const slot_t *from) {
+    uint32_t h = __atomic_load_n(&from->hash, __ATOMIC_ACQUIRE);
+    size_t j = h & t->mask;
+    while (t->slots[j].hash != 0
+           && (t->slots[j].hash != h
+               || strcmp(t->slots[j].name, from->name) != 0)) {
+        j = (j + 1) & t->mask;
+    }
+    slot_t *s = &t->slots[j];
+    s->st.games = __atomic_load_n(&from->st.games, __ATOMIC_RELAXED);
+    s->st.wins = __atomic_load_n(&from->st.wins, __ATOMIC_RELAXED);
+    s->st.losses = __atomic_load_n(&from->st.losses, __ATOMIC_RELAXED);
+    s->st.forfeits = __atomic_load_n(&from->st.forfeits, __ATOMIC_RELAXED);
+    if (s->hash == 0) {
+        memcpy(s->name, from->name, sizeof(s->name));
+        s->hash = h;
+        t->header->count++;
+    }
+}
+
+/* create "<path>.tmp" as a table of nslots holding every entry of the
+   current one (if any), and sync it. Entries may be added and counters
+   bumped while it is copied; those show up in the dirty list. */
+static int table_build(size_t nslots, table_t *t) {
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", table_path)
+        >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    size_t size = table_bytes(nslots);
+    if (ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    t->fd = fd;
+    t->map = m;
+    t->size = size;
+    t->header = m;
+    t->slots = (slot_t *)((char *)m + HEADER_SIZE);
+    t->mask = nslots - 1;
+    size_t old_size = slots ? mask + 1 : 0;
+    for (size_t i = 0; i < old_size; i++) {
+        if (__atomic_load_n(&slots[i].hash, __ATOMIC_ACQUIRE) != 0) {
+            table_put(t, &slots[i]);
+        }
+    }
+    memcpy(t->header->magic, PLAYERS_MAGIC, sizeof(t->header->magic));
+    t->header->slots = nslots;
+
+    if (msync(m, size, MS_SYNC) != 0 || fsync(fd) != 0) {
+        int err = errno;
+        munmap(m, size);
+        close(fd);
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* rename a built table over the old file */
+static int table_commit(table_t *t) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", table_path);
+    if (rename(tmp, table_path) != 0) {
+        int err = errno;
+        munmap(t->map, t->size);
+        close(t->fd);
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    close(t->fd);
+    sync_dir(table_path);
+    return 0;
+}
+
+/* make t the table in use; returns the old mapping's size, to unmap */
+static size_t table_install(table_t *t, void **old) {
+    size_t old_size = map_size;
+    *old = map;
+    map = t->map;
+    map_size = t->size;
+    header = t->header;
+    slots = t->slots;
+    mask = t->mask;
+    return old_size;
+}
+
+/* list slot i as changed while a larger table is being built (called
+   with table_lock held for reading, after the change). Only the grow
+   thread changes the mapping, so it reads slots and mask unlocked. */
+static void mark_dirty(size_t i) {
+    /* pairs with the store in start_grow: a change the grow thread's
+       copy may have missed is always listed */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&growing, __ATOMIC_RELAXED)) return;
+
+    pthread_mutex_lock(&dirty_lock);
+    if (dirty_count == dirty_cap) {
+        size_t cap = dirty_cap ? dirty_cap * 2 : DIRTY_MIN;
+        size_t *grown = realloc(dirty, cap * sizeof(*dirty));
+        if (grown) {
+            dirty = grown;
+            dirty_cap = cap;
+        }
+    }
+    if (dirty_count < dirty_cap) {
+        dirty[dirty_count++] = i;
+    } else {
+        dirty_lost = 1;
+    }
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+/* take the list of slots changed so far, leaving an empty one */
+static size_t dirty_take(size_t **list, int *lost) {
+    pthread_mutex_lock(&dirty_lock);
+    size_t n = dirty_count;
+    *list = dirty;
+    *lost = dirty_lost;
+    dirty = NULL;
+    dirty_count = dirty_cap = 0;
+    dirty_lost = 0;
+    pthread_mutex_unlock(&dirty_lock);
+    return n;
+}
+
+/* copy the listed slots (or all of them, if the list was lost) into t */
+static void dirty_apply(table_t *t, const size_t *list, size_t n, int lost) {
+    if (lost) {
+        for (size_t i = 0; i <= mask; i++) {
+            if (__atomic_load_n(&slots[i].hash, __ATOMIC_ACQUIRE) != 0) {
+                table_put(t, &slots[i]);
+            }
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        table_put(t, &slots[list[i]]);
+    }
+}
+
+static void *grow_run(void *arg) {
+    (void)arg;
+    table_t t;
+    size_t *list;
+    int lost;
+    size_t n;
+    if (table_build((mask + 1) * 2, &t) != 0 || table_commit(&t) != 0) {
+        perror("players: grow");
+        pthread_rwlock_wrlock(&table_lock);
+        __atomic_store_n(&growing, 0, __ATOMIC_RELAXED);
+        n = dirty_take(&list, &lost);
+        pthread_rwlock_unlock(&table_lock);
+        free(list);
+        __atomic_store_n(&grow_busy, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    /* the new file is in place. Bring over what changed in the old
+       table since it was copied, a pass at a time while the old one
+       stays in use, until little is left to copy with it locked. */
+    for (int pass = 0; pass < CATCH_UP_PASSES; pass++) {
+        n = dirty_take(&list, &lost);
+        dirty_apply(&t, list, n, lost);
+        free(list);
+        if (n <= DIRTY_FINAL && !lost) break;
+    }
+
+    pthread_rwlock_wrlock(&table_lock);
+    __atomic_store_n(&growing, 0, __ATOMIC_RELAXED);
+    n = dirty_take(&list, &lost);
+    dirty_apply(&t, list, n, lost);
+    void *old;
+    size_t old_size = table_install(&t, &old);
+    pthread_rwlock_unlock(&table_lock);
+
+    free(list);
+    munmap(old, old_size);
+    __atomic_store_n(&grow_busy, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* start building a table twice the size, unless that is under way
+   (insert_lock held) */
+static void start_grow(void) {
+    if (__atomic_load_n(&grow_busy, __ATOMIC_ACQUIRE)) return;
+    grow_busy = 1;
+    __atomic_store_n(&growing, 1, __ATOMIC_SEQ_CST);
+
+    /* the grow thread takes no signals; they belong to the event loops */
+    sigset_t all, prev;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &prev);
+    pthread_t tid;
+    int rc = pthread_create(&tid, NULL, grow_run, NULL);
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+    if (rc != 0) {
+        errno = rc;
+        perror("players: grow");
+        __atomic_store_n(&growing, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&grow_busy, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+int players_open(const char *path, int readonly) {
+    table_path = strdup(path);
+    if (!table_path) return -1;
+    read_only = readonly;
+
+    int fd = open(path, (readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT || readonly) return -1;
+        table_t t;
+        void *none;
+        if (table_build(MIN_SLOTS, &t) != 0 || table_commit(&t) != 0) {
+            return -1;
+        }
+        (void)table_install(&t, &none);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    void *m = MAP_FAILED;
+    if (size >= HEADER_SIZE) {
+        m = mmap(NULL, size, readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (m == MAP_FAILED) {
+        if (size < HEADER_SIZE) errno = EINVAL;
+        return -1;
+    }
+
+    header_t *h = m;
+    uint64_t n = h->slots;
+    if (memcmp(h->magic, PLAYERS_MAGIC, sizeof(h->magic)) != 0
+        || n == 0 || (n & (n - 1)) != 0 || n > SIZE_MAX / sizeof(slot_t)
+        || table_bytes((size_t)n) != size) {
+        munmap(m, size);
+        errno = EINVAL;
+        return -1;
+    }
+    map = m;
+    map_size = size;
+    header = h;
+    slots = (slot_t *)((char *)m + HEADER_SIZE);
+    mask = (size_t)n - 1;
+    return 0;
+}
+
+int players_lookup(const char *name, player_stats_t *out) {
+    if (!map) return 0;
+    uint32_t h = registry_hash(name);
+    pthread_rwlock_rdlock(&table_lock);
+    slot_t *s = find(h, name);
+    if (s) {
+        out->games = __atomic_load_n(&s->st.games, __ATOMIC_RELAXED);
+        out->wins = __atomic_load_n(&s->st.wins, __ATOMIC_RELAXED);
+        out->losses = __atomic_load_n(&s->st.losses, __ATOMIC_RELAXED);
+        out->forfeits = __atomic_load_n(&s->st.forfeits, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return s != NULL;
+}
+
+void players_add(const char *name) {
+    if (!map || read_only) return;
+    uint32_t h = registry_hash(name);
+
+    pthread_rwlock_rdlock(&table_lock);
+    slot_t *s = find(h, name);
+    pthread_rwlock_unlock(&table_lock);
+    if (s) return;
+
+    pthread_mutex_lock(&insert_lock);
+    pthread_rwlock_rdlock(&table_lock);
+    /* past a load factor of 1/2 a larger table is built in the
+       background; inserts go on into this one up to 7/8 */
+    uint64_t count = header->count;
+    if ((count + 1) * 2 > mask + 1) start_grow();
+    if ((count + 1) * 8 <= (mask + 1) * 7 && !find(h, name)) {
+        size_t i = h & mask;
+        while (slots[i].hash != 0) i = (i + 1) & mask;
+        memcpy(slots[i].name, name, strnlen(name, MAX_NAME_LEN) + 1);
+        slots[i].name[MAX_NAME_LEN] = '\0';
+        __atomic_store_n(&slots[i].hash, h, __ATOMIC_RELEASE);
+        __atomic_store_n(&header->count, count + 1, __ATOMIC_RELAXED);
+        mark_dirty(i);
+    }
+    pthread_rwlock_unlock(&table_lock);
+    pthread_mutex_unlock(&insert_lock);
+}
+
+/* add one game to name's counters; returns 0 if name has no entry */
+static int bump(const char *name, int won, int forfeit) {
+    uint32_t h = registry_hash(name);
+    pthread_rwlock_rdlock(&table_lock);
+    slot_t *s = find(h, name);
+    if (s) {
+        __atomic_fetch_add(&s->st.games, 1, __ATOMIC_RELAXED);
+        if (won) {
+            __atomic_fetch_add(&s->st.wins, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&s->st.losses, 1, __ATOMIC_RELAXED);
+            if (forfeit) {
+                __atomic_fetch_add(&s->st.forfeits, 1, __ATOMIC_RELAXED);
+            }
+        }
+        mark_dirty((size_t)(s - slots));
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return s != NULL;
+}
+
+void players_record(const char *winner, const char *loser, int forfeit) {
+    if (!map || read_only) return;
+    /* names are added at OPEN; this only inserts if that failed */
+    if (!bump(winner, 1, 0)) {
+        players_add(winner);
+        (void)bump(winner, 1, 0);
+    }
+    if (!bump(loser, 0, forfeit)) {
+        players_add(loser);
+        (void)bump(loser, 0, forfeit);
+    }
+}
+
+uint64_t players_count(void) {
+    if (!map) return 0;
+    return __atomic_load_n(&header->count, __ATOMIC_RELAXED);
+}
+
+void players_foreach(void (*fn)(const char *name, const player_stats_t *st,
+                                void *arg),
+                     void *arg) {
+    if (!map) return;
+    pthread_rwlock_rdlock(&table_lock);
+    for (size_t i = 0; i <= mask; i++) {
+        if (__atomic_load_n(&slots[i].hash, __ATOMIC_ACQUIRE) != 0) {
+            player_stats_t st = slots[i].st;
+            fn(slots[i].name, &st, arg);
+        }
+    }
+    pthread_rwlock_unlock(&table_lock);
+}
@@ -0,0 +1,52 @@
+#ifndef PLAYERS_H
+#define PLAYERS_H
+
+#include <stdint.h>
+
+// Persistent per-name statistics, kept in a file-backed hash table that
+// is mapped into memory. Opening an existing file is a single mmap with
+// no parse step. Lookups and counter updates touch only the mapping:
+// they make no system calls, and counters are bumped with atomic adds
+// in place. Inserting a name the table has never seen takes a lock.
+// Growing the table builds a larger copy next to the file, on a thread
+// of its own so no caller waits for the copy, and renames it into
+// place, so a crash leaves either the old table or the new one.
+// Counters reach the disk when the kernel writes the pages back; a
+// crash of the server loses nothing, a crash of the machine may lose
+// the most recent updates (the journal has every game, see journal.h).
+
+typedef struct {
+    uint64_t games;
+    uint64_t wins;
+    uint64_t losses;
+    uint64_t forfeits;   // losses by forfeit, also counted in losses
+} player_stats_t;
+
+// Open (creating it if needed) the table at path; with readonly set, the
+// file must exist and the table cannot change. Returns 0, or -1 with
+// errno set (EINVAL if the file is not a player table).
+int players_open(const char *path, int readonly);
+
+// Copy name's statistics into *out; returns 1 if the name is known, 0
+// if not (or the table is not open)
+int players_lookup(const char *name, player_stats_t *out);
+
+// Make sure name has an entry, so recording its games later never
+// inserts. Called at OPEN; costs one lookup for a returning player.
+// A name is left out if the table fills to 7/8 before a larger one is
+// ready; players_record adds it when a game is counted, if there is
+// room by then.
+void players_add(const char *name);
+
+// Count a finished game; winner and loser are names
+void players_record(const char *winner, const char *loser, int forfeit);
+
+// Names in the table
+uint64_t players_count(void);
+
+// Call fn for every name in the table, in no particular order
+void players_foreach(void (*fn)(const char *name, const player_stats_t *st,
+                                void *arg),
+                     void *arg);
+
+#endif
@@ -0,0 +1,2338 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "reactor.h"
+#include "server.h"
+#include "network.h"
+#include "registry.h"
+#include "outq.h"
+#include "ngp.h"
+#include "game.h"
+#include "rules.h"
+#include "slab.h"
+#include "wheel.h"
+#include "stats.h"
+#include "log.h"
+#include "journal.h"
+#include "players.h"
+#include "spectate.h"
+#include "handoff.h"
+
+#define MAX_EVENTS 64
+#define MATCH_RETRY_MS 50  /* recheck a full pool or game limit this often */
+
+/* per-connection handshake and lifecycle states; a connection only
+   moves forward, and nothing on the loop ever blocks on one peer */
+typedef enum {
+    CONN_CONNECTED,     /* accepted, OPEN not yet received (deadline armed) */
+    CONN_OPEN_RECEIVED, /* valid OPEN, name reserved */
+    CONN_WAIT_SENT,     /* WAIT written */
+    CONN_LOBBY,         /* queued, waiting for an opponent (idle deadline) */
+    CONN_GAME,          /* paired with an opponent in a session */
+    CONN_MUX,           /* carries multiplexed players (NGP1_MUX frames) */
+    CONN_DRAINING,      /* done; flushing output before closing (deadline) */
+    CONN_CLOSED         /* fd closed or handed off; freed after the batch */
+} conn_state_t;
+
+typedef struct session session_t;
+typedef struct reactor reactor_t;
+
+typedef struct conn {
+    int fd;
+    conn_state_t state;
+    char name[MAX_NAME_LEN + 1];
+    int has_name;               /* holds a registry reservation */
+    int version;                /* NGP version of frames it is sent */
+    /* a player on a multiplexed connection has no fd of its own: it
+       sends and receives through mux, under session id mux_id */
+    struct conn *mux;
+    uint32_t mux_id;
+    /* CONN_MUX: its players by session id (config.mux_players slots),
+       the loop it is on and its place on that loop's flush list */
+    struct conn **mux_players;
+    int mux_live;
+    int mux_broken;             /* output passed the high-water mark */
+    int flush_queued;
+    reactor_t *loop;
+    struct conn *next_flush;
+    ngp_framer_t in;
+    outq_t out;
+    session_t *session;
+    /* handshake, lobby idle or drain deadline, if armed */
+    wheel_timer_t timer;
+    /* when the current wait began: accept, then WAIT (stats, in us) */
+    long long since_us;
+    /* lobby queue links while CONN_LOBBY */
+    struct conn *lobby_prev;
+    struct conn *lobby_next;
+    /* the other player when handed to a game worker as a pair */
+    struct conn *handoff_peer;
+    /* deferred free list, or a loop's inbox */
+    struct conn *next_closed;
+    /* the loop's connections with a socket of their own, listed for a
+       hot upgrade, and the number it is handed over under */
+    struct conn *conn_prev;
+    struct conn *conn_next;
+    uint32_t handoff_id;
+} conn_t;
+
+/* players waiting for an opponent, in arrival order; linked through
+   the connections themselves, so enqueue, dequeue and removal of a
+   player who hung up are all O(1) and the queue never needs resizing */
+typedef struct {
+    conn_t *head;
+    conn_t *tail;
+    int count;
+} lobby_t;
+
+struct session {
+    conn_t *p[2];     /* p[0] is player 1, p[1] is player 2 */
+    wheel_timer_t turn;   /* current player's move clock */
+    long long started_us;
+    journal_game_t *journal;   /* record of the game, or NULL */
+    spectate_game_t *spectate; /* its spectators' channel, or NULL */
+    game_t game;      /* last: its piles and board text follow */
+};
+
+/* one reactor per worker thread. Acceptor shards each have their own
+   SO_REUSEPORT listener, epoll set and lobby; game workers in the pool
+   have no listener (-1) and only run sessions handed to them */
+struct reactor {
+    int id;
+    int epfd;
+    int listener;
+    lobby_t lobby;
+    conn_t *closed;
+    wheel_t timers;               /* conn deadlines and turn clocks */
+    int games;                    /* live sessions (atomic) */
+    /* lobby players or matched pairs handed over by other loops;
+       a lock-free stack pushed by any thread, emptied by this one */
+    int inbox_fd;
+    conn_t *inbox;
+    uint64_t rng;                 /* the bot's dice (xorshift64*) */
+    conn_t *flush;                /* multiplexed connections with output */
+    conn_t *conns;                /* connections with a socket */
+};
+
+static reactor_config_t config;
+static reactor_t *shards;
+static int shard_count;
+
+/* game workers (config.game_workers) */
+static reactor_t *pool;
+static int pool_count;
+
+/* every connection, and one object per live game: a session_t on the
+   loops, or the player_pair_t handed to start_game; bounded by
+   config.max_games */
+static slab_t conn_slab;
+static slab_t game_slab;
+
+/* shard holding a lone waiting player that others may pair with */
+static pthread_mutex_t stray_lock = PTHREAD_MUTEX_INITIALIZER;
+static int stray_shard = -1;
+static int stray_mux;           /* its player is multiplexed: cannot move */
+
+/* epoll data pointers for the non-connection fds */
+static char listener_tag;
+static char inbox_tag;
+static char report_tag;
+static char admin_tag;
+
+/* the bot's seat in every bot game. It has no socket and is never
+   written once the loops run: frames sent to it are dropped, and its
+   moves are made by session_bot_move */
+static conn_t bot_conn;
+
+/* SIGUSR1, read by shard 0 to print occupancy */
+static int report_fd = -1;
+
+/* Unix socket on shard 0 answering with a stats snapshot */
+static int admin_fd = -1;
+
+/* Unix socket on shard 0 where a new binary asks for a hot upgrade */
+static int upgrade_fd = -1;
+static char upgrade_tag;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* queue a v1 frame for session id on a multiplexed connection. It is
+   not sent yet: everything queued for the connection while the loop
+   handles a batch of events goes out together in mux_flush. Returns 0,
+   or -1 once the queue has passed its high-water mark (scaled by the
+   players it carries); the connection is then closed at the flush. */
+static int mux_write(conn_t *m, uint32_t id, const char *buf, size_t len) {
+    if (m->mux_broken) return -1;
+    char out[NGP_MAX_MSG];
+    size_t outlen = ngp1_tag(out, sizeof(out), id, buf, len);
+    size_t players = (m->mux_live > 0) ? (size_t)m->mux_live : 1;
+    if (outq_append(&m->out, out, outlen, config.outq_limit * players)
+        != OUTQ_OK) {
+        m->mux_broken = 1;
+    }
+    if (!m->flush_queued) {
+        m->flush_queued = 1;
+        m->next_flush = m->loop->flush;
+        m->loop->flush = m;
+    }
+    return m->mux_broken ? -1 : 0;
+}
+
+/* queue a frame for a connection without blocking; returns 0, or -1
+   if the peer must be dropped: the connection failed, or the peer
+   stopped reading and its queue passed the high-water mark */
+static int conn_send(conn_t *c, const char *buf, size_t len) {
+    if (c == &bot_conn) return 0;
+    if (c->mux) return mux_write(c->mux, c->mux_id, buf, len);
+    int rc = outq_write(&c->out, c->fd, buf, len, config.outq_limit);
+    return (rc == OUTQ_OK) ? 0 : -1;
+}
+
+static int conn_send_fail(conn_t *c, int code) {
+    const ngp_frame *f = c->version ? ngp1_fail_frame(code)
+                                    : ngp_fail_frame(code);
+    stats_fail(code);
+    return conn_send(c, f->data, f->len);
+}
+
+static int conn_send_name(conn_t *c, int player_num, const char *opponent) {
+    char out[NGP_MAX_MSG];
+    size_t outlen = c->version
+        ? ngp1_build_name(out, sizeof(out), player_num, opponent)
+        : ngp_build_name(out, sizeof(out), player_num, opponent);
+    return conn_send(c, out, outlen);
+}
+
+/* a PLAY or OVER, encoded in c's version if no one has needed it yet */
+static int conn_send_board(conn_t *c, ngp_board_frame_t *f) {
+    if (c == &bot_conn) return 0;
+    const char *data;
+    size_t len = ngp_board_frame(f, c->version, &data);
+    return conn_send(c, data, len);
+}
+
+/* a connection has one deadline at a time, whose meaning depends on
+   its state (see on_conn_timer) */
+static void timer_arm(reactor_t *r, conn_t *c, int timeout_ms) {
+    wheel_arm(&r->timers, &c->timer, now_ms() + timeout_ms);
+}
+
+static void timer_cancel(conn_t *c) {
+    wheel_cancel(&c->timer);
+}
+
+static void conn_release_name(conn_t *c) {
+    if (c->has_name) {
+        registry_release(c->name);
+        c->has_name = 0;
+    }
+}
+
+static void conn_link(reactor_t *r, conn_t *c) {
+    c->conn_prev = NULL;
+    c->conn_next = r->conns;
+    if (r->conns) r->conns->conn_prev = c;
+    r->conns = c;
+}
+
+/* take c off r's list as it closes or moves to another loop; a
+   multiplexed player is never on one */
+static void conn_unlink(reactor_t *r, conn_t *c) {
+    if (c->conn_prev) c->conn_prev->conn_next = c->conn_next;
+    else if (r->conns == c) r->conns = c->conn_next;
+    else return;
+    if (c->conn_next) c->conn_next->conn_prev = c->conn_prev;
+    c->conn_prev = c->conn_next = NULL;
+}
+
+/* forget a connection without closing its fd; the struct itself is
+   freed once the current batch of events has been dispatched, since a
+   later event in the same batch may still point at it */
+static void conn_retire(reactor_t *r, conn_t *c) {
+    conn_unlink(r, c);
+    timer_cancel(c);
+    c->fd = -1;
+    c->state = CONN_CLOSED;
+    c->session = NULL;
+    c->next_closed = r->closed;
+    r->closed = c;
+}
+
+static void conn_close(reactor_t *r, conn_t *c) {
+    if (c->state == CONN_CLOSED) return;
+    conn_release_name(c);
+    if (c->mux) {
+        /* its session id is free for a new player */
+        c->mux->mux_players[c->mux_id] = NULL;
+        c->mux->mux_live--;
+        c->mux = NULL;
+        stats_gauge_add(STAT_MUX_PLAYERS, -1);
+    } else {
+        close(c->fd);
+    }
+    conn_retire(r, c);
+}
+
+/* close once queued output has been written (or the drain deadline
+   passes); the name is free for reuse right away */
+static void conn_finish(reactor_t *r, conn_t *c) {
+    if (c->state == CONN_CLOSED || c->state == CONN_DRAINING) return;
+    conn_release_name(c);
+    if (outq_pending(&c->out) == 0) {
+        conn_close(r, c);
+        return;
+    }
+    timer_cancel(c);
+    c->state = CONN_DRAINING;
+    c->session = NULL;
+    timer_arm(r, c, DRAIN_TIMEOUT_MS);
+}
+
+static void free_closed(reactor_t *r) {
+    while (r->closed) {
+        conn_t *c = r->closed;
+        r->closed = c->next_closed;
+        outq_free(&c->out);
+        free(c->mux_players);
+        slab_free(&conn_slab, c);
+    }
+}
+
+/* pull the next complete frame off a connection, reading from the
+   socket (in batches, until EAGAIN) only when none is buffered.
+   Returns 1 with msg filled in, 0 once the socket is drained,
+   -1 on EOF or error, -2 on a malformed frame. */
+static int conn_next_message(conn_t *c, char *frame, ngp_message *msg) {
+    for (;;) {
+        size_t len;
+        int rc = ngp_framer_next(&c->in, frame, NGP_MAX_MSG, &len);
+        if (rc > 0) {
+            if (ngp_parse(frame, len, msg) != 0) return -2;
+            /* session ids are for multiplexed connections only */
+            if (c->state != CONN_CONNECTED
+                && (msg->session >= 0) != (c->state == CONN_MUX)) {
+                return -2;
+            }
+            return 1;
+        }
+        if (rc < 0) {
+            return -2;
+        }
+
+        ssize_t n = ngp_framer_read(&c->in, c->fd);
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        return -1;
+    }
+}
+
+/* --------------------------
+   Game sessions
+   -------------------------- */
+
+/* the bot's seat in s (1 or 2), or 0 if both players are people */
+static int session_bot(const session_t *s) {
+    if (s->p[0] == &bot_conn) return 1;
+    if (s->p[1] == &bot_conn) return 2;
+    return 0;
+}
+
+/* winner is 1 or 2; how is a journal_end_t */
+static void session_end(reactor_t *r, session_t *s, int winner,
+                        journal_end_t how) {
+    journal_end(s->journal, winner, how);
+    spectate_end(s->spectate);
+    stats_record(STAT_GAME_DURATION, stats_now_us() - s->started_us);
+    stats_count(STAT_GAMES_FINISHED);
+    wheel_cancel(&s->turn);
+    int bot = session_bot(s);
+    if (bot) {
+        /* the player table only counts games between people */
+        stats_gauge_add(STAT_BOT_GAMES, -1);
+        conn_finish(r, s->p[2 - bot]);
+    } else {
+        players_record(s->p[winner - 1]->name, s->p[2 - winner]->name,
+                       how != JOURNAL_END_NORMAL);
+        conn_finish(r, s->p[0]);
+        conn_finish(r, s->p[1]);
+    }
+    slab_free(&game_slab, s);
+    __atomic_fetch_sub(&r->games, 1, __ATOMIC_RELAXED);
+}
+
+/* a PLAY (type NGP1_PLAY) or OVER of the current board */
+static void session_board_frame(session_t *s, ngp_board_frame_t *f,
+                                int type, int player, int forfeit) {
+    ngp_board_frame_init(f, type, player, forfeit, s->game.board,
+                         s->game.piles, s->game.layout->piles);
+}
+
+/* spectators are sent text frames */
+static void session_spectate(session_t *s, ngp_board_frame_t *f) {
+    if (!s->spectate) return;
+    const char *data;
+    size_t len = ngp_board_frame(f, 0, &data);
+    spectate_frame(s->spectate, data, len);
+}
+
+/* send OVER ... Forfeit to the winner and end the game */
+static void session_forfeit(reactor_t *r, session_t *s, int winner,
+                            journal_end_t how) {
+    stats_count(STAT_FORFEITS);
+    ngp_board_frame_t f;
+    session_board_frame(s, &f, NGP1_OVER, winner, 1);
+    (void)conn_send_board(s->p[winner - 1], &f);
+    session_spectate(s, &f);
+    session_end(r, s, winner, how);
+}
+
+/* send the same frame to both players, each in their own version; a
+   player who cannot take it forfeits. Returns 1 if the session has
+   ended, 0 otherwise. */
+static int session_broadcast(reactor_t *r, session_t *s,
+                             ngp_board_frame_t *f) {
+    if (conn_send_board(s->p[0], f) != 0) {
+        session_forfeit(r, s, 2, JOURNAL_END_FORFEIT);
+        return 1;
+    }
+    if (conn_send_board(s->p[1], f) != 0) {
+        session_forfeit(r, s, 1, JOURNAL_END_FORFEIT);
+        return 1;
+    }
+    return 0;
+}
+
+static int session_bot_move(reactor_t *r, session_t *s);
+
+/* every PLAY starts the current player's move clock; the bot answers
+   its PLAY at once */
+static int session_send_play(reactor_t *r, session_t *s) {
+    int bot_turn = (s->p[s->game.current_player - 1] == &bot_conn);
+    if (config.turn_timeout_ms > 0 && !bot_turn) {
+        wheel_arm(&r->timers, &s->turn, now_ms() + config.turn_timeout_ms);
+    }
+    ngp_board_frame_t f;
+    session_board_frame(s, &f, NGP1_PLAY, s->game.current_player, 0);
+    if (session_broadcast(r, s, &f)) {
+        return 1;
+    }
+    session_spectate(s, &f);
+    return bot_turn ? session_bot_move(r, s) : 0;
+}
+
+/* send a FAIL to player `who` (1 or 2) and note it in the journal */
+static int session_fail(session_t *s, int who, int code) {
+    journal_fail(s->journal, who, code);
+    return conn_send_fail(s->p[who - 1], code);
+}
+
+/* apply a legal move for the current player, then send OVER or the
+   next PLAY. Returns 1 if the session has ended, 0 otherwise. */
+static int session_move(reactor_t *r, session_t *s, const game_move_t *m) {
+    long long moved_us = stats_now_us();
+    stats_count(STAT_MOVES);
+    journal_move(s->journal, m->pile[0], (int)m->qty[0]);
+    for (int i = 1; i < m->count; i++) {
+        journal_move_more(s->journal, m->pile[i], (int)m->qty[i]);
+    }
+    game_play(&s->game, m);
+
+    if (game_is_over(&s->game)) {
+        int winner = game_winner(&s->game);
+        log_event(LOG_DEBUG, LOG_EV_GAME_OVER, s->p[winner - 1]->name,
+                  s->p[2 - winner]->name, 0);
+        ngp_board_frame_t f;
+        session_board_frame(s, &f, NGP1_OVER, winner, 0);
+        (void)conn_send_board(s->p[0], &f);
+        (void)conn_send_board(s->p[1], &f);
+        session_spectate(s, &f);
+        session_end(r, s, winner, JOURNAL_END_NORMAL);
+        return 1;
+    }
+
+    if (session_send_play(r, s)) {
+        return 1;
+    }
+    stats_record(STAT_MOVE_TO_PLAY, stats_now_us() - moved_us);
+    return 0;
+}
+
+/* handle one message from player `who` (1 or 2).
+   Returns 1 if the session has ended (and been freed), 0 otherwise. */
+static int session_on_message(reactor_t *r, session_t *s, int who,
+                              ngp_message *msg) {
+    int opponent = (who == 1) ? 2 : 1;
+
+    if (who != s->game.current_player) {
+        if (strcmp(msg->type, "MOVE") == 0) {
+            /* out-of-turn MOVE => FAIL 31 Impatient; turn unchanged */
+            if (session_fail(s, who, 31) != 0) {
+                session_forfeit(r, s, opponent, JOURNAL_END_FORFEIT);
+                return 1;
+            }
+            return 0;
+        }
+        if (strcmp(msg->type, "OPEN") == 0) {
+            (void)session_fail(s, who, 23);
+        } else {
+            (void)session_fail(s, who, 10);
+        }
+        session_forfeit(r, s, opponent, JOURNAL_END_FORFEIT);
+        return 1;
+    }
+
+    if (strcmp(msg->type, "MOVE") != 0 || msg->field_count < 2) {
+        if (strcmp(msg->type, "OPEN") == 0) {
+            (void)session_fail(s, who, 23);
+        } else {
+            (void)session_fail(s, who, 10);
+        }
+        session_forfeit(r, s, opponent, JOURNAL_END_FORFEIT);
+        return 1;
+    }
+
+    game_move_t move;
+    int code = game_read_move(&s->game, msg->values, ngp_numbers(msg),
+                              &move);
+    if (code != 0) {
+        /* turn unchanged; ask again */
+        if (session_fail(s, who, code) != 0) {
+            session_forfeit(r, s, opponent, JOURNAL_END_FORFEIT);
+            return 1;
+        }
+        return 0;
+    }
+
+    return session_move(r, s, &move);
+}
+
+static uint64_t bot_next(reactor_t *r) {
+    r->rng ^= r->rng >> 12;
+    r->rng ^= r->rng << 25;
+    r->rng ^= r->rng >> 27;
+    return r->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static uint32_t bot_random(reactor_t *r, uint32_t n) {
+    return (uint32_t)(((bot_next(r) >> 32) * n) >> 32);
+}
+
+/* the bot's turn: a winning move with probability bot_strength percent
+   (when there is one), otherwise a random legal one */
+static int session_bot_move(reactor_t *r, session_t *s) {
+    game_move_t m;
+    if (bot_random(r, 100) >= (uint32_t)config.bot_strength
+        || !rules_best_move(&s->game, &m)) {
+        rules_random_move(&s->game, bot_next(r), &m);
+    }
+    return session_move(r, s, &m);
+}
+
+/* handle every buffered frame, then drain the socket
+   (edge-triggered: read until EAGAIN) */
+static void on_game_readable(reactor_t *r, conn_t *c) {
+    session_t *s = c->session;
+    int who = (s->p[0] == c) ? 1 : 2;
+
+    for (;;) {
+        char frame[NGP_MAX_MSG];
+        ngp_message msg;
+        int rc = conn_next_message(c, frame, &msg);
+        if (rc == 0) {
+            return;
+        }
+        if (rc < 0) {
+            /* disconnected; the opponent wins by forfeit */
+            conn_t *other = s->p[(who == 1) ? 1 : 0];
+            log_event(LOG_INFO, LOG_EV_FORFEIT, c->name, other->name,
+                      LOG_FORFEIT_DISCONNECT);
+            session_forfeit(r, s, (who == 1) ? 2 : 1, JOURNAL_END_DISCONNECT);
+            return;
+        }
+
+        if (session_on_message(r, s, who, &msg)) {
+            return;
+        }
+    }
+}
+
+/* the current player's move clock ran out: they forfeit */
+static void on_turn_timer(wheel_timer_t *t, void *ctx) {
+    session_t *s = (session_t *)((char *)t - offsetof(session_t, turn));
+    int loser = s->game.current_player;
+    int winner = (loser == 1) ? 2 : 1;
+    log_event(LOG_INFO, LOG_EV_FORFEIT, s->p[loser - 1]->name,
+              s->p[winner - 1]->name, LOG_FORFEIT_TIMEOUT);
+    session_forfeit(ctx, s, winner, JOURNAL_END_TIMEOUT);
+}
+
+/* take a paired socket off the loop and make it blocking again */
+static int conn_detach(reactor_t *r, conn_t *c) {
+    int fd = c->fd;
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0) {
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    conn_retire(r, c);
+    return fd;
+}
+
+/* a player whose game can be handed off the loop: not the bot, and
+   with a socket of its own */
+static int conn_portable(const conn_t *c) {
+    return c != &bot_conn && !c->mux;
+}
+
+/* hand a connection's fd, name and buffers over to a player_t */
+static void conn_to_player(reactor_t *r, conn_t *c, player_t *p) {
+    memcpy(p->name, c->name, sizeof(p->name));
+    p->version = c->version;
+    p->in = c->in;
+    p->out = c->out;
+    outq_init(&c->out);
+    c->has_name = 0;
+    p->fd = conn_detach(r, c);
+}
+
+/* obj is the pair's game_slab object, taken when it was matched (as
+   was its slot in r->games when the game runs on a loop). Either player
+   may be the bot or on a multiplexed connection; those games stay on
+   the loop. */
+static void start_game(reactor_t *r, conn_t *p1, conn_t *p2, void *obj) {
+    stats_count(STAT_GAMES_STARTED);
+    if (config.start_game && conn_portable(p1) && conn_portable(p2)) {
+        /* the game runs elsewhere; it owns the pair, both fds, both
+           names and any input or output still buffered */
+        player_pair_t *pair = obj;
+        conn_to_player(r, p1, &pair->p1);
+        conn_to_player(r, p2, &pair->p2);
+        config.start_game(pair);
+        return;
+    }
+
+    session_t *s = obj;
+    game_init(&s->game, config.layout);
+    wheel_timer_init(&s->turn, on_turn_timer);
+    s->started_us = stats_now_us();
+    s->journal = journal_begin(p1->name, p2->name, s->game.piles,
+                               s->game.layout->piles);
+    s->spectate = spectate_begin(p1 == &bot_conn ? NULL : p1->name,
+                                 p2 == &bot_conn ? NULL : p2->name);
+    s->p[0] = p1;
+    s->p[1] = p2;
+    for (int i = 0; i < 2; i++) {
+        if (s->p[i] == &bot_conn) {
+            stats_count(STAT_BOT_GAMES_STARTED);
+            stats_gauge_add(STAT_BOT_GAMES, 1);
+            journal_set_bot(s->journal, i + 1);
+            continue;
+        }
+        s->p[i]->state = CONN_GAME;
+        s->p[i]->session = s;
+    }
+
+    log_event(LOG_INFO, LOG_EV_GAME_START, p1->name, p2->name, 0);
+
+    if (conn_send_name(p1, 1, p2->name) != 0) {
+        session_forfeit(r, s, 2, JOURNAL_END_FORFEIT);
+        return;
+    }
+    if (conn_send_name(p2, 2, p1->name) != 0) {
+        session_forfeit(r, s, 1, JOURNAL_END_FORFEIT);
+        return;
+    }
+    if (session_send_play(r, s)) {
+        return;
+    }
+
+    /* anything either player sent while in the lobby was left unread;
+       edge-triggered epoll will not report it again, so process it now */
+    if (conn_portable(p1)) {
+        on_game_readable(r, p1);
+    }
+    if (conn_portable(p2) && p2->state == CONN_GAME) {
+        on_game_readable(r, p2);
+    }
+}
+
+/* --------------------------
+   Lobby
+   -------------------------- */
+
+static void lobby_remove(reactor_t *r, conn_t *c) {
+    lobby_t *q = &r->lobby;
+    if (c->lobby_prev) c->lobby_prev->lobby_next = c->lobby_next;
+    else q->head = c->lobby_next;
+    if (c->lobby_next) c->lobby_next->lobby_prev = c->lobby_prev;
+    else q->tail = c->lobby_prev;
+    c->lobby_prev = c->lobby_next = NULL;
+    q->count--;
+    stats_gauge_add(STAT_LOBBY_DEPTH, -1);
+    timer_cancel(c);
+}
+
+static conn_t *lobby_pop(reactor_t *r) {
+    conn_t *c = r->lobby.head;
+    if (c) lobby_remove(r, c);
+    return c;
+}
+
+/* a waiting player's socket changed. Hangups are reported by epoll
+   (EPOLLRDHUP/EPOLLHUP), so a dead player leaves the queue as soon as
+   it goes; any data is left queued for the game to read */
+static void on_lobby_event(reactor_t *r, conn_t *c, uint32_t events) {
+    if (!(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    lobby_remove(r, c);
+    conn_close(r, c);
+}
+
+/* a newcomer is turned away only if it would have to wait; one that
+   completes a pair is always admitted */
+static int lobby_full(const reactor_t *r) {
+    return r->lobby.count >= config.max_lobby && r->lobby.count % 2 == 0;
+}
+
+static void inbox_push(reactor_t *target, conn_t *c);
+
+size_t reactor_game_bytes(void) {
+    size_t n = slab_obj_size(&game_slab);
+    if (!config.start_game) {
+        n += 2 * slab_obj_size(&conn_slab);
+    }
+    return n;
+}
+
+void reactor_pair_free(player_pair_t *pair) {
+    slab_free(&game_slab, pair);
+}
+
+/* take a game slot on the least loaded game worker; returns NULL if
+   every worker is at config.games_per_worker */
+static reactor_t *pool_reserve(void) {
+    for (;;) {
+        reactor_t *best = NULL;
+        int best_games = config.games_per_worker;
+        for (int i = 0; i < pool_count; i++) {
+            int g = __atomic_load_n(&pool[i].games, __ATOMIC_RELAXED);
+            if (g < best_games) {
+                best = &pool[i];
+                best_games = g;
+            }
+        }
+        if (!best) return NULL;
+        if (__atomic_fetch_add(&best->games, 1, __ATOMIC_RELAXED)
+            < config.games_per_worker) {
+            return best;
+        }
+        /* lost a race for the last slot; look again */
+        __atomic_fetch_sub(&best->games, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* start games while two players are waiting. Each game first takes
+   its object from game_slab; with a pool, the pair is then handed to a
+   game worker. If --max-games is reached or the pool is full the
+   players stay queued and reactor_run retries shortly. */
+static void lobby_match(reactor_t *r) {
+    while (r->lobby.count >= 2) {
+        void *obj = slab_alloc(&game_slab);
+        if (!obj) return;
+
+        /* a multiplexed player's game stays on its connection's loop */
+        int local = !conn_portable(r->lobby.head)
+                    || !conn_portable(r->lobby.head->lobby_next);
+        reactor_t *w = r;
+        if (pool_count > 0 && !local) {
+            w = pool_reserve();
+            if (!w) {
+                slab_free(&game_slab, obj);
+                return;
+            }
+        } else if (!config.start_game || local) {
+            __atomic_fetch_add(&r->games, 1, __ATOMIC_RELAXED);
+        }
+
+        conn_t *p1 = lobby_pop(r);
+        conn_t *p2 = lobby_pop(r);
+        long long now = stats_now_us();
+        stats_record(STAT_LOBBY_WAIT, now - p1->since_us);
+        stats_record(STAT_LOBBY_WAIT, now - p2->since_us);
+        if (w == r) {
+            start_game(r, p1, p2, obj);
+            continue;
+        }
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, p1->fd, NULL);
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, p2->fd, NULL);
+        conn_unlink(r, p1);
+        conn_unlink(r, p2);
+        p1->handoff_peer = p2;
+        p1->session = obj;
+        inbox_push(w, p1);
+    }
+}
+
+/* a player has waited bot_after_ms: play the bot, in a random seat.
+   Returns -1 if --max-games leaves no room for the game yet. */
+static int lobby_play_bot(reactor_t *r, conn_t *c) {
+    void *obj = slab_alloc(&game_slab);
+    if (!obj) return -1;
+    __atomic_fetch_add(&r->games, 1, __ATOMIC_RELAXED);
+    lobby_remove(r, c);
+    stats_record(STAT_LOBBY_WAIT, stats_now_us() - c->since_us);
+    if (bot_random(r, 2) == 0) {
+        start_game(r, c, &bot_conn, obj);
+    } else {
+        start_game(r, &bot_conn, c, obj);
+    }
+    return 0;
+}
+
+static void lobby_push(reactor_t *r, conn_t *c) {
+    lobby_t *q = &r->lobby;
+    c->state = CONN_LOBBY;
+    c->lobby_next = NULL;
+    c->lobby_prev = q->tail;
+    if (q->tail) q->tail->lobby_next = c;
+    else q->head = c;
+    q->tail = c;
+    q->count++;
+    stats_gauge_add(STAT_LOBBY_DEPTH, 1);
+}
+
+/* queue a named player and start games while two are waiting */
+static void lobby_enqueue(reactor_t *r, conn_t *c) {
+    lobby_push(r, c);
+    /* the idle deadline, or the bot's if that comes first */
+    int wait = config.lobby_timeout_ms;
+    if (config.bot_after_ms > 0 && (wait <= 0 || config.bot_after_ms < wait)) {
+        wait = config.bot_after_ms;
+    }
+    if (wait > 0) {
+        timer_arm(r, c, wait);
+    }
+
+    lobby_match(r);
+}
+
+
+/* --------------------------
+   Cross-shard pairing
+   -------------------------- */
+
+static void inbox_push(reactor_t *target, conn_t *c) {
+    conn_t *head = __atomic_load_n(&target->inbox, __ATOMIC_RELAXED);
+    do {
+        c->next_closed = head;
+    } while (!__atomic_compare_exchange_n(&target->inbox, &head, c, 1,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+
+    uint64_t one = 1;
+    (void)write(target->inbox_fd, &one, sizeof(one));
+}
+
+static int conn_register(reactor_t *r, conn_t *c) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    conn_link(r, c);
+    return 0;
+}
+
+static void on_inbox(reactor_t *r) {
+    uint64_t count;
+    (void)read(r->inbox_fd, &count, sizeof(count));
+
+    /* take the whole stack, then reverse it into arrival order */
+    conn_t *stack = __atomic_exchange_n(&r->inbox, NULL, __ATOMIC_ACQUIRE);
+    conn_t *list = NULL;
+    while (stack) {
+        conn_t *c = stack;
+        stack = c->next_closed;
+        c->next_closed = list;
+        list = c;
+    }
+
+    while (list) {
+        conn_t *c = list;
+        list = c->next_closed;
+        c->next_closed = NULL;
+
+        conn_t *peer = c->handoff_peer;
+        if (!peer) {
+            if (conn_register(r, c) != 0) conn_close(r, c);
+            else lobby_enqueue(r, c);
+            continue;
+        }
+
+        /* a matched pair; its game object and slot are already taken */
+        session_t *s = c->session;
+        c->handoff_peer = NULL;
+        c->session = NULL;
+        if (conn_register(r, c) != 0 || conn_register(r, peer) != 0) {
+            conn_close(r, c);
+            conn_close(r, peer);
+            slab_free(&game_slab, s);
+            __atomic_fetch_sub(&r->games, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        start_game(r, c, peer, s);
+    }
+}
+
+/* SIGUSR1: print how many games each loop is running */
+static void on_report(void) {
+    struct signalfd_siginfo si;
+    while (read(report_fd, &si, sizeof(si)) == sizeof(si)) {
+    }
+
+    if (pool_count > 0) {
+        int total = 0;
+        for (int i = 0; i < pool_count; i++) {
+            int g = __atomic_load_n(&pool[i].games, __ATOMIC_RELAXED);
+            log_text(LOG_INFO, "game worker %d: %d/%d games",
+                     i, g, config.games_per_worker);
+            total += g;
+        }
+        log_text(LOG_INFO, "pool: %d/%d games on %d workers", total,
+                 pool_count * config.games_per_worker, pool_count);
+    } else if (!config.start_game) {
+        for (int i = 0; i < shard_count; i++) {
+            log_text(LOG_INFO, "loop %d: %d games", i,
+                     __atomic_load_n(&shards[i].games, __ATOMIC_RELAXED));
+        }
+    }
+    char limit[32] = "";
+    if (config.max_games > 0) {
+        snprintf(limit, sizeof(limit), " of %d", config.max_games);
+    }
+    log_text(LOG_INFO, "games: %zu live%s, %zu bytes each; %zu bytes in slabs",
+             slab_live(&game_slab), limit, reactor_game_bytes(),
+             slab_bytes(&game_slab) + slab_bytes(&conn_slab));
+    log_text(LOG_INFO, "log: %llu records dropped", log_dropped());
+    if (config.report) config.report();
+}
+
+/* answer each admin client with a stats snapshot and hang up */
+static void on_admin(void) {
+    for (;;) {
+        int fd = accept4(admin_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        /* a snapshot is a few KB, well under a Unix socket's buffer,
+           so one non-blocking send delivers it */
+        char buf[16384];
+        size_t len = stats_snapshot(buf, sizeof(buf));
+        (void)send(fd, buf, len, MSG_NOSIGNAL);
+        close(fd);
+    }
+}
+
+/* Each shard pairs only its own lobby, so a lone player on one shard
+   could wait forever while another shard also holds a lone player.
+   After every event batch a shard with exactly one waiting player
+   either advertises itself as the stray shard or, if another shard
+   already is, hands its player over to be paired there.
+   A multiplexed player cannot leave its connection's loop, so a shard
+   whose lone player is multiplexed takes the slot from a stray that can
+   move, and the other player comes to it instead. Two multiplexed
+   strays cannot be paired with each other: the second leaves the slot
+   alone, and both wait for another player, the bot or their lobby
+   timeout. */
+static void lobby_balance(reactor_t *r) {
+    if (shard_count < 2 || r->listener < 0) return;
+
+    pthread_mutex_lock(&stray_lock);
+    if (r->lobby.count != 1) {
+        if (stray_shard == r->id) stray_shard = -1;
+        pthread_mutex_unlock(&stray_lock);
+        return;
+    }
+    int mux = (r->lobby.head->mux != NULL);
+    if (stray_shard < 0 || stray_shard == r->id || (mux && !stray_mux)) {
+        stray_shard = r->id;
+        stray_mux = mux;
+        pthread_mutex_unlock(&stray_lock);
+        return;
+    }
+    if (mux) {
+        /* both strays are multiplexed; see above */
+        pthread_mutex_unlock(&stray_lock);
+        return;
+    }
+    int target = stray_shard;
+    stray_shard = -1;
+    pthread_mutex_unlock(&stray_lock);
+
+    conn_t *c = lobby_pop(r);
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    conn_unlink(r, c);
+    inbox_push(&shards[target], c);
+}
+
+/* --------------------------
+   Handshake
+   -------------------------- */
+
+static void handshake_reject(reactor_t *r, conn_t *c, int code) {
+    (void)conn_send_fail(c, code);
+    conn_finish(r, c);
+}
+
+/* SPEC in place of OPEN: the connection leaves the loop for the
+   spectators' fan-out thread, which answers it from there */
+static void handshake_spectate(reactor_t *r, conn_t *c, const char *name) {
+    if (c->mux) {
+        /* a spectator needs a connection of its own */
+        handshake_reject(r, c, 10);
+        return;
+    }
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len > MAX_NAME_LEN) {
+        handshake_reject(r, c, 21);
+        return;
+    }
+    /* off this loop before the fan-out thread can close it */
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (spectate_attach(c->fd, name) != 0) {
+        /* spectating is off: as for any other unexpected message */
+        (void)conn_send_fail(c, 10);
+        conn_close(r, c);
+        return;
+    }
+    conn_retire(r, c);
+}
+
+static void handshake_mux(reactor_t *r, conn_t *c, ngp_message *msg);
+
+/* a new player's first message: validate the OPEN, reserve the name,
+   send WAIT and queue the player */
+static void handshake_message(reactor_t *r, conn_t *c, ngp_message *msg) {
+    /* answered in the version it asked for, FAILs included */
+    c->version = (msg->version == 1);
+    if (strcmp(msg->type, "MOVE") == 0) {
+        handshake_reject(r, c, 24);
+        return;
+    }
+    if (strcmp(msg->type, "SPEC") == 0 && msg->field_count >= 1) {
+        handshake_spectate(r, c, msg->fields[0]);
+        return;
+    }
+    if (strcmp(msg->type, "OPEN") != 0 || msg->field_count < 1) {
+        handshake_reject(r, c, 10);
+        return;
+    }
+
+    const char *name = msg->fields[0];
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len > MAX_NAME_LEN) {
+        handshake_reject(r, c, 21);
+        return;
+    }
+    if (lobby_full(r)) {
+        handshake_reject(r, c, 25);
+        return;
+    }
+    if (!registry_reserve(name)) {
+        handshake_reject(r, c, 22);
+        return;
+    }
+
+    players_add(name);
+
+    timer_cancel(c);
+    memcpy(c->name, name, name_len + 1);
+    c->has_name = 1;
+    c->state = CONN_OPEN_RECEIVED;
+
+    const ngp_frame *wait = c->version ? &ngp1_wait_frame : &ngp_wait_frame;
+    if (conn_send(c, wait->data, wait->len) != 0) {
+        conn_close(r, c);
+        return;
+    }
+    c->state = CONN_WAIT_SENT;
+    long long now = stats_now_us();
+    stats_record(STAT_ACCEPT_TO_WAIT, now - c->since_us);
+    c->since_us = now;
+
+    lobby_enqueue(r, c);
+}
+
+/* CONN_CONNECTED: read the first message if it has arrived */
+static void on_handshake(reactor_t *r, conn_t *c) {
+    char frame[NGP_MAX_MSG];
+    ngp_message msg;
+    int rc = conn_next_message(c, frame, &msg);
+    if (rc == 0) {
+        return;
+    }
+    if (rc == -1) {
+        conn_close(r, c);
+        return;
+    }
+    if (rc < 0) {
+        handshake_reject(r, c, 10);
+        return;
+    }
+    if (msg.session >= 0) {
+        handshake_mux(r, c, &msg);
+        return;
+    }
+    handshake_message(r, c, &msg);
+}
+
+/* --------------------------
+   Multiplexed connections
+   -------------------------- */
+
+static void on_conn_timer(wheel_timer_t *t, void *ctx);
+
+/* a player's connection is gone: it leaves the lobby, or forfeits the
+   game it is in */
+static void mux_player_gone(reactor_t *r, conn_t *c) {
+    if (c->state == CONN_GAME) {
+        session_t *s = c->session;
+        int who = (s->p[0] == c) ? 1 : 2;
+        log_event(LOG_INFO, LOG_EV_FORFEIT, c->name, s->p[2 - who]->name,
+                  LOG_FORFEIT_DISCONNECT);
+        session_forfeit(r, s, 3 - who, JOURNAL_END_DISCONNECT);
+        return;
+    }
+    if (c->state == CONN_LOBBY) {
+        lobby_remove(r, c);
+    }
+    conn_close(r, c);
+}
+
+/* the connection hung up, failed or broke the protocol: every player
+   on it goes as if its own connection had. Forfeits may send the
+   winner an OVER on this same connection; that is dropped with it. */
+static void mux_close(reactor_t *r, conn_t *m) {
+    for (int id = 0; m->mux_live > 0 && id < config.mux_players; id++) {
+        if (m->mux_players[id]) {
+            mux_player_gone(r, m->mux_players[id]);
+        }
+    }
+    conn_finish(r, m);
+}
+
+/* a waiting player's frames cannot stay queued behind every other
+   player's on the connection, so they are answered at once: a MOVE
+   is Impatient (FAIL 31), as it would be from the player not to move,
+   and anything else ends the player as it would in a game */
+static void mux_lobby_message(reactor_t *r, conn_t *c, ngp_message *msg) {
+    if (strcmp(msg->type, "MOVE") == 0) {
+        if (conn_send_fail(c, 31) == 0) return;
+    } else {
+        (void)conn_send_fail(c, strcmp(msg->type, "OPEN") == 0 ? 23 : 10);
+    }
+    lobby_remove(r, c);
+    conn_close(r, c);
+}
+
+/* route one tagged frame to its player. A session id not in use
+   starts a new player, which goes through the handshake as a
+   connection would; a FAIL there frees the id again. */
+static void on_mux_message(reactor_t *r, conn_t *m, ngp_message *msg) {
+    if (msg->session >= config.mux_players) {
+        const ngp_frame *f = ngp1_fail_frame(25);
+        stats_fail(25);
+        (void)mux_write(m, (uint32_t)msg->session, f->data, f->len);
+        return;
+    }
+    uint32_t id = (uint32_t)msg->session;
+    conn_t *c = m->mux_players[id];
+    if (!c) {
+        c = slab_alloc(&conn_slab);
+        if (!c) {
+            const ngp_frame *f = ngp1_fail_frame(25);
+            stats_fail(25);
+            (void)mux_write(m, id, f->data, f->len);
+            return;
+        }
+        c->since_us = stats_now_us();
+        c->fd = -1;
+        c->state = CONN_CONNECTED;
+        c->mux = m;
+        c->mux_id = id;
+        ngp_framer_init(&c->in);
+        outq_init(&c->out);
+        wheel_timer_init(&c->timer, on_conn_timer);
+        m->mux_players[id] = c;
+        m->mux_live++;
+        stats_gauge_add(STAT_MUX_PLAYERS, 1);
+        handshake_message(r, c, msg);
+        return;
+    }
+    if (c->state == CONN_GAME) {
+        session_t *s = c->session;
+        (void)session_on_message(r, s, (s->p[0] == c) ? 1 : 2, msg);
+    } else if (c->state == CONN_LOBBY) {
+        mux_lobby_message(r, c, msg);
+    }
+}
+
+/* handle every frame the connection has sent, until EAGAIN */
+static void on_mux_readable(reactor_t *r, conn_t *m) {
+    for (;;) {
+        char frame[NGP_MAX_MSG];
+        ngp_message msg;
+        int rc = conn_next_message(m, frame, &msg);
+        if (rc == 0) {
+            return;
+        }
+        if (rc < 0) {
+            if (rc == -2) {
+                /* untagged or malformed; it cannot be told whose */
+                (void)conn_send_fail(m, 10);
+            }
+            mux_close(r, m);
+            return;
+        }
+        on_mux_message(r, m, &msg);
+    }
+}
+
+/* a first frame tagged with a session id makes the connection a
+   multiplexed one (--mux), carrying up to config.mux_players players */
+static void handshake_mux(reactor_t *r, conn_t *c, ngp_message *msg) {
+    if (config.mux_players == 0) {
+        handshake_reject(r, c, 10);
+        return;
+    }
+    c->mux_players = calloc((size_t)config.mux_players,
+                            sizeof(*c->mux_players));
+    if (!c->mux_players) {
+        conn_close(r, c);
+        return;
+    }
+    timer_cancel(c);
+    c->state = CONN_MUX;
+    c->version = 1;
+    c->loop = r;
+    on_mux_message(r, c, msg);
+    on_mux_readable(r, c);
+}
+
+/* send what each multiplexed connection has queued, in one write per
+   connection, after the events that queued it. One whose queue passed
+   its high-water mark, or whose write fails, is closed. */
+static void mux_flush(reactor_t *r) {
+    while (r->flush) {
+        conn_t *m = r->flush;
+        r->flush = m->next_flush;
+        m->flush_queued = 0;
+        if (m->state == CONN_CLOSED) continue;
+        if (m->mux_broken || outq_flush(&m->out, m->fd) != OUTQ_OK) {
+            outq_free(&m->out);
+            if (m->state == CONN_MUX) mux_close(r, m);
+            else conn_close(r, m);
+        }
+    }
+}
+
+/* a connection's deadline passed: no OPEN in time, waited long enough
+   to play the bot (or too long for an opponent), or could not drain
+   its output */
+static void on_conn_timer(wheel_timer_t *t, void *ctx) {
+    reactor_t *r = ctx;
+    conn_t *c = (conn_t *)((char *)t - offsetof(conn_t, timer));
+
+    if (c->state == CONN_LOBBY && config.bot_after_ms > 0
+        && (config.lobby_timeout_ms <= 0
+            || stats_now_us() - c->since_us
+               < (long long)config.lobby_timeout_ms * 1000)) {
+        if (lobby_play_bot(r, c) != 0) {
+            timer_arm(r, c, MATCH_RETRY_MS);
+        }
+        return;
+    }
+    if (c->state == CONN_LOBBY) {
+        log_event(LOG_INFO, LOG_EV_LOBBY_TIMEOUT, c->name, NULL, 0);
+        lobby_remove(r, c);
+    }
+    conn_close(r, c);
+}
+
+/* fire due timers; returns the epoll_wait timeout until the next
+   one (-1 if none) */
+static int expire_deadlines(reactor_t *r) {
+    long long now = now_ms();
+    wheel_advance(&r->timers, now, r);
+    return wheel_timeout(&r->timers, now);
+}
+
+static void on_accept(reactor_t *r) {
+    for (;;) {
+        int fd = accept4(r->listener, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        conn_t *c = slab_alloc(&conn_slab);
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        stats_count(STAT_ACCEPTED);
+        c->since_us = stats_now_us();
+        c->fd = fd;
+        c->state = CONN_CONNECTED;
+        ngp_framer_init(&c->in);
+        outq_init(&c->out);
+        wheel_timer_init(&c->timer, on_conn_timer);
+        timer_arm(r, c, config.handshake_timeout_ms);
+
+        /* edge-triggered EPOLLOUT only fires when a full socket buffer
+           drains, so it can stay registered for the connection's life */
+        if (conn_register(r, c) != 0) {
+            conn_close(r, c);
+            continue;
+        }
+
+        /* the OPEN may already be queued */
+        on_handshake(r, c);
+    }
+}
+
+/* the socket has room again: flush queued output. A peer whose
+   connection fails here is dropped; in a game that is a forfeit. */
+static void on_writable(reactor_t *r, conn_t *c) {
+    if (outq_pending(&c->out) == 0) return;
+
+    if (outq_flush(&c->out, c->fd) != OUTQ_OK) {
+        outq_free(&c->out);
+        if (c->state == CONN_MUX) {
+            mux_close(r, c);
+        } else if (c->state == CONN_GAME) {
+            session_t *s = c->session;
+            session_forfeit(r, s, (s->p[0] == c) ? 2 : 1, JOURNAL_END_FORFEIT);
+        } else {
+            if (c->state == CONN_LOBBY) lobby_remove(r, c);
+            conn_close(r, c);
+        }
+        return;
+    }
+
+    if (c->state == CONN_DRAINING && outq_pending(&c->out) == 0) {
+        conn_close(r, c);
+    }
+}
+
+static void dispatch(reactor_t *r, conn_t *c, uint32_t events) {
+    if (events & (EPOLLOUT | EPOLLERR)) {
+        on_writable(r, c);
+    }
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+
+    switch (c->state) {
+    case CONN_CONNECTED:
+        on_handshake(r, c);
+        break;
+    case CONN_LOBBY:
+        on_lobby_event(r, c, events);
+        break;
+    case CONN_GAME:
+        on_game_readable(r, c);
+        break;
+    case CONN_MUX:
+        on_mux_readable(r, c);
+        break;
+    case CONN_OPEN_RECEIVED:
+    case CONN_WAIT_SENT:
+    case CONN_DRAINING:
+    case CONN_CLOSED:
+        break;
+    }
+}
+
+/* --------------------------
+   Hot upgrade
+   -------------------------- */
+
+/* A new binary started with the same --upgrade path connects to this
+   process's upgrade socket and asks for its state. Every loop is parked
+   between event batches and the state goes out as one handoff_t (see
+   handoff.h): the listeners and every connection's socket, with its
+   buffered input, queued output and deadline; the lobbies in order;
+   and each game's board, move clock and journal record so far. The new
+   process restores it and answers UPGRADE_ACK; this one answers
+   UPGRADE_BYE and exits without touching a socket again. If the new
+   process fails or goes quiet first, the loops carry on as before.
+   Deadlines are on CLOCK_MONOTONIC, which both processes share; the
+   new one moves them back by however long the loops were parked. */
+
+#define UPGRADE_MAGIC 0x31305055444d494eULL   /* "NIMDUP01" */
+#define UPGRADE_TIMEOUT_MS 10000
+#define UPGRADE_ACK 'A'
+#define UPGRADE_BYE 'B'
+
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+static int upgrading;          /* loops park before their next pass */
+static int parked;
+
+/* the state taken over from the process this one replaces, the socket
+   to answer it on, how many shards it had and how long it was parked */
+static handoff_t takeover;
+static int takeover_fd = -1;
+static int takeover_shards;
+static long long takeover_shift;
+
+static int loop_count(void) {
+    return shard_count + pool_count;
+}
+
+static reactor_t *loop_at(int i) {
+    return (i < shard_count) ? &shards[i] : &pool[i - shard_count];
+}
+
+static void upgrade_timeouts(int fd) {
+    struct timeval tv = { UPGRADE_TIMEOUT_MS / 1000, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* every loop but shard 0, between event batches, while upgrading */
+static void upgrade_park(void) {
+    pthread_mutex_lock(&park_lock);
+    parked++;
+    pthread_cond_broadcast(&park_cond);
+    while (upgrading) {
+        pthread_cond_wait(&park_cond, &park_lock);
+    }
+    parked--;
+    pthread_mutex_unlock(&park_lock);
+}
+
+/* stop every other loop, then finish what was in flight between them:
+   players and pairs in inboxes, and multiplexed output not yet sent */
+static void upgrade_freeze(void) {
+    pthread_mutex_lock(&park_lock);
+    __atomic_store_n(&upgrading, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&park_lock);
+    for (int i = 1; i < loop_count(); i++) {
+        uint64_t one = 1;
+        (void)write(loop_at(i)->inbox_fd, &one, sizeof(one));
+    }
+    pthread_mutex_lock(&park_lock);
+    while (parked < loop_count() - 1) {
+        pthread_cond_wait(&park_cond, &park_lock);
+    }
+    pthread_mutex_unlock(&park_lock);
+
+    /* shards come first: their inboxes may start games on the pool */
+    for (int i = 0; i < loop_count(); i++) {
+        on_inbox(loop_at(i));
+        mux_flush(loop_at(i));
+    }
+}
+
+static void upgrade_thaw(void) {
+    pthread_mutex_lock(&park_lock);
+    __atomic_store_n(&upgrading, 0, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&park_cond);
+    pthread_mutex_unlock(&park_lock);
+}
+
+static uint64_t deadline(const wheel_timer_t *t) {
+    return wheel_armed(t) ? (uint64_t)t->expires : 0;
+}
+
+/* a connection's record; it is numbered in the order written */
+static void save_conn(handoff_t *h, int loop, conn_t *c, uint32_t *next) {
+    char in[NGP_RING_SIZE];
+    const char *out = c->out.buf ? c->out.buf + c->out.head : "";
+    c->handoff_id = (*next)++;
+    handoff_put(h, (uint64_t)loop + 1);
+    handoff_put(h, (uint64_t)c->state);
+    handoff_put(h, c->mux ? (uint64_t)c->mux->handoff_id + 1 : 0);
+    if (c->mux) {
+        handoff_put(h, c->mux_id);
+    } else {
+        handoff_put_fd(h, c->fd);
+    }
+    handoff_put_bytes(h, c->name, c->has_name ? strlen(c->name) : 0);
+    handoff_put(h, (uint64_t)c->version);
+    handoff_put_bytes(h, in, ngp_framer_save(&c->in, in));
+    handoff_put_bytes(h, out, outq_pending(&c->out));
+    handoff_put(h, deadline(&c->timer));
+    handoff_put(h, (uint64_t)c->since_us);
+}
+
+/* a game's record, written with its first seat that is not the bot */
+static int session_owner(const conn_t *c) {
+    if (c->state != CONN_GAME) return 0;
+    const session_t *s = c->session;
+    return s->p[0] == c || (s->p[0] == &bot_conn && s->p[1] == c);
+}
+
+static void save_session(handoff_t *h, int loop, session_t *s) {
+    handoff_put(h, (uint64_t)loop + 1);
+    for (int i = 0; i < 2; i++) {
+        handoff_put(h, (s->p[i] == &bot_conn)
+                       ? 0 : (uint64_t)s->p[i]->handoff_id + 1);
+    }
+    handoff_put(h, (uint64_t)s->game.current_player);
+    for (int i = 0; i < s->game.layout->piles; i++) {
+        handoff_put(h, s->game.piles[i]);
+    }
+    handoff_put(h, deadline(&s->turn));
+    handoff_put(h, (uint64_t)s->started_us);
+    const void *rec = "";
+    long long started_ms = 0;
+    int flags = 0;
+    size_t len = journal_save(s->journal, &rec, &started_ms, &flags);
+    handoff_put_bytes(h, rec, len);
+    handoff_put(h, (uint64_t)started_ms);
+    handoff_put(h, (uint64_t)flags);
+}
+
+/* everything the new process needs, with the loops parked. Lists of
+   records end with a 0; conns and games are counted into *conns and
+   *games for the log. */
+static void upgrade_save(handoff_t *h, long long frozen_ms,
+                         const spectate_watcher_t *watchers, int nwatchers,
+                         uint32_t *conns, int *games) {
+    const game_layout_t *l = config.layout;
+    char rules[256];
+    handoff_put(h, UPGRADE_MAGIC);
+    handoff_put(h, (uint64_t)frozen_ms);
+    handoff_put(h, (uint64_t)l->piles);
+    for (int i = 0; i < l->piles; i++) {
+        handoff_put(h, l->start[i]);
+    }
+    rules_describe(l->rules ? l->rules : rules_default(), rules,
+                   sizeof(rules));
+    handoff_put_bytes(h, rules, strlen(rules));
+
+    handoff_put(h, (uint64_t)shard_count);
+    for (int i = 0; i < shard_count; i++) {
+        handoff_put_fd(h, shards[i].listener);
+    }
+    handoff_put_fd(h, upgrade_fd);
+    const char *admin = (admin_fd >= 0) ? config.admin_path : "";
+    handoff_put_bytes(h, admin, strlen(admin));
+    if (admin_fd >= 0) {
+        handoff_put_fd(h, admin_fd);
+    }
+
+    /* a multiplexed connection's players come right after it */
+    uint32_t next = 0;
+    for (int i = 0; i < loop_count(); i++) {
+        for (conn_t *c = loop_at(i)->conns; c; c = c->conn_next) {
+            save_conn(h, i, c, &next);
+            for (int id = 0; c->state == CONN_MUX && id < config.mux_players;
+                 id++) {
+                if (c->mux_players[id]) {
+                    save_conn(h, i, c->mux_players[id], &next);
+                }
+            }
+        }
+    }
+    handoff_put(h, 0);
+    *conns = next;
+
+    for (int i = 0; i < shard_count; i++) {
+        for (conn_t *c = shards[i].lobby.head; c; c = c->lobby_next) {
+            handoff_put(h, (uint64_t)c->handoff_id + 1);
+        }
+        handoff_put(h, 0);
+    }
+
+    *games = 0;
+    for (int i = 0; i < loop_count(); i++) {
+        for (conn_t *c = loop_at(i)->conns; c; c = c->conn_next) {
+            if (session_owner(c)) {
+                save_session(h, i, c->session);
+                (*games)++;
+            }
+            for (int id = 0; c->state == CONN_MUX && id < config.mux_players;
+                 id++) {
+                conn_t *p = c->mux_players[id];
+                if (p && session_owner(p)) {
+                    save_session(h, i, p->session);
+                    (*games)++;
+                }
+            }
+        }
+    }
+    handoff_put(h, 0);
+
+    for (int i = 0; i < nwatchers; i++) {
+        handoff_put(h, 1);
+        handoff_put_fd(h, watchers[i].fd);
+        handoff_put_bytes(h, watchers[i].name, strlen(watchers[i].name));
+        handoff_put_bytes(h, watchers[i].unsent, watchers[i].unsent_len);
+        handoff_put(h, (uint64_t)watchers[i].behind);
+    }
+    handoff_put(h, 0);
+    handoff_put(h, UPGRADE_MAGIC);
+}
+
+/* a new binary asked for the state on fd. Returns only if the upgrade
+   was refused or abandoned; otherwise this process exits. */
+static void upgrade_handoff(int fd) {
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0
+        || cred.uid != geteuid()) {
+        log_text(LOG_WARN, "upgrade: refused a process of another user");
+        return;
+    }
+    upgrade_timeouts(fd);
+    handoff_t hello;
+    handoff_init(&hello);
+    if (handoff_recv(&hello, fd) != 0 || handoff_get(&hello) != UPGRADE_MAGIC) {
+        handoff_free(&hello);
+        log_text(LOG_WARN, "upgrade: not asked by a nimd");
+        return;
+    }
+    int pid = (int)handoff_get(&hello);
+    handoff_free(&hello);
+
+    long long frozen = now_ms();
+    upgrade_freeze();
+    spectate_watcher_t *watchers;
+    int nwatchers = spectate_pause(&watchers);
+    if (nwatchers < 0) {
+        upgrade_thaw();
+        log_text(LOG_WARN, "upgrade: out of memory; carrying on");
+        return;
+    }
+    journal_flush();
+
+    handoff_t h;
+    handoff_init(&h);
+    uint32_t conns;
+    int games;
+    upgrade_save(&h, frozen, watchers, nwatchers, &conns, &games);
+    char ack = 0;
+    if (handoff_send(&h, fd) == 0 && recv(fd, &ack, 1, 0) == 1
+        && ack == UPGRADE_ACK) {
+        char bye = UPGRADE_BYE;
+        if (send(fd, &bye, 1, MSG_NOSIGNAL) == 1) {
+            log_text(LOG_INFO, "upgrade: handed %d games, %u connections "
+                     "and %d spectators to pid %d after %lld ms",
+                     games, conns, nwatchers, pid, now_ms() - frozen);
+            log_flush();
+            _exit(0);
+        }
+    }
+    log_text(LOG_WARN, "upgrade: pid %d did not take over; carrying on", pid);
+    handoff_free(&h);
+    free(watchers);
+    spectate_resume();
+    upgrade_thaw();
+}
+
+static void on_upgrade(void) {
+    for (;;) {
+        int fd = accept4(upgrade_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+        upgrade_handoff(fd);
+        close(fd);
+    }
+}
+
+int reactor_takeover(const char *path) {
+    int fd = handoff_connect(path);
+    if (fd < 0) {
+        if (errno == ENOENT || errno == ECONNREFUSED) return 0;
+        perror(path);
+        return -1;
+    }
+    upgrade_timeouts(fd);
+    handoff_t hello;
+    handoff_init(&hello);
+    handoff_put(&hello, UPGRADE_MAGIC);
+    handoff_put(&hello, (uint64_t)getpid());
+    int rc = handoff_send(&hello, fd);
+    handoff_free(&hello);
+    handoff_init(&takeover);
+    if (rc != 0 || handoff_recv(&takeover, fd) != 0) {
+        perror("upgrade");
+        handoff_free(&takeover);
+        close(fd);
+        return -1;
+    }
+    takeover_fd = fd;
+    return 1;
+}
+
+static int takeover_fail(const char *why) {
+    fprintf(stderr, "upgrade: %s\n", why);
+    return -1;
+}
+
+/* where a connection or game from the old process's loop i (numbered
+   as loop_at numbers them) goes: the same shard, modulo the shards
+   here. A game between people goes to the pool if there is one. */
+static reactor_t *takeover_loop(uint64_t i, int pool_game) {
+    if (pool_game && pool_count > 0) {
+        reactor_t *best = &pool[0];
+        for (int k = 1; k < pool_count; k++) {
+            if (pool[k].games < best->games) best = &pool[k];
+        }
+        return best;
+    }
+    return &shards[i % (uint64_t)shard_count];
+}
+
+/* check the old process played the same game, and take its listeners
+   (*listeners, *count), upgrade socket and admin socket */
+static int takeover_begin(int **listeners, int *count) {
+    handoff_t *h = &takeover;
+    const game_layout_t *l = config.layout;
+    if (handoff_get(h) != UPGRADE_MAGIC) {
+        return takeover_fail("the old process is not a nimd");
+    }
+    takeover_shift = now_ms() - (long long)handoff_get(h);
+    if (takeover_shift < 0) takeover_shift = 0;
+
+    int same = (handoff_get(h) == (uint64_t)l->piles);
+    for (int i = 0; same && i < l->piles; i++) {
+        same = (handoff_get(h) == l->start[i]);
+    }
+    char rules[256], theirs[256];
+    rules_describe(l->rules ? l->rules : rules_default(), rules,
+                   sizeof(rules));
+    handoff_get_str(h, theirs, sizeof(theirs));
+    if (!same || strcmp(rules, theirs) != 0) {
+        return takeover_fail("the old process plays another --board or "
+                             "--rules");
+    }
+
+    uint64_t n = handoff_get(h);
+    if (n < 1 || n > 65536 || h->failed) {
+        return takeover_fail("the old process's state is corrupt");
+    }
+    *listeners = calloc((size_t)n, sizeof(**listeners));
+    if (!*listeners) {
+        perror("calloc");
+        return -1;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        (*listeners)[i] = handoff_get_fd(h);
+    }
+    *count = (int)n;
+    takeover_shards = (int)n;
+    upgrade_fd = handoff_get_fd(h);
+
+    char admin[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    if (handoff_get_str(h, admin, sizeof(admin)) > 0) {
+        int fd = handoff_get_fd(h);
+        if (config.admin_path && strcmp(admin, config.admin_path) == 0) {
+            admin_fd = fd;
+        } else {
+            close(fd);
+        }
+    }
+    if (h->failed) {
+        return takeover_fail("the old process's state is corrupt");
+    }
+    return 0;
+}
+
+/* one connection record; GAME connections are registered with their
+   game, the rest on their loop here */
+static conn_t *takeover_conn(handoff_t *h, uint64_t loop, conn_t **list,
+                             uint32_t n) {
+    conn_t *c = slab_alloc(&conn_slab);
+    if (!c) return NULL;
+    c->state = (conn_state_t)handoff_get(h);
+    ngp_framer_init(&c->in);
+    outq_init(&c->out);
+    wheel_timer_init(&c->timer, on_conn_timer);
+    uint64_t mux = handoff_get(h);
+    if (mux) {
+        uint64_t id = handoff_get(h);
+        conn_t *m = (mux <= n) ? list[mux - 1] : NULL;
+        if (!m || m->state != CONN_MUX || id >= (uint64_t)config.mux_players
+            || m->mux_players[id]
+            || (c->state != CONN_LOBBY && c->state != CONN_GAME)) {
+            return NULL;
+        }
+        c->fd = -1;
+        c->mux = m;
+        c->mux_id = (uint32_t)id;
+        m->mux_players[id] = c;
+        m->mux_live++;
+        stats_gauge_add(STAT_MUX_PLAYERS, 1);
+    } else {
+        c->fd = handoff_get_fd(h);
+    }
+    if (handoff_get_str(h, c->name, sizeof(c->name)) > 0) {
+        if (!registry_reserve(c->name)) return NULL;
+        c->has_name = 1;
+    }
+    c->version = (int)handoff_get(h);
+    size_t len;
+    const void *data = handoff_get_bytes(h, &len);
+    if (len > NGP_RING_SIZE) return NULL;
+    ngp_framer_load(&c->in, data, len);
+    data = handoff_get_bytes(h, &len);
+    if (len > 0 && outq_append(&c->out, data, len, len) != OUTQ_OK) {
+        return NULL;
+    }
+    uint64_t due = handoff_get(h);
+    c->since_us = (long long)handoff_get(h);
+    if (h->failed) return NULL;
+
+    switch (c->state) {
+    case CONN_GAME:
+        return c;
+    case CONN_MUX:
+        if (config.mux_players == 0) return NULL;
+        c->mux_players = calloc((size_t)config.mux_players,
+                                sizeof(*c->mux_players));
+        if (!c->mux_players) return NULL;
+        break;
+    case CONN_CONNECTED:
+    case CONN_LOBBY:
+    case CONN_DRAINING:
+        break;
+    default:
+        return NULL;
+    }
+    reactor_t *r = c->mux ? c->mux->loop : takeover_loop(loop, 0);
+    c->loop = r;
+    if (!c->mux && conn_register(r, c) != 0) return NULL;
+    if (due) {
+        wheel_arm(&r->timers, &c->timer, (long long)due + takeover_shift);
+    }
+    return c;
+}
+
+/* one game record; its players are in list */
+static int takeover_session(handoff_t *h, uint64_t loop, conn_t **list,
+                            uint32_t n, uint32_t *piles) {
+    conn_t *p[2];
+    for (int i = 0; i < 2; i++) {
+        uint64_t ref = handoff_get(h);
+        p[i] = (ref == 0) ? &bot_conn : (ref <= n) ? list[ref - 1] : NULL;
+        if (!p[i] || (p[i] != &bot_conn
+                      && (p[i]->state != CONN_GAME || p[i]->session))) {
+            return -1;
+        }
+    }
+    int current = (int)handoff_get(h);
+    for (int i = 0; i < config.layout->piles; i++) {
+        piles[i] = (uint32_t)handoff_get(h);
+    }
+    uint64_t turn = handoff_get(h);
+    long long started_us = (long long)handoff_get(h);
+    size_t rec_len;
+    const void *rec = handoff_get_bytes(h, &rec_len);
+    long long started_ms = (long long)handoff_get(h);
+    int flags = (int)handoff_get(h);
+    if (h->failed || p[0] == p[1]) return -1;
+
+    session_t *s = slab_alloc(&game_slab);
+    if (!s) return -1;
+    if (game_restore(&s->game, config.layout, piles, current) != 0
+        || game_is_over(&s->game)) {
+        slab_free(&game_slab, s);
+        return -1;
+    }
+    int bot = (p[0] == &bot_conn || p[1] == &bot_conn);
+    conn_t *m = p[0]->mux ? p[0]->mux : p[1]->mux;
+    reactor_t *r = m ? m->loop : takeover_loop(loop, !bot);
+    __atomic_fetch_add(&r->games, 1, __ATOMIC_RELAXED);
+
+    wheel_timer_init(&s->turn, on_turn_timer);
+    if (turn) {
+        wheel_arm(&r->timers, &s->turn, (long long)turn + takeover_shift);
+    }
+    s->started_us = started_us;
+    if (rec_len > 0) {
+        s->journal = journal_resume(rec, rec_len, config.layout->piles,
+                                    started_ms, flags);
+    }
+    s->spectate = spectate_begin(p[0] == &bot_conn ? NULL : p[0]->name,
+                                 p[1] == &bot_conn ? NULL : p[1]->name);
+    for (int i = 0; i < 2; i++) {
+        s->p[i] = p[i];
+        if (p[i] == &bot_conn) {
+            if (!bot_conn.name[0]) {
+                memcpy(bot_conn.name, BOT_NAME, sizeof(BOT_NAME));
+                bot_conn.fd = -1;
+            }
+            stats_gauge_add(STAT_BOT_GAMES, 1);
+            continue;
+        }
+        p[i]->session = s;
+        if (!p[i]->mux && conn_register(r, p[i]) != 0) return -1;
+    }
+
+    /* a spectator who joins now is shown the board at once */
+    ngp_board_frame_t f;
+    session_board_frame(s, &f, NGP1_PLAY, current, 0);
+    session_spectate(s, &f);
+    return 0;
+}
+
+/* give up on the old process's state, freeing takeover_restore's
+   working arrays */
+static int takeover_abandon(conn_t **list, uint32_t *piles,
+                            const char *why) {
+    free(list);
+    free(piles);
+    return takeover_fail(why);
+}
+
+/* rebuild the old process's connections, lobbies and games on these
+   loops; its spectators are left in *watchers for takeover_commit.
+   Nothing is sent or read until then. */
+static int takeover_restore(spectate_watcher_t **watchers, int *nwatchers,
+                            uint32_t *conns, int *games) {
+    handoff_t *h = &takeover;
+    conn_t **list = NULL;
+    uint32_t n = 0, cap = 0;
+    uint32_t *piles = malloc((size_t)config.layout->piles * sizeof(*piles));
+    if (!piles) return takeover_fail("out of memory");
+    for (;;) {
+        uint64_t loop = handoff_get(h);
+        if (loop == 0 || h->failed) break;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            conn_t **grown = realloc(list, cap * sizeof(*list));
+            if (!grown) return takeover_abandon(list, piles, "out of memory");
+            list = grown;
+        }
+        list[n] = takeover_conn(h, loop - 1, list, n);
+        if (!list[n]) {
+            return takeover_abandon(list, piles, "cannot restore a "
+                                    "connection (is --mux or --max-games "
+                                    "lower?)");
+        }
+        n++;
+    }
+    *conns = n;
+
+    for (int i = 0; i < takeover_shards; i++) {
+        for (;;) {
+            uint64_t ref = handoff_get(h);
+            if (ref == 0 || h->failed) break;
+            conn_t *c = (ref <= n) ? list[ref - 1] : NULL;
+            if (!c || c->state != CONN_LOBBY || c->lobby_prev
+                || c->lobby_next) {
+                return takeover_abandon(list, piles, "the old process's "
+                                        "state is corrupt");
+            }
+            lobby_push(c->loop, c);
+        }
+    }
+
+    *games = 0;
+    for (;;) {
+        uint64_t loop = handoff_get(h);
+        if (loop == 0 || h->failed) break;
+        if (takeover_session(h, loop - 1, list, n, piles) != 0) {
+            return takeover_abandon(list, piles, "cannot restore a game "
+                                    "(is --max-games lower?)");
+        }
+        (*games)++;
+    }
+
+    /* every player is queued or seated */
+    for (uint32_t i = 0; i < n; i++) {
+        conn_t *c = list[i];
+        if ((c->state == CONN_GAME && !c->session)
+            || (c->state == CONN_LOBBY && !c->lobby_prev
+                && c->loop->lobby.head != c)) {
+            return takeover_abandon(list, piles, "the old process's state "
+                                    "is corrupt");
+        }
+    }
+    free(list);
+    free(piles);
+
+    *nwatchers = 0;
+    *watchers = NULL;
+    int wcap = 0;
+    for (;;) {
+        if (handoff_get(h) == 0 || h->failed) break;
+        if (*nwatchers == wcap) {
+            wcap = wcap ? wcap * 2 : 64;
+            spectate_watcher_t *grown = realloc(*watchers,
+                                                (size_t)wcap * sizeof(**watchers));
+            if (!grown) {
+                free(*watchers);
+                return takeover_fail("out of memory");
+            }
+            *watchers = grown;
+        }
+        spectate_watcher_t *w = &(*watchers)[(*nwatchers)++];
+        w->fd = handoff_get_fd(h);
+        handoff_get_str(h, w->name, sizeof(w->name));
+        size_t len;
+        const void *data = handoff_get_bytes(h, &len);
+        if (len > sizeof(w->unsent)) len = 0;
+        memcpy(w->unsent, data, len);
+        w->unsent_len = len;
+        w->behind = (int)handoff_get(h);
+    }
+    if (handoff_get(h) != UPGRADE_MAGIC || h->failed) {
+        free(*watchers);
+        return takeover_fail("the old process's state is corrupt");
+    }
+    return 0;
+}
+
+/* tell the old process its state is restored, and wait for it to let
+   go of the sockets */
+static int takeover_commit(void) {
+    char c = UPGRADE_ACK;
+    if (send(takeover_fd, &c, 1, MSG_NOSIGNAL) != 1
+        || recv(takeover_fd, &c, 1, 0) != 1 || c != UPGRADE_BYE) {
+        return takeover_fail("the old process did not hand over");
+    }
+    close(takeover_fd);
+    takeover_fd = -1;
+    handoff_free(&takeover);
+    return 0;
+}
+
+static int reactor_init(reactor_t *r, int id, int listener) {
+    memset(r, 0, sizeof(*r));
+    r->id = id;
+    r->listener = listener;
+    wheel_init(&r->timers, now_ms());
+    r->rng = ((uint64_t)time(NULL) << 16)
+             ^ (uint64_t)(id + 1) * 0x9E3779B97F4A7C15ULL;
+
+    if (listener >= 0) {
+        int flags = fcntl(listener, F_GETFL, 0);
+        if (flags < 0 || fcntl(listener, F_SETFL, flags | O_NONBLOCK) < 0) {
+            perror("fcntl");
+            return -1;
+        }
+    }
+
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    r->inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->inbox_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &listener_tag;
+    if (listener >= 0 && epoll_ctl(r->epfd, EPOLL_CTL_ADD, listener, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &inbox_tag;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->inbox_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+static void *reactor_run(void *arg) {
+    reactor_t *r = arg;
+
+    /* pin loop i to CPU i (mod ncpu); best effort */
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (shard_count + pool_count > 1 && ncpu > 1) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(r->id % ncpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        if (__atomic_load_n(&upgrading, __ATOMIC_ACQUIRE) && r != &shards[0]) {
+            upgrade_park();
+        }
+        int timeout = expire_deadlines(r);
+        if (r->lobby.count >= 2) {
+            /* pairs held back by a full pool or --max-games */
+            lobby_match(r);
+            if (r->lobby.count >= 2
+                && (timeout < 0 || timeout > MATCH_RETRY_MS)) {
+                timeout = MATCH_RETRY_MS;
+            }
+        }
+        mux_flush(r);
+        free_closed(r);
+
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return NULL;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &listener_tag) {
+                on_accept(r);
+            } else if (ptr == &inbox_tag) {
+                on_inbox(r);
+            } else if (ptr == &report_tag) {
+                on_report();
+            } else if (ptr == &admin_tag) {
+                on_admin();
+            } else if (ptr == &upgrade_tag) {
+                on_upgrade();
+            } else {
+                dispatch(r, ptr, events[i].events);
+            }
+        }
+
+        lobby_balance(r);
+        mux_flush(r);
+        free_closed(r);
+    }
+}
+
+int reactor_serve(const reactor_config_t *cfg) {
+    config = *cfg;
+    if (config.max_lobby < 1) config.max_lobby = DEFAULT_MAX_LOBBY;
+    int workers = (config.workers < 1) ? 1 : config.workers;
+
+    shards = calloc((size_t)workers, sizeof(*shards));
+    if (!shards) {
+        perror("calloc");
+        return -1;
+    }
+
+    /* taking over: the old process's listeners, one per shard */
+    int *passed = NULL;
+    int npassed = 0;
+    if (takeover_fd >= 0 && takeover_begin(&passed, &npassed) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        int listener = (i < npassed)
+            ? passed[i]
+            : open_reuseport_listener(config.service, config.backlog);
+        if (listener < 0) {
+            return -1;
+        }
+        if (reactor_init(&shards[i], i, listener) != 0) {
+            return -1;
+        }
+    }
+    shard_count = workers;
+
+    slab_init(&conn_slab, sizeof(conn_t), 0);
+    /* every game is sized for the board it starts from; with
+       start_game, bot and multiplexed games still need room for a
+       session */
+    size_t game_bytes = game_size(config.layout) - sizeof(game_t);
+    size_t game_obj = sizeof(session_t);
+    if (config.start_game && ((config.bot_after_ms == 0
+                               && config.mux_players == 0)
+                              || sizeof(player_pair_t) > game_obj)) {
+        game_obj = sizeof(player_pair_t);
+    }
+    slab_init(&game_slab, game_bytes + game_obj,
+              config.max_games > 0 ? (size_t)config.max_games : 0);
+
+    if (config.bot_after_ms > 0) {
+        /* keep people from taking the bot's name */
+        memcpy(bot_conn.name, BOT_NAME, sizeof(BOT_NAME));
+        bot_conn.fd = -1;
+        if (!registry_reserve(BOT_NAME)) {
+            fprintf(stderr, "cannot reserve the bot's name\n");
+            return -1;
+        }
+    }
+
+    if (!config.start_game && config.game_workers > 0) {
+        if (config.games_per_worker < 1) {
+            config.games_per_worker = DEFAULT_GAMES_PER_WORKER;
+        }
+        pool = calloc((size_t)config.game_workers, sizeof(*pool));
+        if (!pool) {
+            perror("calloc");
+            return -1;
+        }
+        for (int i = 0; i < config.game_workers; i++) {
+            if (reactor_init(&pool[i], workers + i, -1) != 0) {
+                return -1;
+            }
+        }
+        pool_count = config.game_workers;
+    }
+
+    /* SIGUSR1 is read through a signalfd on shard 0; block it before
+       any other thread exists so every thread inherits the mask */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    report_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (report_fd >= 0) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &report_tag;
+        epoll_ctl(shards[0].epfd, EPOLL_CTL_ADD, report_fd, &ev);
+    }
+
+    if (config.admin_path) {
+        if (admin_fd < 0) {
+            admin_fd = open_unix_listener(config.admin_path, SOMAXCONN);
+        }
+        if (admin_fd < 0) {
+            return -1;
+        }
+        int flags = fcntl(admin_fd, F_GETFL, 0);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &admin_tag;
+        if (flags < 0 || fcntl(admin_fd, F_SETFL, flags | O_NONBLOCK) < 0
+            || epoll_ctl(shards[0].epfd, EPOLL_CTL_ADD, admin_fd, &ev) < 0) {
+            perror("admin socket");
+            return -1;
+        }
+    }
+
+    if (config.upgrade_path) {
+        if (upgrade_fd < 0) {
+            upgrade_fd = open_unix_listener(config.upgrade_path, SOMAXCONN);
+        }
+        if (upgrade_fd < 0) {
+            return -1;
+        }
+        int flags = fcntl(upgrade_fd, F_GETFL, 0);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &upgrade_tag;
+        if (flags < 0 || fcntl(upgrade_fd, F_SETFL, flags | O_NONBLOCK) < 0
+            || epoll_ctl(shards[0].epfd, EPOLL_CTL_ADD, upgrade_fd, &ev) < 0) {
+            perror("upgrade socket");
+            return -1;
+        }
+    } else if (upgrade_fd >= 0) {
+        /* the old process took upgrades; this one was not asked to */
+        close(upgrade_fd);
+        upgrade_fd = -1;
+    }
+
+    if (takeover_fd >= 0) {
+        spectate_watcher_t *watchers;
+        int nwatchers;
+        uint32_t conns;
+        int games;
+        if (takeover_restore(&watchers, &nwatchers, &conns, &games) != 0
+            || takeover_commit() != 0) {
+            return -1;
+        }
+        /* connections queued on listeners no shard here owns are
+           accepted on shard 0 before those listeners close */
+        for (int i = workers; i < npassed; i++) {
+            int own = shards[0].listener;
+            shards[0].listener = passed[i];
+            on_accept(&shards[0]);
+            shards[0].listener = own;
+            close(passed[i]);
+        }
+        for (int i = 0; i < nwatchers; i++) {
+            if (spectate_adopt(&watchers[i]) != 0) {
+                close(watchers[i].fd);
+            }
+        }
+        free(watchers);
+        free(passed);
+        log_text(LOG_INFO, "upgrade: took over %d games, %u connections and "
+                 "%d spectators after a %lld ms pause",
+                 games, conns, nwatchers, takeover_shift);
+    }
+
+    if (pool_count > 0) {
+        log_text(LOG_INFO, "nimd listening on %s (pool of %d game worker%s, "
+                 "%d games each, %d acceptor%s)...",
+                 config.service, pool_count, pool_count == 1 ? "" : "s",
+                 config.games_per_worker, workers, workers == 1 ? "" : "s");
+    } else {
+        log_text(LOG_INFO, "nimd listening on %s (%s, %d acceptor%s)...",
+                 config.service,
+                 config.start_game ? config.game_model : "epoll",
+                 workers, workers == 1 ? "" : "s");
+    }
+
+    log_text(LOG_INFO,
+             "each game holds %zu bytes, plus up to %zu of queued output",
+             reactor_game_bytes(), 2 * config.outq_limit);
+    if (admin_fd >= 0) {
+        log_text(LOG_INFO, "stats snapshots on %s", config.admin_path);
+    }
+
+    for (int i = 0; i < pool_count; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, reactor_run, &pool[i]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+
+    /* shard 0 runs on the main thread */
+    for (int i = 1; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, reactor_run, &shards[i]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    reactor_run(&shards[0]);
+    return -1;
+}
@@ -0,0 +1,93 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "server.h"
+#include "game.h"
+
+// Called with a matched pair whose sockets have been taken off the
+// event loop and made blocking, along with any input already buffered.
+// The callee owns the pair, both fds and both name reservations (see
+// registry.h); it must release the names and close the fds when done,
+// then return the pair with reactor_pair_free().
+typedef void (*reactor_game_fn)(player_pair_t *pair);
+
+typedef struct {
+    char *service;             // port to listen on
+    int workers;               // event loops, each with its own listener
+    int backlog;               // listen() queue per listener
+    int handshake_timeout_ms;  // close peers that send no OPEN in time
+    int lobby_timeout_ms;      // close players left waiting this long
+    int turn_timeout_ms;       // a player who takes longer to move forfeits
+    size_t outq_limit;         // drop peers whose queued output passes this
+    int max_lobby;             // per-worker lobby size; FAIL 25 when full
+    reactor_game_fn start_game; // NULL: play games on event loops
+    const char *game_model;    // how start_game runs games, for the log
+    void (*report)(void);      // extra SIGUSR1 output, or NULL
+    int game_workers;          // with start_game NULL: loops in the game
+                               // pool; 0 plays games on the acceptors
+    int games_per_worker;      // pool capacity per game worker
+    int max_games;             // live games; further pairs wait (0: no limit)
+    const char *admin_path;    // Unix socket serving stats snapshots, or NULL
+    const game_layout_t *layout; // board every game starts from
+    int bot_after_ms;          // pair players left waiting this long with
+                               // the server's bot (0: never)
+    int bot_strength;          // percent of the bot's moves that are
+                               // optimal; the rest are random
+    int mux_players;           // players one multiplexed connection may
+                               // carry (0: not accepted)
+    const char *upgrade_path;  // Unix socket where a new binary takes
+                               // over (see reactor_takeover), or NULL
+} reactor_config_t;
+
+// Run the edge-triggered epoll event-driven server.
+// Each worker thread owns its own SO_REUSEPORT listener, lobby and epoll
+// loop. Every connection moves through a non-blocking handshake
+// (connected -> OPEN received -> WAIT sent -> queued) with a deadline,
+// so no single peer can stall admission. Names stay globally unique
+// (FAIL 22), and lone waiting players are paired across workers.
+// Matched pairs are handed to start_game, or played as state machines
+// with the same protocol behavior as run_game(): on a pool of game
+// worker loops fed through lock-free inboxes (pairs wait in the lobby
+// while every worker is full), or on the acceptor loop itself.
+// With bot_after_ms set, a player left alone in the lobby that long
+// plays BOT_NAME instead, a seat with no socket whose moves are made
+// in-process right after each PLAY; bot games always run on the
+// acceptor loop, whatever start_game is.
+// A client that sends SPEC in place of OPEN is handed to the
+// spectators' fan-out thread (see spectate.h).
+// With mux_players set, a connection whose first frame is an NGP1_MUX
+// frame carries up to that many players, one per session id (see
+// ngp.h), each with the protocol behavior of a connection of its own.
+// Their frames are written in one batch per connection per pass of
+// the loop, and their games stay on the connection's loop.
+// SIGUSR1 prints how many games each loop is running; a client that
+// connects to admin_path is sent a stats_snapshot() (see stats.h).
+// Only returns if the server could not be set up (returns -1).
+int reactor_serve(const reactor_config_t *cfg);
+
+// Hot upgrade. A server with upgrade_path set listens there for a new
+// binary started with the same upgrade_path, which calls
+// reactor_takeover before opening the journal or player table. The old
+// process parks its loops, flushes the journal, pauses the spectators'
+// thread and sends its listeners, every connection (socket, buffered
+// input, queued output, deadline), its lobbies and its games (board,
+// turn clock, journal record so far). The new reactor_serve restores
+// them on its own loops and opens no listener the old one passed; the
+// old process exits once it is told the state arrived, and carries on
+// as before if that never happens. Only games on event loops (start_game
+// NULL) can be handed over, and the new process must play the same
+// layout; deadlines are extended by however long the loops were parked.
+//
+// Returns 1 if a server on path handed over its state (reactor_serve
+// then restores it), 0 if none is listening there, or -1 on error.
+int reactor_takeover(const char *path);
+
+// Give back a pair handed to start_game
+void reactor_pair_free(player_pair_t *pair);
+
+// Memory one live game holds in the reactor's slabs, not counting
+// queued output (bounded by outq_limit per player) or whatever
+// start_game adds, such as a thread or coroutine stack
+size_t reactor_game_bytes(void);
+
+#endif
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "registry.h"
+#include "server.h"
+
+/* Names in the lobby or in a game, for FAIL 22.
+ *
+ * The registry is split into independently locked stripes, each its own
+ * open-addressing hash table with linear probing. A name's hash picks
+ * the stripe from its high bits and the home slot from its low bits, so
+ * reserve and release are O(1) and only contend with other names that
+ * land on the same stripe. Removal shifts later entries of the probe
+ * run back instead of leaving tombstones, so tables never degrade. */
+
+#define REGISTRY_STRIPES   64   /* power of two */
+#define STRIPE_SHIFT       26   /* 32 - log2(REGISTRY_STRIPES) */
+#define STRIPE_MIN_SLOTS   64   /* power of two */
+
+typedef struct {
+    uint32_t hash;              /* 0 marks an empty slot */
+    char name[MAX_NAME_LEN + 1];
+} slot_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    slot_t *slots;
+    size_t mask;                /* slot count - 1; 0 until first insert */
+    size_t count;
+} __attribute__((aligned(64))) stripe_t;
+
+static stripe_t stripes[REGISTRY_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+static void stripes_init(void) {
+    for (int i = 0; i < REGISTRY_STRIPES; i++) {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+    }
+}
+
+uint32_t registry_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+/* slot holding name, or the empty slot ending its probe run
+   (must be called with the stripe locked and slots allocated) */
+static size_t probe(const stripe_t *st, uint32_t h, const char *name) {
+    size_t i = h & st->mask;
+    while (st->slots[i].hash != 0) {
+        if (st->slots[i].hash == h && strcmp(st->slots[i].name, name) == 0) {
+            break;
+        }
+        i = (i + 1) & st->mask;
+    }
+    return i;
+}
+
+/* keep the load factor at or below 1/2 */
+static int stripe_grow(stripe_t *st) {
+    size_t old_size = st->slots ? st->mask + 1 : 0;
+    size_t size = old_size ? old_size * 2 : STRIPE_MIN_SLOTS;
+    slot_t *slots = calloc(size, sizeof(*slots));
+    if (!slots) return -1;
+
+    slot_t *old = st->slots;
+    st->slots = slots;
+    st->mask = size - 1;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].hash != 0) {
+            size_t j = old[i].hash & st->mask;
+            while (slots[j].hash != 0) j = (j + 1) & st->mask;
+            slots[j] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+int registry_reserve(const char *name) {
+    pthread_once(&stripes_once, stripes_init);
+    uint32_t h = registry_hash(name);
+    stripe_t *st = &stripes[h >> STRIPE_SHIFT];
+    int ok = 0;
+
+    pthread_mutex_lock(&st->lock);
+    if (!st->slots || (st->count + 1) * 2 > st->mask + 1) {
+        if (stripe_grow(st) != 0) {
+            pthread_mutex_unlock(&st->lock);
+            return 0;
+        }
+    }
+    size_t i = probe(st, h, name);
+    if (st->slots[i].hash == 0) {
+        st->slots[i].hash = h;
+        strncpy(st->slots[i].name, name, MAX_NAME_LEN);
+        st->slots[i].name[MAX_NAME_LEN] = '\0';
+        st->count++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return ok;
+}
+
+void registry_release(const char *name) {
+    pthread_once(&stripes_once, stripes_init);
+    uint32_t h = registry_hash(name);
+    stripe_t *st = &stripes[h >> STRIPE_SHIFT];
+
+    pthread_mutex_lock(&st->lock);
+    if (!st->slots) {
+        pthread_mutex_unlock(&st->lock);
+        return;
+    }
+    size_t i = probe(st, h, name);
+    if (st->slots[i].hash == 0) {
+        pthread_mutex_unlock(&st->lock);
+        return;
+    }
+
+    /* backward-shift deletion: pull later entries of the run into the
+       hole unless their home slot lies cyclically in (hole, j] */
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & st->mask;
+        if (st->slots[j].hash == 0) break;
+        size_t home = st->slots[j].hash & st->mask;
+        int stays = (i <= j) ? (i < home && home <= j)
+                             : (i < home || home <= j);
+        if (stays) continue;
+        st->slots[i] = st->slots[j];
+        i = j;
+    }
+    st->slots[i].hash = 0;
+    st->count--;
+    pthread_mutex_unlock(&st->lock);
+}
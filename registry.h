@@ -0,0 +1,20 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+// Process-wide registry of player names that are in use, either waiting
+// in a lobby or playing a game. Backs FAIL 22 Already Playing and is
+// safe to call from any thread.
+
+#include <stdint.h>
+
+// Reserve name; returns 1 if reserved, 0 if it is already in use
+int registry_reserve(const char *name);
+
+// Release a name reserved with registry_reserve
+void registry_release(const char *name);
+
+// FNV-1a hash of a name, never 0 so that tables can use 0 for an empty
+// slot; every table keyed by player name hashes with it
+uint32_t registry_hash(const char *name);
+
+#endif
@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rules.h"
+
+static const game_rules_t nim = {
+    .kind = RULES_NIM,
+    .take = 1,
+    .min = 1,
+};
+
+const game_rules_t *rules_default(void) {
+    return &nim;
+}
+
+// --------------------------
+// Subtraction tables
+// --------------------------
+
+// Fill in r->grundy for r's subtraction set. A pile's value is the mex
+// (least value not taken) of the values amount[i] stones below it.
+// Past the largest amount m, each value depends only on the m before
+// it, so once a run of m values repeats an earlier run the sequence
+// repeats from there on. Runs are found through a hash of the last m
+// values kept as it slides.
+static int build_grundy(game_rules_t *r) {
+    uint32_t m = r->amount[r->amounts - 1];
+    uint32_t limit = 1u << RULES_TABLE_BITS;
+    size_t slots = (size_t)limit * 2;
+    uint8_t *t = malloc(limit);
+    uint32_t *seen = malloc(slots * sizeof(*seen));
+    if (!t || !seen) {
+        free(t);
+        free(seen);
+        return -1;
+    }
+    memset(seen, 0xff, slots * sizeof(*seen));
+
+    const uint64_t base = 0x100000001b3ULL;
+    uint64_t drop = 1;          // base^m, to slide the oldest value out
+    for (uint32_t i = 0; i < m; i++) drop *= base;
+
+    uint64_t hash = 0;
+    for (uint32_t n = 0; n < limit; n++) {
+        uint64_t taken = 0;     // values are at most RULES_MAX_AMOUNTS
+        for (int i = 0; i < r->amounts && r->amount[i] <= n; i++) {
+            taken |= 1ULL << t[n - r->amount[i]];
+        }
+        t[n] = (uint8_t)__builtin_ctzll(~taken);
+
+        hash = hash * base + t[n] + 1;
+        if (n >= m) hash -= (uint64_t)(t[n - m] + 1) * drop;
+        if (n + 1 < m) continue;
+
+        uint32_t start = n + 1 - m;   // the run t[start .. n]
+        size_t slot = (size_t)((hash * 0x9E3779B97F4A7C15ULL)
+                               >> (64 - RULES_TABLE_BITS - 1));
+        while (seen[slot] != UINT32_MAX) {
+            uint32_t j = seen[slot];
+            if (memcmp(t + j, t + start, m) == 0) {
+                free(seen);
+                r->pre = j;
+                r->period = start - j;
+                uint8_t *kept = realloc(t, start);
+                r->grundy = kept ? kept : t;
+                return 0;
+            }
+            slot = (slot + 1) & (slots - 1);
+        }
+        seen[slot] = start;
+    }
+    free(t);
+    free(seen);
+    return -1;
+}
+
+// parse "A,B,..." into r's subtraction set and build its tables
+static int parse_amounts(game_rules_t *r, const char *p) {
+    r->amounts = 0;
+    for (;;) {
+        char *end;
+        long v = strtol(p, &end, 10);
+        if (end == p || v < 1 || v > RULES_MAX_AMOUNT
+            || r->amounts == RULES_MAX_AMOUNTS
+            || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        // keep the set sorted and without repeats
+        int i = r->amounts;
+        while (i > 0 && r->amount[i - 1] > (uint32_t)v) {
+            r->amount[i] = r->amount[i - 1];
+            i--;
+        }
+        if (i > 0 && r->amount[i - 1] == (uint32_t)v) {
+            memmove(r->amount + i, r->amount + i + 1,
+                    (size_t)(r->amounts - i) * sizeof(r->amount[0]));
+        } else {
+            r->amount[i] = (uint32_t)v;
+            r->amounts++;
+        }
+        if (*end == '\0') break;
+        p = end + 1;
+    }
+
+    uint32_t max = r->amount[r->amounts - 1];
+    r->allowed = calloc(max + 1, 1);
+    if (!r->allowed) return -1;
+    for (int i = 0; i < r->amounts; i++) {
+        r->allowed[r->amount[i]] = 1;
+    }
+    r->min = r->amount[0];
+    if (build_grundy(r) != 0) {
+        free(r->allowed);
+        return -1;
+    }
+    return 0;
+}
+
+int rules_parse(game_rules_t *r, const char *spec) {
+    memset(r, 0, sizeof(*r));
+    r->take = 1;
+    r->min = 1;
+    if (strcmp(spec, "nim") == 0) {
+        r->kind = RULES_NIM;
+        return 0;
+    }
+    if (strcmp(spec, "misere") == 0) {
+        r->kind = RULES_MISERE;
+        return 0;
+    }
+    if (strncmp(spec, "moore:", 6) == 0) {
+        char *end;
+        long k = strtol(spec + 6, &end, 10);
+        if (end == spec + 6 || *end != '\0' || k < 1 || k > GAME_MAX_TAKE) {
+            return -1;
+        }
+        r->kind = RULES_MOORE;
+        r->take = (int)k;
+        return 0;
+    }
+    if (strncmp(spec, "subtract:", 9) == 0) {
+        r->kind = RULES_SUBTRACT;
+        return parse_amounts(r, spec + 9);
+    }
+    return -1;
+}
+
+void rules_describe(const game_rules_t *r, char *buf, size_t cap) {
+    size_t len = 0;
+    switch (r->kind) {
+    case RULES_NIM:
+        snprintf(buf, cap, "nim");
+        break;
+    case RULES_MISERE:
+        snprintf(buf, cap, "misere");
+        break;
+    case RULES_MOORE:
+        snprintf(buf, cap, "moore:%d", r->take);
+        break;
+    case RULES_SUBTRACT:
+        len = (size_t)snprintf(buf, cap, "subtract:");
+        for (int i = 0; i < r->amounts && len < cap; i++) {
+            len += (size_t)snprintf(buf + len, cap - len, "%s%u",
+                                    i ? "," : "", r->amount[i]);
+        }
+        break;
+    }
+}
+
+uint32_t rules_grundy(const game_rules_t *r, uint32_t n) {
+    if (r->kind != RULES_SUBTRACT) return n;
+    if (n < r->pre) return r->grundy[n];
+    return r->grundy[r->pre + (n - r->pre) % r->period];
+}
+
+// --------------------------
+// Evaluation
+// --------------------------
+
+static uint32_t nim_sum(const game_t *g) {
+    uint32_t sum = 0;
+    for (int i = 0; i < g->layout->piles; i++) {
+        sum ^= rules_grundy(g->rules, g->piles[i]);
+    }
+    return sum;
+}
+
+// Moore's Nim-k: the player to move loses exactly when, in every bit
+// position, the number of piles with that bit set is a multiple of k+1
+static void bit_counts(const game_t *g, uint32_t count[32]) {
+    memset(count, 0, 32 * sizeof(count[0]));
+    for (int i = 0; i < g->layout->piles; i++) {
+        for (uint32_t v = g->piles[i]; v; v &= v - 1) {
+            count[__builtin_ctz(v)]++;
+        }
+    }
+}
+
+// misere Nim plays as normal Nim until a move would leave no pile
+// over 1; then the winner leaves an odd number of 1s
+static int misere_winning(const game_t *g) {
+    int ones = 0, big = 0;
+    for (int i = 0; i < g->layout->piles; i++) {
+        if (g->piles[i] > 1) big++;
+        else ones += (int)g->piles[i];
+    }
+    if (big == 0) return ones % 2 == 0;
+    return nim_sum(g) != 0;
+}
+
+int rules_is_winning(const game_t *g) {
+    switch (g->rules->kind) {
+    case RULES_MISERE:
+        return misere_winning(g);
+    case RULES_MOORE: {
+        uint32_t count[32];
+        bit_counts(g, count);
+        for (int b = 0; b < 32; b++) {
+            if (count[b] % (uint32_t)(g->rules->take + 1) != 0) return 1;
+        }
+        return 0;
+    }
+    case RULES_NIM:
+    case RULES_SUBTRACT:
+        break;
+    }
+    return nim_sum(g) != 0;
+}
+
+// --------------------------
+// Moves
+// --------------------------
+
+static void single(game_move_t *m, int pile, uint32_t qty) {
+    m->count = 1;
+    m->pile[0] = pile;
+    m->qty[0] = qty;
+}
+
+// a move to a position whose Grundy values XOR to 0: some pile's value
+// drops by XORing it with sum, and a pile can reach every smaller value
+static int grundy_move(const game_t *g, uint32_t sum, game_move_t *m) {
+    const game_rules_t *r = g->rules;
+    for (int i = 0; i < g->layout->piles; i++) {
+        uint32_t n = g->piles[i];
+        uint32_t value = rules_grundy(r, n);
+        uint32_t to = value ^ sum;
+        if (to >= value) continue;
+        if (r->kind != RULES_SUBTRACT) {
+            single(m, i, n - to);
+            return 1;
+        }
+        for (int a = 0; a < r->amounts && r->amount[a] <= n; a++) {
+            if (rules_grundy(r, n - r->amount[a]) == to) {
+                single(m, i, r->amount[a]);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int misere_move(const game_t *g, game_move_t *m) {
+    int ones = 0, big = 0, last_big = -1, a_one = -1;
+    for (int i = 0; i < g->layout->piles; i++) {
+        if (g->piles[i] > 1) {
+            big++;
+            last_big = i;
+        } else if (g->piles[i] == 1) {
+            ones++;
+            a_one = i;
+        }
+    }
+    if (big == 0) {
+        // take a 1 to leave an odd number of them
+        if (ones % 2 != 0) return 0;
+        single(m, a_one, 1);
+        return 1;
+    }
+    if (big == 1) {
+        // the last pile over 1: shrink it to 0 or 1 so the 1s left
+        // number odd
+        uint32_t n = g->piles[last_big];
+        single(m, last_big, (ones % 2 != 0) ? n : n - 1);
+        return 1;
+    }
+    uint32_t sum = nim_sum(g);
+    return sum != 0 && grundy_move(g, sum, m);
+}
+
+// Moore's construction, from the highest bit down: in each bit the
+// piles already reduced are free to take either value, and the rest
+// keep theirs. If the set bits do not already come to a multiple of
+// k+1, either clear the excess in untouched piles (reducing them) or,
+// if that would touch more than k piles, set the bit in enough of the
+// reduced ones to reach the next multiple.
+static int moore_move(const game_t *g, game_move_t *m) {
+    uint32_t count[32];
+    bit_counts(g, count);
+    uint32_t mod = (uint32_t)g->rules->take + 1;
+    int k = g->rules->take;
+
+    int touched = 0;
+    uint32_t target[GAME_MAX_TAKE];
+    for (int b = 31; b >= 0; b--) {
+        uint32_t bit = 1u << b;
+        uint32_t set = count[b];
+        for (int t = 0; t < touched; t++) {
+            if (g->piles[m->pile[t]] & bit) set--;
+        }
+        int need = (int)(set % mod);
+        if (need != 0 && touched + need <= k) {
+            for (int i = 0; need > 0; i++) {
+                if (!(g->piles[i] & bit)) continue;
+                int t = 0;
+                while (t < touched && m->pile[t] != i) t++;
+                if (t < touched) continue;
+                // keep the bits above b; the lower ones are chosen below
+                m->pile[touched] = i;
+                target[touched++] = g->piles[i] & ~(bit | (bit - 1));
+                need--;
+            }
+        } else if (need != 0) {
+            for (int t = 0; t < k + 1 - need; t++) {
+                target[t] |= bit;
+            }
+        }
+    }
+    if (touched == 0) return 0;
+    m->count = touched;
+    for (int t = 0; t < touched; t++) {
+        m->qty[t] = g->piles[m->pile[t]] - target[t];
+    }
+    return 1;
+}
+
+int rules_best_move(const game_t *g, game_move_t *m) {
+    switch (g->rules->kind) {
+    case RULES_MISERE:
+        return misere_move(g, m);
+    case RULES_MOORE:
+        return moore_move(g, m);
+    case RULES_NIM:
+    case RULES_SUBTRACT:
+        break;
+    }
+    uint32_t sum = nim_sum(g);
+    return sum != 0 && grundy_move(g, sum, m);
+}
+
+void rules_random_move(const game_t *g, uint64_t rnd, game_move_t *m) {
+    const game_rules_t *r = g->rules;
+    int piles = g->layout->piles;
+    int pile = (int)(((rnd >> 32) * (uint64_t)piles) >> 32);
+    while (g->piles[pile] < r->min) {
+        pile = (pile + 1) % piles;
+    }
+    uint32_t n = g->piles[pile];
+    uint32_t low = (uint32_t)rnd;
+    if (r->kind != RULES_SUBTRACT) {
+        single(m, pile, 1 + (uint32_t)(((uint64_t)low * n) >> 32));
+        return;
+    }
+    int fit = 0;
+    while (fit < r->amounts && r->amount[fit] <= n) fit++;
+    single(m, pile, r->amount[((uint64_t)low * (uint32_t)fit) >> 32]);
+}
@@ -0,0 +1,78 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <stdint.h>
+
+#include "game.h"
+
+// Variants of Nim (nimd --rules). Every variant is played on the same
+// piles and board text (game.h); its rules decide which moves are
+// legal, when the game is over and who wins, and rules_best_move finds
+// a winning move for the bot.
+//
+// Positions are evaluated with Sprague-Grundy values: under normal play
+// the player to move loses exactly when the XOR of the piles' Grundy
+// values is 0. A pile's value comes from a closed form, or for a
+// subtraction set from a table built once by rules_parse, so
+// evaluating a position costs one lookup per pile, never a search.
+// Misere Nim and Moore's Nim-k are not sums of single-pile games; they
+// use their known closed-form rules instead.
+
+#define RULES_MAX_AMOUNTS 32       // amounts in a subtraction set
+#define RULES_MAX_AMOUNT 4096      // largest amount in a subtraction set
+#define RULES_TABLE_BITS 20        // at most 2^20 Grundy values are
+                                   // computed in search of a period
+
+typedef enum {
+    RULES_NIM,        // take any number from one pile; last stone wins
+    RULES_MISERE,     // the same moves, but the last stone loses
+    RULES_SUBTRACT,   // take one of a set of amounts from one pile; a
+                      // player left without a move loses
+    RULES_MOORE       // take any number from each of up to `take`
+                      // piles (Moore's Nim-k); last stone wins
+} rules_kind_t;
+
+struct game_rules {
+    rules_kind_t kind;
+    int take;           // piles one move may take from
+    uint32_t min;       // a pile with fewer stones allows no move
+    // RULES_SUBTRACT: the amounts, ascending, and allowed[q] for every
+    // q up to the largest
+    int amounts;
+    uint32_t amount[RULES_MAX_AMOUNTS];
+    uint8_t *allowed;
+    // RULES_SUBTRACT: a pile's Grundy values. The sequence is eventually
+    // periodic, so only the first pre + period values are kept; the
+    // value of n >= pre is grundy[pre + (n - pre) % period].
+    uint8_t *grundy;
+    uint32_t pre;
+    uint32_t period;
+};
+
+// Plain Nim
+const game_rules_t *rules_default(void);
+
+// Parse "nim", "misere", "subtract:A,B,..." (amounts 1 to
+// RULES_MAX_AMOUNT) or "moore:K" (K from 1 to GAME_MAX_TAKE), building
+// any table the rules need. Returns 0, or -1 if spec is malformed, the
+// table has no period within 2^RULES_TABLE_BITS values, or memory ran out.
+int rules_parse(game_rules_t *r, const char *spec);
+
+// Short description for logs, such as "subtract:1,3,4"
+void rules_describe(const game_rules_t *r, char *buf, size_t cap);
+
+// Grundy value of one pile of n stones (RULES_NIM and RULES_SUBTRACT)
+uint32_t rules_grundy(const game_rules_t *r, uint32_t n);
+
+// 1 if the player to move in g wins against best play, 0 if not
+int rules_is_winning(const game_t *g);
+
+// A winning move for the player to move in g: returns 1 with m set,
+// or 0 if every move loses against best play
+int rules_best_move(const game_t *g, game_move_t *m);
+
+// A random legal move from a single pile, chosen by the bits of rnd;
+// g must not be over
+void rules_random_move(const game_t *g, uint64_t rnd, game_move_t *m);
+
+#endif
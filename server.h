@@ -0,0 +1,39 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+
+#include "game.h"
+#include "ngp.h"
+#include "outq.h"
+
+#define MAX_NAME_LEN 72   // per spec
+#define DEFAULT_MAX_LOBBY 4096   // queued players per worker
+#define DEFAULT_GAMES_PER_WORKER 10000   // game pool capacity per worker
+#define DEFAULT_HANDSHAKE_TIMEOUT_MS 10000  // time allowed to send OPEN
+#define DEFAULT_LOBBY_TIMEOUT_MS 600000     // time allowed to wait for an opponent
+#define DEFAULT_TURN_TIMEOUT_MS 120000      // time allowed to make a move
+#define DRAIN_TIMEOUT_MS 5000   // time allowed to flush output at game end
+#define BOT_NAME "nimbot"       // the server's bot; reserved while bots are on
+#define DEFAULT_BOT_STRENGTH 100   // percent of the bot's moves played optimally
+#define MAX_MUX_PLAYERS 65536   // session ids on one multiplexed connection;
+                                // a tagged frame still fits in NGP_MAX_MSG
+
+// A named player handed from the acceptor to a game
+typedef struct {
+    int  fd;
+    char name[MAX_NAME_LEN + 1];
+    int  version;      // NGP version of frames it is sent
+    ngp_framer_t in;   // bytes already read from fd but not yet consumed
+    outq_t out;        // bytes not yet accepted by the socket
+} player_t;
+
+// A matched pair handed from the acceptor to a game, with room for the
+// game itself: its piles and board text follow the struct (game_size)
+typedef struct {
+    player_t p1;
+    player_t p2;
+    game_t game;    // last
+} player_pair_t;
+
+#endif
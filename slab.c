@@ -0,0 +1,82 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+#define SLAB_CHUNK_BYTES 65536   // each growth step carves this much
+
+void slab_init(slab_t *s, size_t obj_size, size_t limit) {
+    pthread_mutex_init(&s->lock, NULL);
+    if (obj_size < sizeof(void *)) obj_size = sizeof(void *);
+    s->obj_size = (obj_size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    s->per_chunk = SLAB_CHUNK_BYTES / s->obj_size;
+    if (s->per_chunk == 0) s->per_chunk = 1;
+    s->limit = limit;
+    s->live = 0;
+    s->total = 0;
+    s->free = NULL;
+}
+
+/* carve a new chunk onto the free list (called with the lock held) */
+static int slab_grow(slab_t *s) {
+    size_t n = s->per_chunk;
+    if (s->limit && s->total + n > s->limit) {
+        n = s->limit - s->total;
+    }
+    void *chunk;
+    if (n == 0 || posix_memalign(&chunk, SLAB_ALIGN, n * s->obj_size) != 0) {
+        return -1;
+    }
+
+    char *p = chunk;
+    for (size_t i = 0; i < n; i++) {
+        *(void **)(p + i * s->obj_size) = s->free;
+        s->free = p + i * s->obj_size;
+    }
+    s->total += n;
+    return 0;
+}
+
+void *slab_alloc(slab_t *s) {
+    pthread_mutex_lock(&s->lock);
+    if ((s->limit && s->live >= s->limit)
+        || (!s->free && slab_grow(s) != 0)) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+    void *obj = s->free;
+    s->free = *(void **)obj;
+    s->live++;
+    pthread_mutex_unlock(&s->lock);
+
+    memset(obj, 0, s->obj_size);
+    return obj;
+}
+
+void slab_free(slab_t *s, void *obj) {
+    if (!obj) return;
+    pthread_mutex_lock(&s->lock);
+    *(void **)obj = s->free;
+    s->free = obj;
+    s->live--;
+    pthread_mutex_unlock(&s->lock);
+}
+
+size_t slab_obj_size(const slab_t *s) {
+    return s->obj_size;
+}
+
+size_t slab_live(slab_t *s) {
+    pthread_mutex_lock(&s->lock);
+    size_t n = s->live;
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+size_t slab_bytes(slab_t *s) {
+    pthread_mutex_lock(&s->lock);
+    size_t n = s->total * s->obj_size;
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
@@ -0,0 +1,40 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Fixed-size object allocator. Objects are cache-line aligned and
+// carved out of chunks that are never returned to the system; freed
+// objects go on a free list and are handed out again first, so once a
+// slab has grown to its peak the alloc/free path never calls malloc.
+// Safe to use from any thread.
+
+#define SLAB_ALIGN 64   // cache line
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t obj_size;    // requested size rounded up to SLAB_ALIGN
+    size_t per_chunk;   // objects carved per chunk
+    size_t limit;       // most objects live at once; 0 = no limit
+    size_t live;        // objects handed out
+    size_t total;       // objects carved (live + free)
+    void  *free;        // free list, threaded through the objects
+} slab_t;
+
+void slab_init(slab_t *s, size_t obj_size, size_t limit);
+
+// A zeroed object, or NULL at the limit or out of memory
+void *slab_alloc(slab_t *s);
+
+// Return an object obtained from slab_alloc on the same slab
+void slab_free(slab_t *s, void *obj);
+
+// Bytes one object occupies
+size_t slab_obj_size(const slab_t *s);
+
+// Objects currently handed out, and bytes reserved by the slab
+size_t slab_live(slab_t *s);
+size_t slab_bytes(slab_t *s);
+
+#endif
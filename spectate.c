@@ -0,0 +1,656 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "spectate.h"
+#include "server.h"
+#include "ngp.h"
+#include "stats.h"
+#include "registry.h"
+
+#define MAX_EVENTS 64
+#define TICK_MS 2          /* inbox poll interval while anyone watches */
+#define MIN_BUCKETS 1024   /* names table; doubles as games are added */
+
+typedef enum {
+    MSG_BEGIN,    /* a game can be watched */
+    MSG_FRAME,    /* a frame for its watchers */
+    MSG_END,      /* the game is over */
+    MSG_ATTACH,   /* a socket wants to watch a player */
+    MSG_PAUSE     /* a hot upgrade: list the watchers and stop */
+} msg_type_t;
+
+/* inbox message. A FRAME is the shared buffer itself: once on the
+   fan-out thread, refs counts the watchers holding it, and it is freed
+   when the last one has sent it or skipped it. Only the fan-out thread
+   touches refs, so it needs no atomics. */
+typedef struct msg {
+    struct msg *next;
+    msg_type_t type;
+    spectate_game_t *game;
+    int fd;                 /* ATTACH */
+    size_t name_len;        /* ATTACH: data holds the name, its NUL,
+                               then any bytes to send first */
+    int catch_up;           /* ATTACH: then send the newest frame */
+    int refs;               /* FRAME */
+    uint64_t seq;           /* FRAME: its number within the game */
+    size_t len;
+    char *data;             /* FRAME: the frame; ATTACH: the name */
+} msg_t;
+
+typedef struct watcher {
+    int fd;                 /* -1 once dropped */
+    spectate_game_t *game;
+    msg_t *cur;             /* frame being sent */
+    size_t off;             /* bytes of cur already sent */
+    msg_t *pending;         /* newest frame not yet started, or NULL */
+    uint64_t seen;          /* seq of the newest frame taken */
+    struct watcher *prev;   /* the game's watchers */
+    struct watcher *next;
+    struct watcher *next_dropped;
+} watcher_t;
+
+/* a watchable name, chained in its hash bucket */
+typedef struct entry {
+    char name[MAX_NAME_LEN + 1];
+    spectate_game_t *game;
+    struct entry *next;
+} entry_t;
+
+struct spectate_game {
+    /* the game's thread writes these; the fan-out thread reads them */
+    int watchers;             /* atomic; frames are only queued if > 0 */
+    unsigned version;         /* seqlock over latest: odd while written */
+    uint64_t latest_seq;
+    size_t latest_len;
+    char latest[NGP_MAX_MSG];
+    uint64_t seq;             /* frames published; game's thread only */
+    msg_t begin;
+    msg_t end;
+    /* fan-out thread only */
+    entry_t entry[2];
+    watcher_t *list;
+};
+
+static int spectate_on;
+static int max_watchers;
+static int watching;          /* atomic, for spectate_watchers() */
+
+static int epfd = -1;
+static int inbox_fd = -1;
+static msg_t *inbox;          /* lock-free stack, emptied by fan-out */
+static char inbox_tag;
+static int sleeping;          /* fan-out is waiting on inbox_fd alone */
+
+/* name -> game, fan-out thread only */
+static entry_t **buckets;
+static size_t bucket_mask;
+static size_t entries;
+
+/* watchers dropped during the current event batch; freed after it,
+   since a later event in the batch may still point at one */
+static watcher_t *dropped;
+
+/* spectate_pause: the fan-out thread lists its watchers, then waits
+   until paused is cleared */
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+static int paused;
+static spectate_watcher_t *pause_list;
+static int pause_count;
+
+/* --------------------------
+   Game side
+   -------------------------- */
+
+/* While anyone watches, the fan-out thread empties the inbox every
+   TICK_MS, so games push without a system call; only a push that finds
+   it asleep, or an urgent one (a spectator waiting for an answer),
+   writes the eventfd. */
+static void inbox_push(msg_t *m, int urgent) {
+    msg_t *head = __atomic_load_n(&inbox, __ATOMIC_RELAXED);
+    do {
+        m->next = head;
+    } while (!__atomic_compare_exchange_n(&inbox, &head, m, 1,
+                                          __ATOMIC_SEQ_CST,
+                                          __ATOMIC_RELAXED));
+
+    if (urgent || (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST)
+                   && __atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST))) {
+        uint64_t one = 1;
+        (void)write(inbox_fd, &one, sizeof(one));
+    }
+}
+
+/* a message with len bytes of data following it */
+static msg_t *msg_new(msg_type_t type, size_t len) {
+    msg_t *m = malloc(sizeof(*m) + len);
+    if (!m) return NULL;
+    memset(m, 0, sizeof(*m));
+    m->type = type;
+    m->len = len;
+    m->data = (char *)(m + 1);
+    return m;
+}
+
+spectate_game_t *spectate_begin(const char *name1, const char *name2) {
+    if (!spectate_on) return NULL;
+    spectate_game_t *g = calloc(1, sizeof(*g));
+    if (!g) return NULL;
+    const char *names[2] = { name1, name2 };
+    for (int i = 0; i < 2; i++) {
+        if (names[i]) {
+            snprintf(g->entry[i].name, sizeof(g->entry[i].name), "%s",
+                     names[i]);
+        }
+        g->entry[i].game = g;
+    }
+    g->begin.type = MSG_BEGIN;
+    g->begin.game = g;
+    g->end.type = MSG_END;
+    g->end.game = g;
+    inbox_push(&g->begin, 0);
+    return g;
+}
+
+void spectate_frame(spectate_game_t *g, const char *frame, size_t len) {
+    if (!g || len > sizeof(g->latest)) return;
+    uint64_t seq = ++g->seq;
+
+    /* the latest frame, for watchers who join later */
+    unsigned v = g->version;
+    __atomic_store_n(&g->version, v + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(g->latest, frame, len);
+    g->latest_len = len;
+    g->latest_seq = seq;
+    /* a full barrier: a watcher who joins after the load below reads
+       this frame from latest, so none misses it */
+    __atomic_fetch_add(&g->version, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&g->watchers, __ATOMIC_SEQ_CST) == 0) return;
+    msg_t *m = msg_new(MSG_FRAME, len);
+    if (!m) return;   /* as if skipped; the next frame catches up */
+    m->game = g;
+    m->seq = seq;
+    memcpy(m->data, frame, len);
+    inbox_push(m, 0);
+}
+
+void spectate_end(spectate_game_t *g) {
+    if (!g) return;
+    inbox_push(&g->end, 0);
+}
+
+/* an ATTACH whose watcher is sent first[0..first_len) before any
+   frame, and the game's newest frame if catch_up is set */
+static int attach(int fd, const char *name, const char *first,
+                  size_t first_len, int catch_up) {
+    if (!spectate_on) return -1;
+    size_t len = strlen(name) + 1;
+    msg_t *m = msg_new(MSG_ATTACH, len + first_len);
+    if (!m) return -1;
+    m->fd = fd;
+    m->name_len = len - 1;
+    m->catch_up = catch_up;
+    memcpy(m->data, name, len);
+    if (first_len) memcpy(m->data + len, first, first_len);
+    inbox_push(m, 1);
+    return 0;
+}
+
+int spectate_attach(int fd, const char *name) {
+    return attach(fd, name, NULL, 0, 1);
+}
+
+int spectate_adopt(const spectate_watcher_t *w) {
+    return attach(w->fd, w->name, w->unsent, w->unsent_len, w->behind);
+}
+
+int spectate_watchers(void) {
+    return __atomic_load_n(&watching, __ATOMIC_RELAXED);
+}
+
+/* --------------------------
+   Names
+   -------------------------- */
+
+static void names_grow(void) {
+    size_t count = (bucket_mask + 1) * 2;
+    entry_t **grown = calloc(count, sizeof(*grown));
+    if (!grown) return;   /* chains just get longer */
+    for (size_t i = 0; i <= bucket_mask; i++) {
+        while (buckets[i]) {
+            entry_t *e = buckets[i];
+            buckets[i] = e->next;
+            entry_t **b = &grown[registry_hash(e->name) & (count - 1)];
+            e->next = *b;
+            *b = e;
+        }
+    }
+    free(buckets);
+    buckets = grown;
+    bucket_mask = count - 1;
+}
+
+/* a name is in at most one entry: names are unique while their games
+   run (see registry.h), and a game queues its END before they are
+   released, so a reused name's BEGIN always comes later */
+static void names_add(entry_t *e) {
+    if (entries > bucket_mask) names_grow();
+    entry_t **b = &buckets[registry_hash(e->name) & bucket_mask];
+    e->next = *b;
+    *b = e;
+    entries++;
+}
+
+static void names_remove(entry_t *e) {
+    entry_t **p = &buckets[registry_hash(e->name) & bucket_mask];
+    while (*p && *p != e) p = &(*p)->next;
+    if (*p) {
+        *p = e->next;
+        entries--;
+    }
+}
+
+static spectate_game_t *names_find(const char *name) {
+    entry_t *e = buckets[registry_hash(name) & bucket_mask];
+    while (e && strcmp(e->name, name) != 0) e = e->next;
+    return e ? e->game : NULL;
+}
+
+/* --------------------------
+   Watchers
+   -------------------------- */
+
+static void frame_release(msg_t *f) {
+    if (f && --f->refs == 0) free(f);
+}
+
+/* queue f for w unless w already has it or a newer one; an older frame
+   still waiting is replaced (skip-ahead) */
+static void watcher_take(watcher_t *w, msg_t *f) {
+    if (f->seq <= w->seen) return;
+    if (w->pending) {
+        frame_release(w->pending);
+        stats_count(STAT_SPECTATOR_SKIPS);
+    }
+    f->refs++;
+    w->pending = f;
+    w->seen = f->seq;
+}
+
+/* send what the socket takes. Returns 0 (the rest waits for EPOLLOUT),
+   or -1 if the watcher must be dropped */
+static int watcher_flush(watcher_t *w) {
+    for (;;) {
+        if (!w->cur) {
+            w->cur = w->pending;
+            w->pending = NULL;
+            w->off = 0;
+            if (!w->cur) return 0;
+        }
+        ssize_t n = send(w->fd, w->cur->data + w->off, w->cur->len - w->off,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        w->off += (size_t)n;
+        if (w->off == w->cur->len) {
+            frame_release(w->cur);
+            w->cur = NULL;
+        }
+    }
+}
+
+static void watcher_drop(watcher_t *w) {
+    if (w->fd < 0) return;
+    if (w->cur || w->pending) {
+        stats_count(STAT_SPECTATORS_DROPPED);
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    close(w->fd);
+    w->fd = -1;
+    frame_release(w->cur);
+    frame_release(w->pending);
+    w->cur = w->pending = NULL;
+
+    spectate_game_t *g = w->game;
+    if (w->prev) w->prev->next = w->next;
+    else g->list = w->next;
+    if (w->next) w->next->prev = w->prev;
+    __atomic_fetch_sub(&g->watchers, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_sub(&watching, 1, __ATOMIC_RELAXED);
+    stats_gauge_add(STAT_SPECTATORS, -1);
+
+    w->next_dropped = dropped;
+    dropped = w;
+}
+
+/* copy the game's latest frame, if there is one yet */
+static msg_t *latest_frame(spectate_game_t *g) {
+    char buf[NGP_MAX_MSG];
+    size_t len;
+    uint64_t seq;
+    for (;;) {
+        unsigned v = __atomic_load_n(&g->version, __ATOMIC_SEQ_CST);
+        if (v & 1) {
+            sched_yield();
+            continue;
+        }
+        len = g->latest_len;
+        seq = g->latest_seq;
+        if (len <= sizeof(buf)) memcpy(buf, g->latest, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&g->version, __ATOMIC_RELAXED) == v) break;
+    }
+    if (seq == 0) return NULL;
+    msg_t *f = msg_new(MSG_FRAME, len);
+    if (!f) return NULL;
+    f->seq = seq;
+    memcpy(f->data, buf, len);
+    return f;
+}
+
+static void answer_fail(int fd, int code) {
+    const ngp_frame *f = ngp_fail_frame(code);
+    stats_fail(code);
+    (void)send(fd, f->data, f->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+}
+
+static void on_attach(msg_t *m) {
+    int fd = m->fd;
+    spectate_game_t *g = names_find(m->data);
+    size_t first_len = m->len - m->name_len - 1;
+    int catch_up = m->catch_up;
+    msg_t *first = NULL;
+    if (g && first_len > 0) {
+        /* the rest of a frame an earlier process began sending */
+        first = msg_new(MSG_FRAME, first_len);
+        if (first) {
+            memcpy(first->data, m->data + m->name_len + 1, first_len);
+            first->refs = 1;
+        }
+    }
+    free(m);
+    if (!g) {
+        answer_fail(fd, 24);
+        return;
+    }
+    if (__atomic_load_n(&watching, __ATOMIC_RELAXED) >= max_watchers) {
+        free(first);
+        answer_fail(fd, 25);
+        return;
+    }
+
+    watcher_t *w = calloc(1, sizeof(*w));
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = w;
+    if (!w || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        free(first);
+        free(w);
+        close(fd);
+        return;
+    }
+    w->fd = fd;
+    w->cur = first;
+    w->game = g;
+    w->next = g->list;
+    if (g->list) g->list->prev = w;
+    g->list = w;
+    __atomic_fetch_add(&watching, 1, __ATOMIC_RELAXED);
+    stats_gauge_add(STAT_SPECTATORS, 1);
+
+    /* counted before latest is read: any frame published after that
+       read is queued for this watcher too (see spectate_frame) */
+    __atomic_fetch_add(&g->watchers, 1, __ATOMIC_SEQ_CST);
+    msg_t *f = catch_up ? latest_frame(g) : NULL;
+    if (f) {
+        f->refs = 1;
+        watcher_take(w, f);
+        frame_release(f);
+    }
+    if (watcher_flush(w) != 0) {
+        watcher_drop(w);
+    }
+}
+
+static void on_frame(msg_t *f) {
+    /* held while it is handed out */
+    f->refs = 1;
+    watcher_t *w = f->game->list;
+    while (w) {
+        watcher_t *next = w->next;
+        watcher_take(w, f);
+        if (watcher_flush(w) != 0) {
+            watcher_drop(w);
+        }
+        w = next;
+    }
+    frame_release(f);
+}
+
+/* the OVER frame came just before: flush it and let every watcher go;
+   anyone who cannot take it now is too far behind to wait for */
+static void on_end(spectate_game_t *g) {
+    for (int i = 0; i < 2; i++) {
+        if (g->entry[i].name[0]) names_remove(&g->entry[i]);
+    }
+    while (g->list) {
+        watcher_t *w = g->list;
+        (void)watcher_flush(w);
+        watcher_drop(w);
+    }
+    free(g);
+}
+
+/* list every watcher for spectate_pause, then wait for it to be
+   either abandoned (spectate_resume) or finished by the process
+   exiting. A watcher's queued frame is left out: the new process sends
+   the latest board when it takes the watcher over. */
+static void on_pause(void) {
+    int count = __atomic_load_n(&watching, __ATOMIC_RELAXED);
+    spectate_watcher_t *list = calloc((size_t)count + 1, sizeof(*list));
+    int n = 0;
+    for (size_t i = 0; list && i <= bucket_mask; i++) {
+        for (entry_t *e = buckets[i]; e; e = e->next) {
+            /* each game once, through its first named seat */
+            spectate_game_t *g = e->game;
+            if (e != &g->entry[0] && g->entry[0].name[0]) continue;
+            for (watcher_t *w = g->list; w && n < count; w = w->next) {
+                spectate_watcher_t *out = &list[n++];
+                out->fd = w->fd;
+                memcpy(out->name, e->name, sizeof(out->name));
+                if (w->cur) {
+                    out->unsent_len = w->cur->len - w->off;
+                    memcpy(out->unsent, w->cur->data + w->off,
+                           out->unsent_len);
+                }
+                out->behind = (w->pending != NULL);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&pause_lock);
+    pause_list = list;
+    pause_count = list ? n : -1;
+    paused = 2;
+    pthread_cond_broadcast(&pause_cond);
+    while (paused && list) {
+        pthread_cond_wait(&pause_cond, &pause_lock);
+    }
+    paused = 0;
+    pthread_mutex_unlock(&pause_lock);
+}
+
+int spectate_pause(spectate_watcher_t **out) {
+    if (!spectate_on) {
+        *out = NULL;
+        return 0;
+    }
+    static msg_t pause_msg = { .type = MSG_PAUSE };
+    pthread_mutex_lock(&pause_lock);
+    paused = 1;
+    inbox_push(&pause_msg, 1);
+    while (paused == 1) {
+        pthread_cond_wait(&pause_cond, &pause_lock);
+    }
+    *out = pause_list;
+    int n = pause_count;
+    pause_list = NULL;
+    pthread_mutex_unlock(&pause_lock);
+    return n;
+}
+
+void spectate_resume(void) {
+    if (!spectate_on) return;
+    pthread_mutex_lock(&pause_lock);
+    paused = 0;
+    pthread_cond_broadcast(&pause_cond);
+    pthread_mutex_unlock(&pause_lock);
+}
+
+static void on_inbox(void) {
+    /* take the whole stack, then reverse it into arrival order */
+    msg_t *stack = __atomic_exchange_n(&inbox, NULL, __ATOMIC_ACQUIRE);
+    msg_t *list = NULL;
+    while (stack) {
+        msg_t *m = stack;
+        stack = m->next;
+        m->next = list;
+        list = m;
+    }
+
+    while (list) {
+        msg_t *m = list;
+        list = m->next;
+        switch (m->type) {
+        case MSG_BEGIN:
+            for (int i = 0; i < 2; i++) {
+                if (m->game->entry[i].name[0]) {
+                    names_add(&m->game->entry[i]);
+                }
+            }
+            break;
+        case MSG_FRAME:
+            on_frame(m);
+            break;
+        case MSG_END:
+            on_end(m->game);
+            break;
+        case MSG_ATTACH:
+            on_attach(m);
+            break;
+        case MSG_PAUSE:
+            on_pause();
+            break;
+        }
+    }
+}
+
+/* a watcher's socket: send what is waiting, and discard anything the
+   spectator sends (there is nothing for it to say) */
+static void on_watcher(watcher_t *w, uint32_t events) {
+    if (w->fd < 0) return;
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        watcher_drop(w);
+        return;
+    }
+    if ((events & EPOLLOUT) && watcher_flush(w) != 0) {
+        watcher_drop(w);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP)) {
+        char buf[512];
+        for (;;) {
+            ssize_t n = recv(w->fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n > 0) continue;
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            watcher_drop(w);
+            return;
+        }
+    }
+}
+
+static void *fanout_run(void *arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int timeout = TICK_MS;
+        if (__atomic_load_n(&watching, __ATOMIC_RELAXED) == 0) {
+            /* nobody to send to: sleep until something is pushed */
+            __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&inbox, __ATOMIC_SEQ_CST) == NULL) {
+                timeout = -1;
+            } else {
+                __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+            }
+        }
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &inbox_tag) {
+                uint64_t count;
+                (void)read(inbox_fd, &count, sizeof(count));
+            } else {
+                on_watcher(events[i].data.ptr, events[i].events);
+            }
+        }
+        on_inbox();
+        while (dropped) {
+            watcher_t *w = dropped;
+            dropped = w->next_dropped;
+            free(w);
+        }
+    }
+}
+
+int spectate_start(int max) {
+    buckets = calloc(MIN_BUCKETS, sizeof(*buckets));
+    if (!buckets) return -1;
+    bucket_mask = MIN_BUCKETS - 1;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) return -1;
+    inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inbox_fd < 0) return -1;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &inbox_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, inbox_fd, &ev) < 0) return -1;
+    max_watchers = max;
+
+    /* the fan-out thread takes no signals; they belong to the event loops */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t tid;
+    int rc = pthread_create(&tid, NULL, fanout_run, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    pthread_detach(tid);
+    spectate_on = 1;
+    return 0;
+}
@@ -0,0 +1,82 @@
+#ifndef SPECTATE_H
+#define SPECTATE_H
+
+#include <stddef.h>
+
+#include "server.h"
+#include "ngp.h"
+
+// Spectators (nimd --spectators). A client that sends SPEC|name| in
+// place of OPEN is handed to a fan-out thread and sent every PLAY and
+// OVER frame of the game that player is in, starting with the current
+// board.
+//
+// A game publishes each frame once, after it has been sent to the two
+// players. With nobody watching, that is a copy into the game's
+// latest-frame slot, with no lock, allocation or system call. With
+// watchers, the frame is also copied into one reference-counted,
+// immutable buffer and pushed on the fan-out thread's lock-free inbox,
+// which that thread polls while anyone watches, so the push makes no
+// system call either. The fan-out thread writes the same buffer to
+// every watcher with non-blocking sends. A watcher keeps at most the
+// frame it is part way through and the newest one after it: a
+// spectator that reads slower than the game moves skips ahead to the
+// latest board, and one still holding unsent output when the game ends
+// is dropped. The players'
+// turn loop never waits on a spectator.
+//
+// Every function is a no-op when spectating is off, or when given the
+// NULL that spectate_begin returns in that case.
+
+typedef struct spectate_game spectate_game_t;
+
+// Start the fan-out thread, allowing at most max_watchers spectators
+// at once. Returns 0, or -1 with errno set.
+int spectate_start(int max_watchers);
+
+// Make a game watchable under either player's name; a NULL name (the
+// bot's seat) is not looked up. Returns NULL if spectating is off or
+// memory ran out.
+spectate_game_t *spectate_begin(const char *name1, const char *name2);
+
+// Publish a PLAY or OVER frame the players have been sent
+void spectate_frame(spectate_game_t *g, const char *frame, size_t len);
+
+// The game is over; g is consumed. Call before the players' names are
+// released, so a name is never watched in two games at once.
+void spectate_end(spectate_game_t *g);
+
+// Hand over a non-blocking socket that asked to watch name. The fan-out
+// thread owns fd from here on: it answers FAIL 24 if name is not in a
+// game and FAIL 25 if max_watchers are already watching. Returns 0, or
+// -1 (fd untouched) if spectating is off or memory ran out.
+int spectate_attach(int fd, const char *name);
+
+// Spectators now watching
+int spectate_watchers(void);
+
+// A watcher being handed to a new process (hot upgrade, see reactor.h):
+// its socket, a name in the game it watches, the rest of the frame it
+// was part way through, which must reach it first, and whether a newer
+// board was still waiting behind that
+typedef struct {
+    int fd;
+    char name[MAX_NAME_LEN + 1];
+    size_t unsent_len;
+    char unsent[NGP_MAX_MSG];
+    int behind;
+} spectate_watcher_t;
+
+// Stop the fan-out thread once it has handled every frame published so
+// far, and list its watchers in *out (malloc'd; free it). The thread
+// sends nothing more until spectate_resume. Returns the count, or -1
+// if memory ran out (the thread is left running).
+int spectate_pause(spectate_watcher_t **out);
+void spectate_resume(void);
+
+// Take over a watcher listed by another process's spectate_pause; as
+// spectate_attach, but its unsent bytes go out before anything else,
+// and the game's current board only if it was behind
+int spectate_adopt(const spectate_watcher_t *w);
+
+#endif
@@ -0,0 +1,264 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define SUB_BITS    4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_EXP     36   /* values from 2^36 us (19 hours) up share the last bucket */
+#define HIST_BUCKETS ((MAX_EXP - SUB_BITS + 1) * SUB_BUCKETS)
+#define MAX_FAIL_CODE 100
+
+/* one thread's counts. Only the owning thread writes them, with relaxed
+   atomic stores so a concurrent snapshot reads whole values */
+typedef struct block {
+    unsigned long long counters[STAT_COUNTER_COUNT];
+    long long gauges[STAT_GAUGE_COUNT];
+    unsigned long long fails[MAX_FAIL_CODE];
+    unsigned long long hist[STAT_HIST_COUNT][HIST_BUCKETS];
+    struct block *prev;
+    struct block *next;
+} block_t;
+
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static block_t *blocks;
+/* counts of threads that have exited */
+static block_t retired;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t block_key;
+
+static __thread block_t *this_block;
+
+static const char *const hist_names[STAT_HIST_COUNT] = {
+    "nimd_accept_to_wait_us",
+    "nimd_lobby_wait_us",
+    "nimd_move_to_play_us",
+    "nimd_game_duration_us",
+};
+
+static const char *const counter_names[STAT_COUNTER_COUNT] = {
+    "nimd_connections_accepted_total",
+    "nimd_games_started_total",
+    "nimd_games_finished_total",
+    "nimd_moves_total",
+    "nimd_forfeits_total",
+    "nimd_bot_games_started_total",
+    "nimd_spectator_frames_skipped_total",
+    "nimd_spectators_dropped_total",
+};
+
+static const char *const gauge_names[STAT_GAUGE_COUNT] = {
+    "nimd_lobby_depth",
+    "nimd_bot_games",
+    "nimd_spectators",
+    "nimd_mux_players",
+};
+
+long long stats_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void add_block(block_t *dst, const block_t *src) {
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++) {
+        dst->counters[i] += __atomic_load_n(&src->counters[i], __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < STAT_GAUGE_COUNT; i++) {
+        dst->gauges[i] += __atomic_load_n(&src->gauges[i], __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < MAX_FAIL_CODE; i++) {
+        dst->fails[i] += __atomic_load_n(&src->fails[i], __ATOMIC_RELAXED);
+    }
+    for (int h = 0; h < STAT_HIST_COUNT; h++) {
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            dst->hist[h][i] += __atomic_load_n(&src->hist[h][i],
+                                               __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* thread exit: fold the block into `retired` and free it */
+static void retire_block(void *arg) {
+    block_t *b = arg;
+    pthread_mutex_lock(&blocks_lock);
+    add_block(&retired, b);
+    if (b->prev) b->prev->next = b->next;
+    else blocks = b->next;
+    if (b->next) b->next->prev = b->prev;
+    pthread_mutex_unlock(&blocks_lock);
+    free(b);
+}
+
+static void make_key(void) {
+    pthread_key_create(&block_key, retire_block);
+}
+
+/* first record on this thread: allocate and publish its block. Blocks
+   are cache-line aligned so no two threads ever write the same line. */
+static block_t *register_block(void) {
+    pthread_once(&key_once, make_key);
+
+    void *mem;
+    if (posix_memalign(&mem, 64, sizeof(block_t)) != 0) {
+        return NULL;
+    }
+    block_t *b = mem;
+    memset(b, 0, sizeof(*b));
+
+    pthread_mutex_lock(&blocks_lock);
+    b->next = blocks;
+    if (blocks) blocks->prev = b;
+    blocks = b;
+    pthread_mutex_unlock(&blocks_lock);
+
+    pthread_setspecific(block_key, b);
+    this_block = b;
+    return b;
+}
+
+static inline block_t *my_block(void) {
+    block_t *b = this_block;
+    return b ? b : register_block();
+}
+
+/* single writer: a load and a store, never a locked instruction */
+static inline void bump(unsigned long long *p) {
+    __atomic_store_n(p, *p + 1, __ATOMIC_RELAXED);
+}
+
+void stats_count(stat_counter_t c) {
+    block_t *b = my_block();
+    if (b) bump(&b->counters[c]);
+}
+
+void stats_gauge_add(stat_gauge_t g, int delta) {
+    block_t *b = my_block();
+    if (b) __atomic_store_n(&b->gauges[g], b->gauges[g] + delta,
+                            __ATOMIC_RELAXED);
+}
+
+void stats_fail(int code) {
+    block_t *b = my_block();
+    if (b && code >= 0 && code < MAX_FAIL_CODE) bump(&b->fails[code]);
+}
+
+/* values below 16 get a bucket each; above that, 16 buckets per power
+   of two, indexed by the top four bits under the leading one */
+static inline int bucket_of(unsigned long long v) {
+    if (v < SUB_BUCKETS) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    if (e >= MAX_EXP) return HIST_BUCKETS - 1;
+    return (e - SUB_BITS + 1) * SUB_BUCKETS
+           + (int)((v >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* largest value that lands in bucket i */
+static unsigned long long bucket_top(int i) {
+    if (i < SUB_BUCKETS) return (unsigned long long)i;
+    int k = i / SUB_BUCKETS;
+    unsigned long long sub = (unsigned long long)(i % SUB_BUCKETS);
+    return ((SUB_BUCKETS + sub + 1) << (k - 1)) - 1;
+}
+
+void stats_record(stat_hist_t h, long long us) {
+    block_t *b = my_block();
+    if (b) bump(&b->hist[h][bucket_of(us > 0 ? (unsigned long long)us : 0)]);
+}
+
+/* --------------------------
+   Snapshot
+   -------------------------- */
+
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t len;
+} out_t;
+
+static void out_printf(out_t *o, const char *fmt, ...) {
+    if (o->len + 1 >= o->cap) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(o->buf + o->len, o->cap - o->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    o->len += (size_t)n;
+    if (o->len >= o->cap) o->len = o->cap - 1;
+}
+
+/* smallest bucket top with at least q of the count at or below it */
+static unsigned long long quantile(const unsigned long long *hist,
+                                   unsigned long long count, double q) {
+    unsigned long long rank = (unsigned long long)(q * (double)count);
+    if (rank < 1) rank = 1;
+    unsigned long long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= rank) return bucket_top(i);
+    }
+    return 0;
+}
+
+static void write_hist(out_t *o, const char *name,
+                       const unsigned long long *hist) {
+    static const double qs[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+    unsigned long long count = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) count += hist[i];
+
+    out_printf(o, "# TYPE %s summary\n", name);
+    for (size_t i = 0; i < sizeof(qs) / sizeof(qs[0]); i++) {
+        out_printf(o, "%s{quantile=\"%g\"} %llu\n", name, qs[i],
+                   count ? quantile(hist, count, qs[i]) : 0ULL);
+    }
+    out_printf(o, "%s_count %llu\n", name, count);
+}
+
+size_t stats_snapshot(char *buf, size_t cap) {
+    out_t o = { buf, cap, 0 };
+    if (cap == 0) return 0;
+    buf[0] = '\0';
+
+    block_t *sum = calloc(1, sizeof(*sum));
+    if (!sum) return 0;
+
+    /* holding the lock keeps every block alive and stops a thread's
+       counts moving from its block to `retired` mid-sum */
+    pthread_mutex_lock(&blocks_lock);
+    add_block(sum, &retired);
+    for (block_t *b = blocks; b; b = b->next) {
+        add_block(sum, b);
+    }
+    pthread_mutex_unlock(&blocks_lock);
+
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++) {
+        out_printf(&o, "%s %llu\n", counter_names[i], sum->counters[i]);
+    }
+    /* blocks are read one after another, so a game that started and
+       ended meanwhile may show only its end */
+    unsigned long long started = sum->counters[STAT_GAMES_STARTED];
+    unsigned long long finished = sum->counters[STAT_GAMES_FINISHED];
+    out_printf(&o, "nimd_games_active %llu\n",
+               started > finished ? started - finished : 0ULL);
+    for (int i = 0; i < STAT_GAUGE_COUNT; i++) {
+        out_printf(&o, "%s %lld\n", gauge_names[i], sum->gauges[i]);
+    }
+    for (int i = 0; i < MAX_FAIL_CODE; i++) {
+        if (sum->fails[i]) {
+            out_printf(&o, "nimd_fail_total{code=\"%d\"} %llu\n",
+                       i, sum->fails[i]);
+        }
+    }
+    for (int h = 0; h < STAT_HIST_COUNT; h++) {
+        write_hist(&o, hist_names[h], sum->hist[h]);
+    }
+
+    free(sum);
+    return o.len;
+}
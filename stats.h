@@ -0,0 +1,63 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+// Server metrics: event counters, gauges and latency histograms.
+// Every thread records into its own block, found through a thread-local
+// pointer, so recording is a plain store to memory no other thread
+// writes: no locks, no atomic read-modify-write, no shared cache lines.
+// Histograms are log-linear (16 buckets per power of two, so a reported
+// value is within 1/16 of the true one) over 1us .. about 19 hours.
+// A thread's counts outlive it: they are folded into a shared block
+// when the thread exits.
+
+typedef enum {
+    STAT_ACCEPT_TO_WAIT,   // accept() to WAIT queued
+    STAT_LOBBY_WAIT,       // WAIT to paired with an opponent
+    STAT_MOVE_TO_PLAY,     // valid MOVE read to the next PLAY queued
+    STAT_GAME_DURATION,    // first NAME to OVER (or forfeit)
+    STAT_HIST_COUNT
+} stat_hist_t;
+
+typedef enum {
+    STAT_ACCEPTED,         // connections accepted
+    STAT_GAMES_STARTED,
+    STAT_GAMES_FINISHED,
+    STAT_MOVES,            // valid moves applied
+    STAT_FORFEITS,
+    STAT_BOT_GAMES_STARTED, // games against the server's bot
+    STAT_SPECTATOR_SKIPS,  // frames a slow spectator skipped
+    STAT_SPECTATORS_DROPPED, // spectators cut off with output unsent
+    STAT_COUNTER_COUNT
+} stat_counter_t;
+
+typedef enum {
+    STAT_LOBBY_DEPTH,      // players waiting for an opponent
+    STAT_BOT_GAMES,        // live games against the server's bot
+    STAT_SPECTATORS,       // spectators watching a game
+    STAT_MUX_PLAYERS,      // players on multiplexed connections
+    STAT_GAUGE_COUNT
+} stat_gauge_t;
+
+// Monotonic clock in microseconds, for the latencies below
+long long stats_now_us(void);
+
+void stats_count(stat_counter_t c);
+
+void stats_gauge_add(stat_gauge_t g, int delta);
+
+// A FAIL frame with this code was sent
+void stats_fail(int code);
+
+// Record a latency of `us` microseconds (negative counts as 0)
+void stats_record(stat_hist_t h, long long us);
+
+// Write a snapshot of every thread's counts as text, one
+// "name{labels} value" line per series (the Prometheus text format).
+// Threads cannot start or exit recording while it is taken, and each
+// histogram's count and quantiles come from the same bucket reads.
+// Returns the length written (truncated to cap - 1, NUL-terminated).
+size_t stats_snapshot(char *buf, size_t cap);
+
+#endif
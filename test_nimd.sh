@@ -6,15 +6,18 @@ PORT2=23457
 PORT3=23458
 PORT4=23459
 
+# extra server flags, e.g. NIMD_FLAGS=--epoll ./test_nimd.sh
+NIMD_FLAGS=${NIMD_FLAGS:-}
+
 echo "[test] building..."
-make -s nimd
+make -s nimd nimjournal nimplayers
 
 ########################################
 # First server: T1–T4 on PORT1
 ########################################
 
 echo "[test] starting nimd on port $PORT1 (T1–T4)"
-./nimd "$PORT1" &
+./nimd $NIMD_FLAGS "$PORT1" &
 SERVER_PID=$!
 
 # Give the server a moment to start
@@ -55,7 +58,7 @@ send_case_port1 "[T2] Invalid framing -> expect FAIL 10 Invalid" \
 # Long name > 72 chars (80 'A's)
 LONGNAME=$(printf 'A%.0s' {1..80})
 send_case_port1 "[T3] Long name -> expect FAIL 21 Long Name" \
-                "0|99|OPEN|$LONGNAME|"
+                "0|86|OPEN|$LONGNAME|"
 
 echo
 echo "========================================"
@@ -92,7 +95,7 @@ wait "$SERVER_PID" 2>/dev/null || true
 
 echo
 echo "[test] starting nimd on port $PORT2 for T5"
-./nimd "$PORT2" &
+./nimd $NIMD_FLAGS "$PORT2" &
 SERVER_PID=$!
 
 sleep 1
@@ -151,7 +154,7 @@ wait "$SERVER_PID" 2>/dev/null || true
 
 echo
 echo "[test] starting nimd on port $PORT3 for T6/T7"
-./nimd "$PORT3" &
+./nimd $NIMD_FLAGS "$PORT3" &
 SERVER_PID=$!
 
 sleep 1
@@ -177,7 +180,7 @@ timeout 1 dd bs=1 count=256 <&9 2>/dev/null | hexdump -C || true
 if { : >&8; } 2>/dev/null && { : >&9; } 2>/dev/null; then
     sleep 0.5
     # From current player (A), send MOVE with clearly invalid pile index 99
-    printf "0|11|MOVE|99|1|" >&8
+    printf "0|10|MOVE|99|1|" >&8
     sleep 0.2
     echo "--- response on A (expect FAIL 32 Pile Index) ---"
     timeout 1 dd bs=1 count=256 <&8 2>/dev/null | hexdump -C || true
@@ -191,7 +194,7 @@ echo "========================================"
 if { : >&8; } 2>/dev/null && { : >&9; } 2>/dev/null; then
     sleep 0.5
     # From current player (still A), send MOVE with huge quantity
-    printf "0|11|MOVE|1|99|" >&8
+    printf "0|10|MOVE|1|99|" >&8
     sleep 0.2
     echo "--- response on A (expect FAIL 33 Quantity) ---"
     timeout 1 dd bs=1 count=256 <&8 2>/dev/null | hexdump -C || true
@@ -213,7 +216,7 @@ wait "$SERVER_PID" 2>/dev/null || true
 
 echo
 echo "[test] starting nimd on port $PORT4 for T8"
-./nimd "$PORT4" &
+./nimd $NIMD_FLAGS "$PORT4" &
 SERVER_PID=$!
 
 sleep 1
@@ -255,5 +258,741 @@ echo "[test] killing nimd after T8 (pid=$SERVER_PID)"
 kill "$SERVER_PID" 2>/dev/null || true
 wait "$SERVER_PID" 2>/dev/null || true
 
+########################################
+# T9 onward: each case checks the bytes it gets against an expected
+# transcript and counts mismatches; the run fails if there are any
+########################################
+
+FAILURES=0
+
+# an NGP text frame: frame "OPEN|Bob|" -> 0|09|OPEN|Bob|
+frame() {
+    printf "0|%02d|%s" "${#1}" "$1"
+}
+
+start_nimd() {
+    local port="$1"
+    shift
+    ./nimd $NIMD_FLAGS "$@" "$port" &
+    SERVER_PID=$!
+    sleep 1
+}
+
+stop_nimd() {
+    kill "$SERVER_PID" 2>/dev/null || true
+    wait "$SERVER_PID" 2>/dev/null || true
+}
+
+# expect_reply FD LABEL WANT [ALT]: read what FD gets within a second
+# and compare it to WANT (a printf format, so binary frames can be
+# written with \x escapes), or to ALT where the server may pick either
+expect_reply() {
+    local fd="$1" label="$2" got want alt=""
+    got=$(timeout 1 cat <&"$fd" 2>/dev/null | od -An -c | tr -s ' \n' ' ')
+    want=$(printf "$3" | od -An -c | tr -s ' \n' ' ')
+    if [ $# -ge 4 ]; then
+        alt=$(printf "$4" | od -An -c | tr -s ' \n' ' ')
+    fi
+    if [ "$got" = "$want" ] || { [ -n "$alt" ] && [ "$got" = "$alt" ]; }; then
+        echo "ok: $label"
+    else
+        echo "MISMATCH: $label"
+        echo "  want:$want"
+        [ -z "$alt" ] || echo "  or:  $alt"
+        echo "  got: $got"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+# expect_closed FD LABEL: the server has closed FD's connection
+expect_closed() {
+    if timeout 1 cat <&"$1" >/dev/null 2>&1; then
+        echo "ok: $2"
+    else
+        echo "MISMATCH: $2 (connection still open)"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+########################################
+# T9: split and pipelined frames (streaming framer)
+########################################
+
+PORT5=23460
+echo
+echo "[test] starting nimd on port $PORT5 for T9"
+start_nimd "$PORT5"
+
+echo
+echo "========================================"
+echo "[T9] OPEN split across two writes, then two MOVEs in one write"
+echo "========================================"
+
+set +e
+
+exec 12<>"/dev/tcp/localhost/$PORT5"
+OPEN_S1=$(frame "OPEN|S1|")
+printf "%s" "${OPEN_S1:0:6}" >&12
+sleep 0.3
+printf "%s" "${OPEN_S1:6}" >&12
+expect_reply 12 "split OPEN -> WAIT" "$(frame "WAIT|")"
+
+exec 13<>"/dev/tcp/localhost/$PORT5"
+frame "OPEN|S2|" >&13
+expect_reply 13 "S2 -> WAIT, NAME, PLAY" \
+    "$(frame "WAIT|")$(frame "NAME|2|S1|")$(frame "PLAY|1|1 3 5 7 9|")"
+expect_reply 12 "S1 -> NAME, PLAY" \
+    "$(frame "NAME|1|S2|")$(frame "PLAY|1|1 3 5 7 9|")"
+
+# the second MOVE is read with the first but is out of turn
+printf "%s%s" "$(frame "MOVE|0|1|")" "$(frame "MOVE|1|1|")" >&12
+expect_reply 12 "pipelined MOVEs -> PLAY, then FAIL 31 Impatient" \
+    "$(frame "PLAY|2|0 3 5 7 9|")$(frame "FAIL|31 Impatient|")"
+expect_reply 13 "S2 -> PLAY" "$(frame "PLAY|2|0 3 5 7 9|")"
+
+exec 12>&- 2>/dev/null
+exec 13>&- 2>/dev/null
+
+set -e
+
+echo
+echo "[test] killing nimd after T9 (pid=$SERVER_PID)"
+stop_nimd
+
+########################################
+# T10: FAIL 25 once the lobby is full
+########################################
+
+PORT6=23461
+echo
+echo "[test] starting nimd on port $PORT6 for T10"
+start_nimd "$PORT6" --max-lobby 2 --max-games 1
+
+echo
+echo "========================================"
+echo "[T10] Lobby full (--max-lobby 2, --max-games 1) -> expect FAIL 25"
+echo "========================================"
+
+set +e
+
+# L12 and L13 take the only game; L14 and L15 wait as a pair held back
+for fd in 12 13 14 15; do
+    eval "exec $fd<>/dev/tcp/localhost/$PORT6"
+    frame "OPEN|L$fd|" >&"$fd"
+    sleep 0.2
+done
+expect_reply 15 "L15 -> WAIT (pair held by --max-games)" "$(frame "WAIT|")"
+
+exec 16<>"/dev/tcp/localhost/$PORT6"
+frame "OPEN|L16|" >&16
+expect_reply 16 "L16 -> FAIL 25 Lobby Full" "$(frame "FAIL|25 Lobby Full|")"
+expect_closed 16 "L16 closed"
+
+for fd in 12 13 14 15 16; do
+    eval "exec $fd>&-" 2>/dev/null
+done
+
+set -e
+
+echo
+echo "[test] killing nimd after T10 (pid=$SERVER_PID)"
+stop_nimd
+
+########################################
+# T11: handshake, lobby and turn deadlines
+########################################
+
+PORT7=23462
+echo
+echo "[test] starting nimd on port $PORT7 for T11"
+start_nimd "$PORT7" --handshake-timeout 500 --lobby-timeout 500 \
+           --turn-timeout 500
+
+echo
+echo "========================================"
+echo "[T11] Deadlines of 500 ms -> expect closes and a forfeit"
+echo "========================================"
+
+set +e
+
+# connects but never sends OPEN
+exec 12<>"/dev/tcp/localhost/$PORT7"
+sleep 1
+expect_closed 12 "no OPEN -> closed after --handshake-timeout"
+
+# waits alone in the lobby
+exec 13<>"/dev/tcp/localhost/$PORT7"
+frame "OPEN|Idle|" >&13
+expect_reply 13 "Idle -> WAIT, then closed after --lobby-timeout" \
+    "$(frame "WAIT|")"
+expect_closed 13 "Idle closed"
+
+# T1 never moves
+exec 14<>"/dev/tcp/localhost/$PORT7"
+frame "OPEN|T1|" >&14
+sleep 0.2
+exec 15<>"/dev/tcp/localhost/$PORT7"
+frame "OPEN|T2|" >&15
+sleep 1
+expect_reply 15 "T2 -> WAIT, NAME, PLAY, then OVER Forfeit after --turn-timeout" \
+    "$(frame "WAIT|")$(frame "NAME|2|T1|")$(frame "PLAY|1|1 3 5 7 9|")$(frame "OVER|2|1 3 5 7 9|Forfeit|")"
+expect_reply 14 "T1 -> WAIT, NAME, PLAY" \
+    "$(frame "WAIT|")$(frame "NAME|1|T2|")$(frame "PLAY|1|1 3 5 7 9|")"
+
+for fd in 12 13 14 15; do
+    eval "exec $fd>&-" 2>/dev/null
+done
+
+set -e
+
+echo
+echo "[test] killing nimd after T11 (pid=$SERVER_PID)"
+stop_nimd
+
+########################################
+# T12: counters on the admin socket
+########################################
+
+PORT8=23463
+ADMIN_SOCK="/tmp/nimd_test_admin.$$"
+echo
+echo "[test] starting nimd on port $PORT8 for T12"
+start_nimd "$PORT8" --admin "$ADMIN_SOCK"
+
+echo
+echo "========================================"
+echo "[T12] A game with a FAIL 33 -> expect it in the --admin snapshot"
+echo "========================================"
+
+# expect_text LABEL WANT: compare standard input with WANT
+expect_text() {
+    local got
+    got=$(cat)
+    if [ "$got" = "$2" ]; then
+        echo "ok: $1"
+    else
+        echo "MISMATCH: $1"
+        echo "  want: $2" | sed '2,$s/^/        /'
+        echo "  got:  $got" | sed '2,$s/^/        /'
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+set +e
+
+exec 12<>"/dev/tcp/localhost/$PORT8"
+frame "OPEN|A1|" >&12
+sleep 0.2
+exec 13<>"/dev/tcp/localhost/$PORT8"
+frame "OPEN|A2|" >&13
+sleep 0.2
+for m in "12 MOVE|0|1|" "13 MOVE|1|9|" "13 MOVE|1|3|" "12 MOVE|2|5|" \
+         "13 MOVE|3|7|" "12 MOVE|4|9|"; do
+    frame "${m#* }" >&"${m%% *}"
+    sleep 0.1
+done
+expect_reply 12 "A1 -> a whole game, won" \
+    "$(frame "WAIT|")$(frame "NAME|1|A2|")$(frame "PLAY|1|1 3 5 7 9|")$(frame "PLAY|2|0 3 5 7 9|")$(frame "PLAY|1|0 0 5 7 9|")$(frame "PLAY|2|0 0 0 7 9|")$(frame "PLAY|1|0 0 0 0 9|")$(frame "OVER|1|0 0 0 0 0||")"
+
+# each client of the socket gets one snapshot
+perl -MIO::Socket::UNIX -e '
+    my $s = IO::Socket::UNIX->new(Peer => $ARGV[0]) or die "$ARGV[0]: $!\n";
+    print while <$s>;' "$ADMIN_SOCK" |
+    grep -E '^nimd_(games_finished_total|moves_total|fail_total)' |
+    expect_text "snapshot -> one game finished, five moves, one FAIL 33" \
+        "$(printf '%s\n' 'nimd_games_finished_total 1' 'nimd_moves_total 5' \
+                         'nimd_fail_total{code="33"} 1')"
+
+exec 12>&- 2>/dev/null
+exec 13>&- 2>/dev/null
+
+set -e
+
+echo
+echo "[test] killing nimd after T12 (pid=$SERVER_PID)"
+stop_nimd
+rm -f "$ADMIN_SOCK"
+
+########################################
+# T13: games read back from the journal
+########################################
+
+PORT9=23464
+JOURNAL_DIR=$(mktemp -d /tmp/nimd_test_journal.XXXXXX)
+echo
+echo "[test] starting nimd on port $PORT9 for T13"
+start_nimd "$PORT9" --journal "$JOURNAL_DIR"
+
+echo
+echo "========================================"
+echo "[T13] Two games with --journal -> expect nimjournal to print them back"
+echo "========================================"
+
+set +e
+
+# a whole game with a FAIL 33 in it, then a forfeit
+exec 12<>"/dev/tcp/localhost/$PORT9"
+frame "OPEN|J1|" >&12
+sleep 0.2
+exec 13<>"/dev/tcp/localhost/$PORT9"
+frame "OPEN|J2|" >&13
+sleep 0.2
+for m in "12 MOVE|0|1|" "13 MOVE|1|9|" "13 MOVE|1|3|" "12 MOVE|2|5|" \
+         "13 MOVE|3|7|" "12 MOVE|4|9|"; do
+    frame "${m#* }" >&"${m%% *}"
+    sleep 0.1
+done
+expect_reply 13 "J2 -> a whole game, lost" \
+    "$(frame "WAIT|")$(frame "NAME|2|J1|")$(frame "PLAY|1|1 3 5 7 9|")$(frame "PLAY|2|0 3 5 7 9|")$(frame "FAIL|33 Quantity|")$(frame "PLAY|1|0 0 5 7 9|")$(frame "PLAY|2|0 0 0 7 9|")$(frame "PLAY|1|0 0 0 0 9|")$(frame "OVER|1|0 0 0 0 0||")"
+exec 14<>"/dev/tcp/localhost/$PORT9"
+frame "OPEN|K1|" >&14
+sleep 0.2
+exec 15<>"/dev/tcp/localhost/$PORT9"
+frame "OPEN|K2|" >&15
+sleep 0.2
+exec 15>&- 2>/dev/null
+sleep 0.3
+
+set -e
+
+echo
+echo "[test] killing nimd after T13 (pid=$SERVER_PID)"
+stop_nimd
+
+set +e
+
+# the times differ from run to run
+GAME1='p1="J1" p2="J2" board=1,3,5,7,9 winner=1 end=normal moves=5 events="0:1 F33/2 1:3 2:5 3:7 4:9"'
+GAME2='p1="K1" p2="K2" board=1,3,5,7,9 winner=1 end=disconnect moves=0 events=""'
+./nimjournal "$JOURNAL_DIR" | sed 's/^ts=[^ ]* //; s/ duration_ms=[0-9]*//' |
+    expect_text "nimjournal -> both games" "$GAME1
+$GAME2"
+
+# a record torn by a crash is reported and skipped
+SEGMENT=$(ls "$JOURNAL_DIR"/*.nj | tail -n 1)
+truncate -s -3 "$SEGMENT"
+./nimjournal "$JOURNAL_DIR" 2>"$JOURNAL_DIR/err" |
+    sed 's/^ts=[^ ]* //; s/ duration_ms=[0-9]*//' |
+    expect_text "torn last record -> only the first game" "$GAME1"
+grep -c "bad record" "$JOURNAL_DIR/err" |
+    expect_text "torn last record -> reported" "1"
+
+exec 12>&- 2>/dev/null
+exec 13>&- 2>/dev/null
+exec 14>&- 2>/dev/null
+
+set -e
+
+rm -rf "$JOURNAL_DIR"
+
+########################################
+# T14: the player table across a growth
+########################################
+
+PORT10=23465
+PLAYERS_FILE="/tmp/nimd_test_players.$$"
+echo
+echo "[test] starting nimd on port $PORT10 for T14"
+start_nimd "$PORT10" --players "$PLAYERS_FILE"
+
+echo
+echo "========================================"
+echo "[T14] A forfeit, then 600 new names -> expect every one in nimplayers"
+echo "========================================"
+
+set +e
+
+exec 12<>"/dev/tcp/localhost/$PORT10"
+frame "OPEN|G1|" >&12
+sleep 0.2
+exec 13<>"/dev/tcp/localhost/$PORT10"
+frame "OPEN|G2|" >&13
+sleep 0.2
+exec 13>&- 2>/dev/null
+expect_reply 12 "G1 -> WAIT, NAME, PLAY, OVER Forfeit" \
+    "$(frame "WAIT|")$(frame "NAME|1|G2|")$(frame "PLAY|1|1 3 5 7 9|")$(frame "OVER|1|1 3 5 7 9|Forfeit|")"
+exec 12>&- 2>/dev/null
+
+# the table starts at 1024 slots and grows once it is half full; each
+# name waits for its WAIT, so it has been added before the next OPEN
+for i in $(seq -w 0 599); do
+    exec 14<>"/dev/tcp/localhost/$PORT10"
+    frame "OPEN|P$i|" >&14
+    head -c 10 <&14 >/dev/null
+    exec 14>&- 2>/dev/null
+done
+
+set -e
+
+echo
+echo "[test] killing nimd after T14 (pid=$SERVER_PID)"
+stop_nimd
+
+set +e
+
+./nimplayers "$PLAYERS_FILE" | grep -c '^name="P[0-9]*" games=0 ' |
+    expect_text "nimplayers -> all 600 new names" "600"
+./nimplayers "$PLAYERS_FILE" G1 G2 |
+    expect_text "nimplayers G1 G2 -> the forfeit counted" \
+        'name="G1" games=1 wins=1 losses=0 forfeits=0
+name="G2" games=1 wins=0 losses=1 forfeits=1'
+
+set -e
+
+rm -f "$PLAYERS_FILE"
+
+########################################
+# T15: a custom starting board
+########################################
+
+PORT11=23466
+echo
+echo "[test] starting nimd on port $PORT11 for T15"
+start_nimd "$PORT11" --board 2x3,10,1
+
+echo
+echo "========================================"
+echo "[T15] --board 2x3,10,1 -> expect that board, kept as stones go"
+echo "========================================"
+
+set +e
+
+exec 12<>"/dev/tcp/localhost/$PORT11"
+frame "OPEN|C1|" >&12
+sleep 0.2
+exec 13<>"/dev/tcp/localhost/$PORT11"
+frame "OPEN|C2|" >&13
+expect_reply 12 "C1 -> WAIT, NAME, PLAY on the custom board" \
+    "$(frame "WAIT|")$(frame "NAME|1|C2|")$(frame "PLAY|1|3 3 10 1|")"
+
+# the board text gets one byte shorter
+frame "MOVE|2|1|" >&12
+expect_reply 13 "C2 -> WAIT, NAME, PLAY, then PLAY with 10 -> 9" \
+    "$(frame "WAIT|")$(frame "NAME|2|C1|")$(frame "PLAY|1|3 3 10 1|")$(frame "PLAY|2|3 3 9 1|")"
+
+exec 12>&- 2>/dev/null
+exec 13>&- 2>/dev/null
+
+set -e
+
+echo
+echo "[test] killing nimd after T15 (pid=$SERVER_PID)"
+stop_nimd
+
+set +e
+
+# an OVER with this board would not fit in a frame
+timeout 2 ./nimd --board 40x1000 "$PORT11" 2>&1 >/dev/null |
+    expect_text "--board 40x1000 -> refused at startup" \
+        "--board: the board text must fit in an NGP frame (at most 83 bytes)"
+
+set -e
+
+########################################
+# T16: the bot takes the empty seat
+########################################
+
+PORT12=23467
+echo
+echo "[test] starting nimd on port $PORT12 for T16"
+start_nimd "$PORT12" --bot-after 300 --bot-strength 100
+
+echo
+echo "========================================"
+echo "[T16] Alone for --bot-after 300 -> expect a game against nimbot"
+echo "========================================"
+
+set +e
+
+# the bot's seat is random; seated first, it empties the last pile
+exec 12<>"/dev/tcp/localhost/$PORT12"
+frame "OPEN|Solo|" >&12
+expect_reply 12 "Solo -> WAIT, NAME nimbot, PLAY" \
+    "$(frame "WAIT|")$(frame "NAME|1|nimbot|")$(frame "PLAY|1|1 3 5 7 9|")" \
+    "$(frame "WAIT|")$(frame "NAME|2|nimbot|")$(frame "PLAY|1|1 3 5 7 9|")$(frame "PLAY|2|1 3 5 7 0|")"
+
+exec 12>&- 2>/dev/null
+
+set -e
+
+echo
+echo "[test] killing nimd after T16 (pid=$SERVER_PID)"
+stop_nimd
+
+########################################
+# T17: rule variants, and moves the rules refuse
+########################################
+
+PORT13=23468
+
+echo
+echo "========================================"
+echo "[T17] --rules misere, subtract:1,3, moore:2 and FAIL 33 for bad amounts"
+echo "========================================"
+
+# start_pair FLAGS...: a fresh server with R1 (fd 12) and R2 (fd 13)
+# playing on it
+start_pair() {
+    echo "[test] starting nimd on port $PORT13 with $*"
+    start_nimd "$PORT13" "$@"
+    exec 12<>"/dev/tcp/localhost/$PORT13"
+    frame "OPEN|R1|" >&12
+    sleep 0.2
+    exec 13<>"/dev/tcp/localhost/$PORT13"
+    frame "OPEN|R2|" >&13
+    sleep 0.2
+}
+
+end_pair() {
+    exec 12>&- 2>/dev/null
+    exec 13>&- 2>/dev/null
+    stop_nimd
+}
+
+set +e
+
+# whoever takes the last stone loses
+start_pair --rules misere --board 1,1
+frame "MOVE|0|1|" >&12
+sleep 0.1
+frame "MOVE|1|1|" >&13
+expect_reply 12 "misere: R2 takes the last stone -> OVER, R1 wins" \
+    "$(frame "WAIT|")$(frame "NAME|1|R2|")$(frame "PLAY|1|1 1|")$(frame "PLAY|2|0 1|")$(frame "OVER|1|0 0||")"
+end_pair
+
+# 2 is not in the set; 3 is
+start_pair --rules subtract:1,3
+frame "MOVE|4|2|" >&12
+sleep 0.1
+frame "MOVE|4|3|" >&12
+expect_reply 12 "subtract:1,3: take 2 -> FAIL 33, take 3 -> PLAY" \
+    "$(frame "WAIT|")$(frame "NAME|1|R2|")$(frame "PLAY|1|1 3 5 7 9|")$(frame "FAIL|33 Quantity|")$(frame "PLAY|2|1 3 5 7 6|")"
+end_pair
+
+# two piles at once, but not three
+start_pair --rules moore:2
+frame "MOVE|3|1|4|2|" >&12
+sleep 0.1
+frame "MOVE|4|3|3|1|2|1|" >&13
+expect_reply 13 "moore:2: two piles -> PLAY, three piles -> FAIL 33" \
+    "$(frame "WAIT|")$(frame "NAME|2|R1|")$(frame "PLAY|1|1 3 5 7 9|")$(frame "PLAY|2|1 3 5 6 7|")$(frame "FAIL|33 Quantity|")"
+end_pair
+
+# 4294967299 is 3 past 2^32; one pile per move under plain Nim
+start_pair
+frame "MOVE|4|4294967299|" >&12
+sleep 0.1
+frame "MOVE|4|1|3|1|" >&12
+expect_reply 12 "nim: 2^32 + 3 stones -> FAIL 33, two piles -> FAIL 33" \
+    "$(frame "WAIT|")$(frame "NAME|1|R2|")$(frame "PLAY|1|1 3 5 7 9|")$(frame "FAIL|33 Quantity|")$(frame "FAIL|33 Quantity|")"
+end_pair
+
+set -e
+
+########################################
+# T18: spectators
+########################################
+
+PORT14=23469
+echo
+echo "[test] starting nimd on port $PORT14 for T18"
+start_nimd "$PORT14" --spectators 1
+
+echo
+echo "========================================"
+echo "[T18] SPEC on a live game, an unknown name and a full house (--spectators 1)"
+echo "========================================"
+
+set +e
+
+exec 14<>"/dev/tcp/localhost/$PORT14"
+frame "SPEC|Nobody|" >&14
+expect_reply 14 "SPEC for a name not playing -> FAIL 24" \
+    "$(frame "FAIL|24 Not Playing|")"
+expect_closed 14 "Nobody's spectator closed"
+
+exec 12<>"/dev/tcp/localhost/$PORT14"
+frame "OPEN|W1|" >&12
+sleep 0.2
+exec 13<>"/dev/tcp/localhost/$PORT14"
+frame "OPEN|W2|" >&13
+sleep 0.2
+frame "MOVE|0|1|" >&12
+sleep 0.2
+
+exec 15<>"/dev/tcp/localhost/$PORT14"
+frame "SPEC|W1|" >&15
+sleep 0.2
+exec 16<>"/dev/tcp/localhost/$PORT14"
+frame "SPEC|W2|" >&16
+expect_reply 16 "second spectator -> FAIL 25" "$(frame "FAIL|25 Lobby Full|")"
+expect_closed 16 "second spectator closed"
+
+for m in "13 MOVE|1|3|" "12 MOVE|2|5|" "13 MOVE|3|7|" "12 MOVE|4|9|"; do
+    frame "${m#* }" >&"${m%% *}"
+    sleep 0.1
+done
+expect_reply 15 "spectator -> the current PLAY, every later one, then OVER" \
+    "$(frame "PLAY|2|0 3 5 7 9|")$(frame "PLAY|1|0 0 5 7 9|")$(frame "PLAY|2|0 0 0 7 9|")$(frame "PLAY|1|0 0 0 0 9|")$(frame "OVER|1|0 0 0 0 0||")"
+expect_closed 15 "spectator closed after OVER"
+
+for fd in 12 13 14 15 16; do
+    eval "exec $fd>&-" 2>/dev/null
+done
+
+set -e
+
+echo
+echo "[test] killing nimd after T18 (pid=$SERVER_PID)"
+stop_nimd
+
+########################################
+# T19: an NGP v1 (binary) game
+########################################
+
+PORT15=23470
+echo
+echo "[test] starting nimd on port $PORT15 for T19"
+start_nimd "$PORT15"
+
+echo
+echo "========================================"
+echo "[T19] Two binary players -> expect v1 frames (0x01, length, type)"
+echo "========================================"
+
+set +e
+
+# OPEN is type 6 with a NUL-terminated name; WAIT 1, NAME 2, PLAY 3,
+# MOVE 7; a board is its pile count, then the piles
+exec 12<>"/dev/tcp/localhost/$PORT15"
+printf '\x01\x04\x06B1\x00' >&12
+expect_reply 12 "B1 -> WAIT" '\x01\x01\x01'
+
+exec 13<>"/dev/tcp/localhost/$PORT15"
+printf '\x01\x04\x06B2\x00' >&13
+expect_reply 13 "B2 -> WAIT, NAME, PLAY" \
+    '\x01\x01\x01\x01\x05\x02\x02B1\x00\x01\x08\x03\x01\x05\x01\x03\x05\x07\x09'
+expect_reply 12 "B1 -> NAME, PLAY" \
+    '\x01\x05\x02\x01B2\x00\x01\x08\x03\x01\x05\x01\x03\x05\x07\x09'
+
+printf '\x01\x03\x07\x00\x01' >&12
+expect_reply 12 "B1 MOVE 0 1 -> PLAY" \
+    '\x01\x08\x03\x02\x05\x00\x03\x05\x07\x09'
+expect_reply 13 "B2 -> PLAY" \
+    '\x01\x08\x03\x02\x05\x00\x03\x05\x07\x09'
+
+exec 12>&- 2>/dev/null
+exec 13>&- 2>/dev/null
+
+set -e
+
+echo
+echo "[test] killing nimd after T19 (pid=$SERVER_PID)"
+stop_nimd
+
+########################################
+# T20: two players on one multiplexed connection
+########################################
+
+PORT16=23471
+echo
+echo "[test] starting nimd on port $PORT16 for T20"
+start_nimd "$PORT16" --mux 4
+
+echo
+echo "========================================"
+echo "[T20] Sessions 0 and 1 on one connection -> expect them paired"
+echo "========================================"
+
+set +e
+
+# a tagged frame is 0x02, length, session id, then a v1 type and fields
+exec 12<>"/dev/tcp/localhost/$PORT16"
+printf '\x02\x05\x00\x06M0\x00' >&12
+expect_reply 12 "session 0 OPEN -> WAIT" '\x02\x02\x00\x01'
+
+printf '\x02\x05\x01\x06M1\x00' >&12
+expect_reply 12 "session 1 OPEN -> WAIT, NAME to both, PLAY to both" \
+    '\x02\x02\x01\x01\x02\x06\x00\x02\x01M1\x00\x02\x06\x01\x02\x02M0\x00\x02\x09\x00\x03\x01\x05\x01\x03\x05\x07\x09\x02\x09\x01\x03\x01\x05\x01\x03\x05\x07\x09'
+
+printf '\x02\x04\x00\x07\x00\x01' >&12
+expect_reply 12 "session 0 MOVE 0 1 -> PLAY to both" \
+    '\x02\x09\x00\x03\x02\x05\x00\x03\x05\x07\x09\x02\x09\x01\x03\x02\x05\x00\x03\x05\x07\x09'
+
+exec 12>&- 2>/dev/null
+
+set -e
+
+echo
+echo "[test] killing nimd after T20 (pid=$SERVER_PID)"
+stop_nimd
+
+########################################
+# T21: a hot upgrade hands over a live game
+########################################
+
+PORT17=23472
+UPGRADE_SOCK="/tmp/nimd_test_upgrade.$$"
+
+echo
+echo "========================================"
+echo "[T21] Second nimd with the same --upgrade -> expect the game to go on"
+echo "========================================"
+
+case " $NIMD_FLAGS " in
+*" --threads "*|*" --coroutines "*)
+    echo "skipped: games on threads or coroutines cannot be handed over"
+    ;;
+*)
+    echo "[test] starting nimd on port $PORT17 for T21"
+    start_nimd "$PORT17" --upgrade "$UPGRADE_SOCK"
+    OLD_PID=$SERVER_PID
+
+    set +e
+
+    exec 12<>"/dev/tcp/localhost/$PORT17"
+    frame "OPEN|U1|" >&12
+    sleep 0.2
+    exec 13<>"/dev/tcp/localhost/$PORT17"
+    frame "OPEN|U2|" >&13
+    sleep 0.2
+    frame "MOVE|0|1|" >&12
+    expect_reply 12 "U1 -> WAIT, NAME, PLAY, PLAY" \
+        "$(frame "WAIT|")$(frame "NAME|1|U2|")$(frame "PLAY|1|1 3 5 7 9|")$(frame "PLAY|2|0 3 5 7 9|")"
+    expect_reply 13 "U2 -> WAIT, NAME, PLAY, PLAY" \
+        "$(frame "WAIT|")$(frame "NAME|2|U1|")$(frame "PLAY|1|1 3 5 7 9|")$(frame "PLAY|2|0 3 5 7 9|")"
+
+    echo "[test] starting the new nimd on port $PORT17"
+    start_nimd "$PORT17" --upgrade "$UPGRADE_SOCK"
+    if kill -0 "$OLD_PID" 2>/dev/null; then
+        echo "MISMATCH: the old nimd (pid=$OLD_PID) is still running"
+        FAILURES=$((FAILURES + 1))
+        kill "$OLD_PID" 2>/dev/null
+    else
+        echo "ok: the old nimd has exited"
+    fi
+    wait "$OLD_PID" 2>/dev/null
+
+    frame "MOVE|1|3|" >&13
+    expect_reply 13 "U2 MOVE after the upgrade -> PLAY" \
+        "$(frame "PLAY|1|0 0 5 7 9|")"
+    expect_reply 12 "U1 -> PLAY" "$(frame "PLAY|1|0 0 5 7 9|")"
+
+    exec 12>&- 2>/dev/null
+    exec 13>&- 2>/dev/null
+
+    set -e
+
+    echo
+    echo "[test] killing nimd after T21 (pid=$SERVER_PID)"
+    stop_nimd
+    rm -f "$UPGRADE_SOCK"
+    ;;
+esac
+
 echo
+if [ "$FAILURES" -gt 0 ]; then
+    echo "[test] finished: $FAILURES mismatch(es)."
+    exit 1
+fi
 echo "[test] finished."
@@ -0,0 +1,169 @@
+#include <stddef.h>
+
+#include "wheel.h"
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+
+/* ticks covered by the whole wheel; later deadlines are clamped */
+#define WHEEL_SPAN (1LL << (WHEEL_BITS * WHEEL_LEVELS))
+
+void wheel_init(wheel_t *w, long long now_ms) {
+    w->now = now_ms;
+    w->count = 0;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        for (int i = 0; i < WHEEL_SLOTS; i++) {
+            w->slots[l][i] = NULL;
+        }
+        w->occupied[l] = 0;
+    }
+    w->due = NULL;
+}
+
+void wheel_timer_init(wheel_timer_t *t, wheel_fn fire) {
+    t->expires = 0;
+    t->fire = fire;
+    t->prev = t->next = NULL;
+    t->slot = NULL;
+    t->wheel = NULL;
+}
+
+int wheel_armed(const wheel_timer_t *t) {
+    return t->slot != NULL;
+}
+
+static void list_push(wheel_timer_t **head, wheel_timer_t *t) {
+    t->prev = NULL;
+    t->next = *head;
+    if (*head) (*head)->prev = t;
+    *head = t;
+    t->slot = head;
+}
+
+/* unlink t from its list, keeping the occupied bits in step */
+static void list_remove(wheel_t *w, wheel_timer_t *t) {
+    if (t->prev) t->prev->next = t->next;
+    else *t->slot = t->next;
+    if (t->next) t->next->prev = t->prev;
+
+    if (*t->slot == NULL && t->slot != &w->due) {
+        ptrdiff_t n = t->slot - &w->slots[0][0];
+        w->occupied[n / WHEEL_SLOTS] &= ~(1ULL << (n % WHEEL_SLOTS));
+    }
+    t->prev = t->next = NULL;
+    t->slot = NULL;
+}
+
+/* file t by how far away it is: level l holds deadlines less than
+   64^(l+1) ticks ahead, in the slot for bits [6l, 6l+6) of the tick.
+   Nothing is filed before tick `earliest`: the current tick's slot
+   has already fired unless a cascade is re-filing into it. */
+static void place(wheel_t *w, wheel_timer_t *t, long long earliest) {
+    long long at = t->expires;
+    if (at < earliest) at = earliest;
+    long long delta = at - w->now;
+    if (delta >= WHEEL_SPAN) {
+        at = w->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+
+    int l = 0;
+    while (l < WHEEL_LEVELS - 1 && delta >= (1LL << (WHEEL_BITS * (l + 1)))) {
+        l++;
+    }
+    int i = (int)((at >> (WHEEL_BITS * l)) & SLOT_MASK);
+    list_push(&w->slots[l][i], t);
+    w->occupied[l] |= 1ULL << i;
+}
+
+void wheel_arm(wheel_t *w, wheel_timer_t *t, long long expires_ms) {
+    if (t->slot) wheel_cancel(t);
+    t->expires = expires_ms;
+    t->wheel = w;
+    place(w, t, w->now + 1);
+    w->count++;
+}
+
+void wheel_cancel(wheel_timer_t *t) {
+    if (!t->slot) return;
+    list_remove(t->wheel, t);
+    t->wheel->count--;
+}
+
+/* re-file every timer in level l's current slot into lower levels;
+   when that slot is 0 the level above has wrapped too */
+static void cascade(wheel_t *w, int l) {
+    int i = (int)((w->now >> (WHEEL_BITS * l)) & SLOT_MASK);
+    if (i == 0 && l + 1 < WHEEL_LEVELS) {
+        cascade(w, l + 1);
+    }
+    wheel_timer_t *t = w->slots[l][i];
+    w->slots[l][i] = NULL;
+    w->occupied[l] &= ~(1ULL << i);
+    while (t) {
+        wheel_timer_t *next = t->next;
+        place(w, t, w->now);
+        t = next;
+    }
+}
+
+void wheel_advance(wheel_t *w, long long now_ms, void *ctx) {
+    while (w->now < now_ms) {
+        if (w->occupied[0] == 0) {
+            /* nothing can fire before level 0 wraps: skip ahead */
+            long long last = w->now | SLOT_MASK;
+            if (w->count == 0 || last >= now_ms) {
+                w->now = now_ms;
+                break;
+            }
+            w->now = last;
+        }
+
+        w->now++;
+        if ((w->now & SLOT_MASK) == 0) {
+            cascade(w, 1);
+        }
+
+        /* move the slot to the due list first: a callback may arm or
+           cancel any timer, including others in this slot */
+        int i = (int)(w->now & SLOT_MASK);
+        wheel_timer_t *t = w->slots[0][i];
+        w->slots[0][i] = NULL;
+        w->occupied[0] &= ~(1ULL << i);
+        while (t) {
+            wheel_timer_t *next = t->next;
+            list_push(&w->due, t);
+            t = next;
+        }
+
+        while (w->due) {
+            t = w->due;
+            list_remove(w, t);
+            if (t->expires > w->now) {
+                /* clamped past the wheel's span; not due yet */
+                place(w, t, w->now + 1);
+                continue;
+            }
+            w->count--;
+            t->fire(t, ctx);
+        }
+    }
+}
+
+int wheel_timeout(const wheel_t *w, long long now_ms) {
+    if (w->count == 0) return -1;
+
+    /* next tick with a level-0 timer, else the next level-0 wrap, when
+       higher levels cascade */
+    long long next = (w->now | SLOT_MASK) + 1;
+    uint64_t bits = w->occupied[0];
+    if (bits) {
+        int from = (int)((w->now + 1) & SLOT_MASK);
+        uint64_t rot = (bits >> from) | (from ? bits << (WHEEL_SLOTS - from) : 0);
+        long long at = w->now + 1 + __builtin_ctzll(rot);
+        if (at < next) next = at;
+    }
+
+    long long ms = next - now_ms;
+    if (ms < 0) return 0;
+    return (ms > 0x7fffffffLL) ? 0x7fffffff : (int)ms;
+}
@@ -0,0 +1,60 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+
+// Hierarchical timing wheel with millisecond ticks. Four levels of 64
+// slots cover about 4.6 hours; later deadlines wait in the top level
+// and are re-filed as they come into range. Arming and cancelling are
+// O(1), and advancing does work only for slots that hold timers, so a
+// wheel can carry hundreds of thousands of timers. Not thread-safe:
+// each event loop owns its own wheel.
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+
+typedef struct wheel_timer wheel_timer_t;
+typedef struct wheel wheel_t;
+
+// Called once when a timer expires; the timer is no longer armed and
+// may be re-armed. ctx is the pointer given to wheel_advance.
+typedef void (*wheel_fn)(wheel_timer_t *t, void *ctx);
+
+struct wheel_timer {
+    long long expires;        // ms, same clock as wheel_advance
+    wheel_fn fire;
+    wheel_timer_t *prev;
+    wheel_timer_t *next;
+    wheel_timer_t **slot;     // list holding the timer; NULL if idle
+    wheel_t *wheel;
+};
+
+struct wheel {
+    long long now;            // last tick processed
+    long count;               // armed timers
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t occupied[WHEEL_LEVELS];   // bit per non-empty slot
+    wheel_timer_t *due;       // expired, not yet fired
+};
+
+void wheel_init(wheel_t *w, long long now_ms);
+
+void wheel_timer_init(wheel_timer_t *t, wheel_fn fire);
+
+// Arm (or re-arm) t to fire at expires_ms
+void wheel_arm(wheel_t *w, wheel_timer_t *t, long long expires_ms);
+
+// Disarm t; harmless if it is not armed
+void wheel_cancel(wheel_timer_t *t);
+
+int wheel_armed(const wheel_timer_t *t);
+
+// Fire every timer due at or before now_ms, in tick order
+void wheel_advance(wheel_t *w, long long now_ms, void *ctx);
+
+// Milliseconds from now_ms until the wheel next needs advancing,
+// or -1 if no timers are armed (suits an epoll_wait timeout)
+int wheel_timeout(const wheel_t *w, long long now_ms);
+
+#endif
@@ -0,0 +1,49 @@
+#include "wire.h"
+
+size_t wire_varint_len(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+void *wire_put_varint(void *p, uint64_t v) {
+    unsigned char *q = p;
+    while (v >= 0x80) {
+        *q++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *q++ = (unsigned char)v;
+    return q;
+}
+
+const void *wire_get_varint(const void *p, const void *end, uint64_t *v) {
+    const unsigned char *q = p;
+    uint64_t x = 0;
+    for (int shift = 0; q < (const unsigned char *)end && shift < 64;
+         shift += 7) {
+        unsigned char b = *q++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return q;
+        }
+    }
+    return NULL;
+}
+
+void wire_put_u32(void *p, uint32_t v) {
+    unsigned char *q = p;
+    q[0] = (unsigned char)v;
+    q[1] = (unsigned char)(v >> 8);
+    q[2] = (unsigned char)(v >> 16);
+    q[3] = (unsigned char)(v >> 24);
+}
+
+uint32_t wire_get_u32(const void *p) {
+    const unsigned char *q = p;
+    return (uint32_t)q[0] | (uint32_t)q[1] << 8
+         | (uint32_t)q[2] << 16 | (uint32_t)q[3] << 24;
+}
@@ -0,0 +1,29 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Byte encodings shared by NGP v1 frames (ngp.c), the journal
+// (journal.c, nimjournal.c) and the hot upgrade handoff (handoff.c):
+// unsigned LEB128 varints, 7 bits a byte, low bits first, with the
+// high bit set on every byte but the last; and little-endian 32-bit
+// words.
+
+#define WIRE_VARINT_MAX 10   // bytes in the longest 64-bit varint
+
+// Bytes v takes as a varint
+size_t wire_varint_len(uint64_t v);
+
+// Write v as a varint at p, which has room for wire_varint_len(v)
+// bytes; returns the byte after it
+void *wire_put_varint(void *p, uint64_t v);
+
+// Read the varint at p into *v; returns the byte after it, or NULL if
+// it runs past end or is longer than WIRE_VARINT_MAX bytes
+const void *wire_get_varint(const void *p, const void *end, uint64_t *v);
+
+void wire_put_u32(void *p, uint32_t v);
+uint32_t wire_get_u32(const void *p);
+
+#endif